@@ -1,6 +1,9 @@
 /* for fsync in glibc up to and including 2.15 */
 /* for realpath */
-#define _XOPEN_SOURCE 500
+/* 600 for posix_fadvise */
+#define _XOPEN_SOURCE 600
+/* for syscall */
+#define _DEFAULT_SOURCE
 
 #include "afs.h"
 #include "panic.h"
@@ -9,23 +12,40 @@
 #include <limits.h> /* for PATH_MAX */
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h> /* for rename */
 #include <fcntl.h>
-#include <sys/socket.h> /* for socketpair */
+#include <sys/socket.h> /* for socketpair, SCM_RIGHTS */
 #include <sys/wait.h> /* for waitpid */
 #include <sys/mman.h> /* for mmap, munmap */
-#include <sys/stat.h> /* for mkdir */
+#include <sys/uio.h> /* for writev, pwritev */
+#include <sys/stat.h> /* for mkdir, fstat */
+#include <sys/syscall.h> /* for SYS_io_uring_setup */
+#include <sys/timerfd.h> /* XXX: linux specific; for the group commit window */
+#include <time.h> /* for clock_gettime */
+
+#ifdef SOB_AFS_URING
+/* XXX: linux specific; needs the uapi headers of linux 5.15 or newer */
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#endif
 
 struct afs_ev {
     enum afs_event ty;
     int fd;
+    unsigned long tag;
     union {
         struct {
             size_t len; /* always equal to requested if not fail */
-        } write; /* also used for write_fsync_close */
+        } write; /* also used for write_fsync_close and replace */
         struct {
             size_t len;
+            size_t off; /* only for afs_readall_stream */
             const char * data;
         } readall;
+        struct {
+            size_t len;
+            const char * data; /* NULL for an empty file */
+        } map;
     } d;
 };
 
@@ -38,7 +58,12 @@ enum proc_cmd_ {
     proc_cmd_write_,
     proc_cmd_readall_,
     proc_cmd_mkdir_,
-    proc_cmd_write_fsync_close_
+    proc_cmd_write_fsync_close_,
+    proc_cmd_readall_stream_,
+    proc_cmd_map_,
+    proc_cmd_group_sync_, /* for write_len held fsyncs from held[buf_off] */
+    proc_cmd_writev_,
+    proc_cmd_replace_
 };
 enum proc_res_ {
     proc_res_none_ = 0,
@@ -47,65 +72,210 @@ enum proc_res_ {
 };
 enum proc_child_st_ {
     proc_child_st_not_started_ = 0,
-    proc_child_st_idle_ = 1,
-    proc_child_st_busy_ = 2
+    proc_child_st_running_
 };
-struct proc_shared_ {
-    /* modified by parent */
+/* a cmd queued for a worker; rw_buf of its slot is read when it runs */
+struct proc_sqe_ {
     enum proc_cmd_ cmd;
+    size_t slot; /* unused for proc_cmd_exit_ */
+    unsigned long tag;
+    size_t buf_off; /* data of a write starts at rw_buf + buf_off */
     size_t write_len;
     int open_flags;
-
-    /* modified by child */
+    struct afs_slice slices[SOB_AFS_SLICES_MAX]; /* of a writev */
+    size_t slices_len;
+    long long write_off; /* of a writev; -1 for the file position */
+};
+/* result of the sqe with the same index */
+struct proc_cqe_ {
     enum proc_res_ res;
-    enum proc_child_st_ st;
     size_t written;
     size_t read_len;
     struct sob_fail fail;
 };
+/* a filled part of the stream of proc_cmd_readall_stream_ */
+struct proc_chunk_ {
+    size_t sqe; /* index of the stream cmd, not modulo sqes_len */
+    size_t off;
+    size_t len;
+};
+/* followed by sqes_len sqes, as many cqes and chunks_len chunks.
+ * the child runs sqes in order, so the result of sqe i is cqe i, and the
+ * parent never has more than sqes_len cmds that are not reaped yet.
+ * only one stream runs at a time, so its chunks ring is per worker.
+ * both sides only sleep in read() after announcing it in the flags */
+struct proc_shared_ {
+    /* modified by parent */
+    size_t sq_tail; /* sqes submitted so far */
+    size_t stream_head; /* chunks released so far */
+
+    /* modified by child */
+    size_t cq_tail; /* cqes completed so far */
+    size_t stream_tail; /* chunks filled so far */
+    int is_child_asleep;
+    enum proc_child_st_ st;
+    struct sob_fail fail;
+
+    /* set by child, cleared by parent when it starts reaping */
+    int is_parent_notified;
+};
 
 enum {
     /* best guess; remember that page size on a different target may differ */
-    rw_buf_len_ = PAGESIZE * 3 - sizeof(struct proc_shared_),
-    proc_evs_maxlen_ = 3,
-    evs_pfds_prealloc_len_ = 2,
+    rw_buf_len_ = PAGESIZE * 3,
+    /* init, stop and a spare one on top of one per sqe and chunk */
+    proc_evs_extra_len_ = 3,
+    pool_default_maxlen_ = 4,
+    pool_default_slots_len_ = 8,
+    pool_default_fds_maxlen_ = 1024,
+    pool_default_queue_depth_ = 4,
+    pool_default_chunks_len_ = 4,
+    pool_default_chunk_len_ = 64 * 1024
 };
 
 enum proc_st_ {
     proc_st_uninit_ = 0,
     proc_st_init_pend_,
     proc_st_avail_,
-    proc_st_busy_,
     proc_st_dead_
 };
 
+enum proc_slot_st_ {
+    proc_slot_st_free_ = 0,
+    proc_slot_st_used_,
+    proc_slot_st_closing_ /* a cmd that releases the afs fd is queued */
+};
+
+struct proc_slot_ctl_ {
+    enum proc_slot_st_ st;
+    int afs_fd; /* only used to tag events */
+    size_t queued;
+    int is_readall_queued; /* both would read into the same rw_buf */
+    int is_fsync_held; /* by the group commit, not submitted yet */
+};
+
+/* an afs_fsync waiting for the group commit of its worker; in the shared
+ * pages, so the child finds the fds of a batch here */
+struct proc_held_ {
+    size_t slot;
+    unsigned long tag;
+    enum proc_res_ res; /* of the fdatasync of its file, set by the child */
+};
+
+/* a long-lived worker; serves up to slots_len afs fds with up to
+ * queue_depth cmds queued per fd */
 struct proc_ {
     struct sob_fail fail;
     int is_stop_req;
     enum proc_st_ st;
-    struct afs_ev evs[proc_evs_maxlen_];
+    struct afs_ev * evs; /* sqes_len + proc_evs_extra_len_ */
     size_t evs_len;
     struct proc_shared_ * shared;
-    void * rw_buf;
+    struct proc_sqe_ * sqes;
+    struct proc_cqe_ * cqes;
+    size_t sqes_len; /* slots_len * queue_depth + 1 for proc_cmd_exit_ */
+    size_t sq_tail;
+    size_t cq_head; /* cqes reaped so far */
+    size_t queue_depth;
+    struct proc_chunk_ * chunks;
+    char * chunks_mem;
+    size_t chunks_len;
+    size_t chunk_len;
+    size_t stream_head; /* chunks released so far */
+    size_t stream_seen; /* chunks turned into evs so far */
+    int * map_fds; /* sqes_len; received from the child, not mapped yet */
+    size_t map_fds_head;
+    size_t map_fds_len;
+    int is_group; /* fsyncs are held until proc_group_flush_ */
+    struct proc_held_ * held; /* sqes_len; a fifo, oldest first */
+    size_t held_head;
+    size_t held_len;
+    size_t held_unflushed; /* the newest ones, not in a sync yet */
+    char * slots_mem;
+    size_t slot_stride;
     size_t rw_buf_len;
+    struct proc_slot_ctl_ * slots;
+    size_t slots_len;
+    size_t slots_used;
     void * mmap_start;
     size_t mmap_len;
     pid_t pid;
     int fd;
 };
 
+/* what the child sees of its proc_ */
+struct proc_child_ {
+    int parent_fd;
+    struct proc_shared_ * s;
+    const struct proc_sqe_ * sqes;
+    struct proc_cqe_ * cqes;
+    size_t sqes_len;
+    struct proc_chunk_ * chunks;
+    char * chunks_mem;
+    size_t chunks_len;
+    size_t chunk_len;
+    struct proc_held_ * held;
+    char * slots_mem;
+    size_t slot_stride;
+    size_t slots_len;
+};
+
+struct ring_;
+
+/* an entry of the afs fd table; the afs fd is gen * ps_len + its index,
+ * so a stale afs fd of a reused entry does not match */
 struct ps_ {
-    int fd;
-    struct proc_ p;
-    struct ps_ * next;
-    enum proc_cmd_ cmd_after_init;
-    int is_avail;
+    int fd; /* -1 when free */
+    struct proc_ * p; /* NULL with afs_backend_uring */
+    size_t slot;
+    size_t gen; /* bumped when freed */
+    size_t next_free;
+
+    /* while all slots are used; see ps_wait_bind_ */
+    struct proc_sqe_ * wait_sqes; /* queue_depth; NULL once it has a slot */
+    char * wait_buf; /* its rw_buf till then, after the sqes */
+    struct proc_slot_ctl_ wait_ctl; /* checks the cmds as a slot would */
+    struct ps_ * wait_next;
 };
 
 struct afs_ctx {
     struct sob_fail fail;
     int is_stop_req;
+    enum afs_backend backend;
+
+    /* fds_maxlen, or one per fd the pool can serve if more; allocated
+     * with it. the ones beyond the slots wait in a fifo for one */
     struct ps_ * ps;
+    size_t ps_len;
+    size_t ps_free; /* head of the free list; ps_len if none */
+    size_t ps_gens; /* so that afs fds fit in an int */
+    size_t fds_maxlen;
+    size_t slots_used; /* of the workers or of the ring */
+    struct ps_ * wait_head;
+    struct ps_ * wait_tail;
+
+    /* NULL until the first fd is allocated; only one of them is used */
+    struct ring_ * ring;
+    struct proc_ * procs;
+    size_t procs_maxlen;
+    size_t slots_len;
+    size_t queue_depth;
+    size_t chunks_len;
+    size_t chunk_len;
+    size_t prefork_len; /* idle workers to keep spawned */
+    unsigned long tag; /* for cmds submitted from now on */
+    struct proc_slot_ctl_ * slot_ctls;
+    struct afs_ev * proc_evs;
+    int * map_fds;
+
+    /* group commit; window_us is -1 when off */
+    long group_window_us;
+    int group_timer_fd;
+    int is_group_armed; /* some fsyncs are held */
+    size_t group_held;
+    unsigned long group_first_us;
+    unsigned long group_start_sum_us;
+    struct afs_group_stats group_stats;
 
     struct pollfd * pfds;
     size_t pfds_maxlen;
@@ -118,7 +288,7 @@ struct afs_ctx {
 /* undef at the bottom */
 #define SOB_AFS_FAIL_(msg) SOB_FAIL_INIT(&c->fail, msg);
 #define SOB_AFS_PROC_FAIL_(msg) SOB_FAIL_INIT(&p->fail, msg);
-#define SOB_AFS_PROC_C_FAIL_(msg) SOB_FAIL_INIT(&s->fail, msg);
+#define SOB_AFS_PROC_C_FAIL_(msg) SOB_FAIL_INIT(&cq->fail, msg);
 #define SOB_AFS_PROC_CHECK_EV_(stmt) \
     do { \
         if ((stmt) == NULL) { \
@@ -127,12 +297,39 @@ struct afs_ctx {
         } \
     } while (0)
 
-static struct ps_ * maybe_alloc_ps_(struct afs_ctx * c, int * was_init_out);
-static struct ps_ * ps_add_(struct afs_ctx * c);
+static enum afs_res pool_alloc_(struct afs_ctx * c);
+static void pool_free_(struct afs_ctx * c);
+static struct proc_ * pool_pick_(struct afs_ctx * c);
+static void pool_refill_(struct afs_ctx * c, size_t spawn_maxlen);
+
+static struct ps_ * ps_alloc_(struct afs_ctx * c);
+static int ps_bind_(struct afs_ctx * c, struct ps_ * ps, int fd);
+static int ps_wait_(struct afs_ctx * c, struct ps_ * ps);
+static void ps_unwait_(struct afs_ctx * c, struct ps_ * ps);
+static void ps_wait_bind_(struct afs_ctx * c);
+static void * ps_buf_(const struct afs_ctx * c, const struct ps_ * ps);
+static size_t ps_buf_len_(const struct afs_ctx * c, const struct ps_ * ps);
+static enum afs_res ps_submit_(struct afs_ctx * c,
+    struct ps_ * ps, struct proc_sqe_ * q);
+static enum afs_res ps_send_(struct afs_ctx * c,
+    struct ps_ * ps, const struct proc_sqe_ * q);
 static enum afs_res ps_del_(struct afs_ctx * c, int fd);
+static void ps_del_proc_(struct afs_ctx * c, const struct proc_ * p);
 static struct ps_ * ps_get_(struct afs_ctx * c, int fd);
-static int ps_next_fd_(struct afs_ctx * c);
-static size_t ps_len_(struct afs_ctx * c);
+static void ps_free_(struct afs_ctx * c, struct ps_ * ps);
+
+static void sqe_init_(struct proc_sqe_ * q, enum proc_cmd_ cmd);
+static int is_release_cmd_(enum proc_cmd_ cmd);
+static int slot_ctl_queue_(struct proc_slot_ctl_ * ctl,
+    enum proc_cmd_ cmd, size_t queue_depth, struct sob_fail * fail);
+static void slot_ctl_done_(struct proc_slot_ctl_ * ctl, enum proc_cmd_ cmd);
+static void cqe_ev_(struct afs_ev * ev, const struct proc_sqe_ * q,
+    const struct proc_cqe_ * cq, void * rw_buf);
+static int map_fd_(int fd, struct afs_ev * ev, struct sob_fail * fail);
+static size_t iov_init_(struct iovec * iov, const struct proc_sqe_ * q,
+    char * rw_buf);
+static struct iovec * iov_skip_(struct iovec * iov, size_t * iov_len,
+    size_t len);
 
 static enum afs_res proc_init_(struct proc_ * p);
 static enum afs_res proc_update_(struct proc_ * p,
@@ -142,38 +339,87 @@ static enum afs_res proc_stop_(struct proc_ * p);
 static size_t proc_evs_(struct proc_ * p, struct afs_ev ** evs_out);
 static int proc_fd_(const struct proc_ * p);
 
-static enum afs_res proc_open_(struct proc_ * p);
-static enum afs_res proc_close_(struct proc_ * p);
-static enum afs_res proc_fsync_(struct proc_ * p);
-static enum afs_res proc_write_(struct proc_ * p);
-static enum afs_res proc_readall_(struct proc_ * p);
-static enum afs_res proc_mkdir_(struct proc_ * p);
-static enum afs_res proc_write_fsync_close_(struct proc_ * p);
-
-static enum afs_res proc_update_init_pend_(struct proc_ * p, short revents);
-static enum afs_res proc_update_busy_(struct proc_ * p, short revents);
-static enum afs_res proc_update_avail_(struct proc_ * p, short revents);
+static int proc_slot_alloc_(struct proc_ * p, int afs_fd, size_t * slot_out);
+static void proc_slot_free_(struct proc_ * p, size_t slot);
+static void * proc_slot_buf_(const struct proc_ * p, size_t slot);
+static enum afs_res proc_submit_(struct proc_ * p,
+    size_t slot, const struct proc_sqe_ * q);
+static enum afs_res proc_push_(struct proc_ * p);
+static enum afs_res proc_reap_(struct proc_ * p);
+static enum afs_res proc_reap_chunks_(struct proc_ * p,
+    size_t stream_tail, size_t sqe);
+static void proc_release_chunks_(struct proc_ * p);
+static size_t proc_group_flush_(struct proc_ * p);
+static enum afs_res proc_reap_held_(struct proc_ * p,
+    const struct proc_sqe_ * q, const struct proc_cqe_ * cq);
+static enum afs_res proc_recv_(struct proc_ * p);
+static int proc_map_(struct proc_ * p, struct afs_ev * ev);
+
+static enum afs_res proc_update_live_(struct proc_ * p, short revents);
 static enum afs_res proc_update_dead_(struct proc_ * p);
 
-static enum afs_res proc_send_cmd_(struct proc_ * p, enum proc_cmd_ cmd);
 static enum afs_res proc_notify_child_(struct proc_ * p);
+static enum afs_res proc_die_(struct proc_ * p);
 static void proc_destroy_child_(struct proc_ * p);
-static struct afs_ev * proc_add_ev_(struct proc_ * p, enum afs_event ty);
-
-static int proc_child_worker_(int fd,
-    struct proc_shared_ * s, void * rw_buf, size_t rw_buf_len);
-static enum proc_res_ proc_child_open_(struct proc_shared_ * s, int * fd,
-    void * rw_buf, size_t rw_buf_len);
-static enum proc_res_ proc_child_close_(struct proc_shared_ * s, int * fd);
-static enum proc_res_ proc_child_fsync_(struct proc_shared_ * s, int fd);
-static enum proc_res_ proc_child_write_(struct proc_shared_ * s, int fd,
-    void * rw_buf, size_t rw_buf_len);
-static enum proc_res_ proc_child_readall_(struct proc_shared_ * s, int fd,
-    void * rw_buf, size_t rw_buf_len);
-static enum proc_res_ proc_child_mkdir_(struct proc_shared_ * s,
-    void * rw_buf, size_t rw_buf_len);
-static enum proc_res_ proc_child_write_fsync_close_(struct proc_shared_ * s,
-    void * rw_buf, size_t rw_buf_len);
+static struct afs_ev * proc_add_ev_(struct proc_ * p,
+    enum afs_event ty, int afs_fd, unsigned long tag);
+
+static enum afs_res ring_init_(struct ring_ ** r_out,
+    size_t slots_len, size_t queue_depth, size_t chunk_len, int is_group,
+    struct sob_fail * fail_out);
+static void ring_destroy_(struct ring_ * r);
+static size_t ring_group_flush_(struct ring_ * r);
+static int ring_is_held_(const struct ring_ * r);
+static enum afs_res ring_update_(struct ring_ * r,
+    const struct pollfd * fds, size_t fds_len);
+static size_t ring_evs_(struct ring_ * r, struct afs_ev ** evs_out);
+static int ring_fd_(const struct ring_ * r);
+static int ring_is_idle_(const struct ring_ * r);
+static void ring_flush_(struct ring_ * r);
+static void ring_wake_(struct ring_ * r);
+static const struct sob_fail * ring_fail_(const struct ring_ * r);
+static int ring_slot_alloc_(struct ring_ * r, int afs_fd, size_t * slot_out);
+static void ring_slot_free_(struct ring_ * r, size_t slot);
+static void * ring_slot_buf_(const struct ring_ * r, size_t slot);
+static size_t ring_buf_len_(const struct ring_ * r);
+static enum afs_res ring_submit_(struct ring_ * r,
+    size_t slot, const struct proc_sqe_ * q);
+
+static int proc_child_worker_(const struct proc_child_ * ch);
+static int proc_child_notify_(const struct proc_child_ * ch);
+static int proc_child_sleep_(const struct proc_child_ * ch,
+    const size_t * watch, size_t val);
+static enum proc_res_ proc_child_cmd_(const struct proc_child_ * ch,
+    size_t sqe, struct proc_cqe_ * cq, int * fd);
+static enum proc_res_ proc_child_open_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int * fd, char * rw_buf, size_t rw_buf_len);
+static enum proc_res_ proc_child_close_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int * fd);
+static enum proc_res_ proc_child_fsync_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int fd);
+static enum proc_res_ proc_child_write_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int fd, char * rw_buf, size_t rw_buf_len);
+static enum proc_res_ proc_child_writev_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int fd, char * rw_buf);
+static enum proc_res_ proc_child_readall_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int fd, char * rw_buf, size_t rw_buf_len);
+static enum proc_res_ proc_child_mkdir_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, char * rw_buf, size_t rw_buf_len);
+static enum proc_res_ proc_child_write_fsync_close_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, char * rw_buf, size_t rw_buf_len);
+static enum proc_res_ proc_child_replace_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, char * rw_buf, size_t rw_buf_len);
+static enum proc_res_ proc_child_stream_(const struct proc_child_ * ch,
+    size_t sqe, struct proc_cqe_ * cq, int fd);
+static enum proc_res_ proc_child_map_(const struct proc_child_ * ch,
+    const struct proc_sqe_ * q, struct proc_cqe_ * cq, char * rw_buf);
+static enum proc_res_ proc_child_group_sync_(const struct proc_child_ * ch,
+    const struct proc_sqe_ * q, struct proc_cqe_ * cq, const int * fds);
+
+static void group_arm_(struct afs_ctx * c);
+static void group_hold_(struct afs_ctx * c);
+static void group_flush_(struct afs_ctx * c);
+static unsigned long group_now_us_(void);
 
 static enum afs_event proc_cmd_fail_ev_(enum proc_cmd_ cmd);
 
@@ -182,10 +428,37 @@ struct sob_fail * afs_get_fail(struct afs_ctx * c)
     return &c->fail;
 }
 
-void afs_init(struct afs_ctx * c)
+void afs_init(struct afs_ctx * c, enum afs_backend backend)
 {
     c->is_stop_req = 0;
+    c->backend = backend;
     c->ps = NULL;
+    c->ps_len = 0;
+    c->ps_free = 0;
+    c->ps_gens = 0;
+    c->fds_maxlen = pool_default_fds_maxlen_;
+    c->slots_used = 0;
+    c->wait_head = NULL;
+    c->wait_tail = NULL;
+    c->ring = NULL;
+    c->procs = NULL;
+    c->procs_maxlen = pool_default_maxlen_;
+    c->slots_len = pool_default_slots_len_;
+    c->queue_depth = pool_default_queue_depth_;
+    c->chunks_len = pool_default_chunks_len_;
+    c->chunk_len = pool_default_chunk_len_;
+    c->prefork_len = 0;
+    c->tag = 0;
+    c->slot_ctls = NULL;
+    c->proc_evs = NULL;
+    c->map_fds = NULL;
+    c->group_window_us = -1;
+    c->group_timer_fd = -1;
+    c->is_group_armed = 0;
+    c->group_held = 0;
+    c->group_first_us = 0;
+    c->group_start_sum_us = 0;
+    memset(&c->group_stats, 0, sizeof(c->group_stats));
     c->pfds = NULL;
     c->pfds_maxlen = 0;
     c->pfds_len = 0;
@@ -194,6 +467,114 @@ void afs_init(struct afs_ctx * c)
     c->evs_len = 0;
 }
 
+enum afs_backend afs_get_backend(const struct afs_ctx * c)
+{
+    return c->backend;
+}
+
+enum afs_res afs_set_pool(struct afs_ctx * c,
+    size_t workers_maxlen, size_t fds_per_worker)
+{
+    if (c->procs != NULL || c->ring != NULL) {
+        SOB_AFS_FAIL_("pool is already in use (no errno)");
+        return afs_fail;
+    }
+    if (workers_maxlen == 0 || fds_per_worker == 0) {
+        SOB_AFS_FAIL_("empty pool (no errno)");
+        return afs_fail_bad_arg;
+    }
+    c->procs_maxlen = workers_maxlen;
+    c->slots_len = fds_per_worker;
+    return afs_ok;
+}
+
+enum afs_res afs_set_fds_maxlen(struct afs_ctx * c, size_t fds_maxlen)
+{
+    if (c->procs != NULL || c->ring != NULL) {
+        SOB_AFS_FAIL_("pool is already in use (no errno)");
+        return afs_fail;
+    }
+    if (fds_maxlen == 0 || fds_maxlen > INT_MAX) {
+        SOB_AFS_FAIL_("bad fds_maxlen (no errno)");
+        return afs_fail_bad_arg;
+    }
+    c->fds_maxlen = fds_maxlen;
+    return afs_ok;
+}
+
+enum afs_res afs_set_queue_depth(struct afs_ctx * c, size_t depth)
+{
+    if (c->procs != NULL || c->ring != NULL) {
+        SOB_AFS_FAIL_("pool is already in use (no errno)");
+        return afs_fail;
+    }
+    if (depth == 0) {
+        SOB_AFS_FAIL_("empty queue (no errno)");
+        return afs_fail_bad_arg;
+    }
+    c->queue_depth = depth;
+    return afs_ok;
+}
+
+enum afs_res afs_set_stream(struct afs_ctx * c,
+    size_t chunks_len, size_t chunk_len)
+{
+    if (c->procs != NULL || c->ring != NULL) {
+        SOB_AFS_FAIL_("pool is already in use (no errno)");
+        return afs_fail;
+    }
+    if (chunks_len == 0 || chunk_len == 0) {
+        SOB_AFS_FAIL_("empty stream (no errno)");
+        return afs_fail_bad_arg;
+    }
+    c->chunks_len = chunks_len;
+    c->chunk_len = chunk_len;
+    return afs_ok;
+}
+
+enum afs_res afs_prefork(struct afs_ctx * c, size_t workers_len)
+{
+    if (c->is_stop_req) {
+        SOB_AFS_FAIL_("stop requested (no errno)");
+        return afs_fail;
+    }
+    if (c->procs == NULL && c->ring == NULL) {
+        SOB_AFS_CHECK(pool_alloc_(c));
+    }
+    if (c->procs == NULL) {
+        return afs_ok; /* the ring has no workers to spawn */
+    }
+    c->prefork_len = (workers_len < c->procs_maxlen)
+        ? workers_len : c->procs_maxlen;
+    pool_refill_(c, c->prefork_len);
+    return afs_ok;
+}
+
+enum afs_res afs_set_group_commit(struct afs_ctx * c, long window_us)
+{
+    if (c->procs != NULL || c->ring != NULL) {
+        SOB_AFS_FAIL_("pool is already in use (no errno)");
+        return afs_fail;
+    }
+    if (window_us < -1) {
+        SOB_AFS_FAIL_("bad window (no errno)");
+        return afs_fail_bad_arg;
+    }
+    c->group_window_us = window_us;
+    return afs_ok;
+}
+
+void afs_get_group_stats(const struct afs_ctx * c,
+    struct afs_group_stats * stats_out)
+{
+    memcpy(stats_out, &c->group_stats, sizeof(struct afs_group_stats));
+}
+
+void afs_set_tag(struct afs_ctx * c, unsigned long tag)
+{
+    c->tag = tag;
+}
+
 /* undef after afs_update */
 #define SOB_AFS_UPD_ADD_EV_() \
     do { \
@@ -204,124 +585,136 @@ void afs_init(struct afs_ctx * c)
         oev++; \
     } while (0)
 
+/* takes events of a worker or of the ring */
+static void update_evs_(struct afs_ctx * c,
+    struct afs_ev * evs, size_t evs_len, const struct sob_fail * fail)
+{
+    struct afs_ev * oev = c->evs + c->evs_len;
+    while (evs_len > 0 && evs != NULL) {
+        int should_add_ev = 1;
+        int should_del = 0;
+        switch (afs_ev_ty(evs)) {
+        /* these are about the worker, not about an fd */
+        case afs_ev_init:
+        case afs_ev_init_fail:
+        case afs_ev_stop:
+        case afs_ev_stop_fail:
+            should_add_ev = 0;
+            break;
+        /* the afs fd is released after these */
+        case afs_ev_close:
+        case afs_ev_close_fail:
+        case afs_ev_mkdir:
+        case afs_ev_mkdir_fail:
+        case afs_ev_write_fsync_close:
+        case afs_ev_write_fsync_close_fail:
+        case afs_ev_map:
+        case afs_ev_map_fail:
+        case afs_ev_replace:
+        case afs_ev_replace_fail:
+            should_del = 1;
+            break;
+        default:
+            break;
+        };
+        if (afs_ev_is_fail(evs)) {
+            memcpy(&c->fail, fail, sizeof(struct sob_fail));
+        }
+        if (should_del) {
+            (void) ps_del_(c, evs->fd);
+        }
+        if (should_add_ev) {
+            memcpy(oev, evs, sizeof(struct afs_ev));
+            SOB_AFS_UPD_ADD_EV_();
+        }
+        evs_len--;
+        evs++;
+    }
+}
+
+/* the workers exit with the fds they have, so no slot is freed for
+ * the ones still waiting; their cmds fail */
+static void ps_wait_fail_(struct afs_ctx * c)
+{
+    struct afs_ev * oev = c->evs + c->evs_len;
+    if (c->wait_head != NULL) {
+        SOB_AFS_FAIL_("stopped while waiting for a slot (no errno)");
+    }
+    while (c->wait_head != NULL) {
+        struct ps_ * ps = c->wait_head;
+        size_t i;
+        /* pool_alloc_ counts these in evs_maxlen */
+        for (i = 0; i < ps->wait_ctl.queued; i++) {
+            memset(oev, 0, sizeof(struct afs_ev));
+            oev->ty = proc_cmd_fail_ev_(ps->wait_sqes[i].cmd);
+            oev->fd = ps->fd;
+            oev->tag = ps->wait_sqes[i].tag;
+            SOB_AFS_UPD_ADD_EV_();
+        }
+        ps_free_(c, ps);
+    }
+}
+
 void afs_update(struct afs_ctx * c,
     struct pollfd * fds, size_t fds_len)
 {
-    struct ps_ * ps = c->ps;
-    struct afs_ev * oev = c->evs;
+    size_t i;
+    struct afs_ev * evs = NULL;
+    size_t evs_len;
     c->evs_len = 0;
-    if (ps != NULL && oev == NULL) {
-        SOB_PANIC("no evs");
-    }
 
-    while (ps != NULL) {
-        struct ps_ * next_ps = ps->next;
-        enum afs_res r = proc_update_(&ps->p, fds, fds_len);
-        struct afs_ev * evs = NULL;
-        size_t evs_len = proc_evs_(&ps->p, &evs);
-        int should_del = 0;
-        while (evs_len > 0 && evs != NULL) {
-            int should_add_ev = 0;
-            evs->fd = ps->fd;
-            switch (afs_ev_ty(evs)) {
-            case afs_ev_init:
-                should_add_ev = 0;
-                ps->is_avail = 1;
-                if (ps->cmd_after_init == proc_cmd_open_) {
-                    enum afs_res ores = proc_open_(&ps->p);
-                    if (ores != afs_ok) {
-                        memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-                        oev->fd = evs->fd;
-                        oev->ty = afs_ev_open_fail;
-                        SOB_AFS_UPD_ADD_EV_();
-                    }
-                } else if (ps->cmd_after_init == proc_cmd_mkdir_) {
-                    enum afs_res ores = proc_mkdir_(&ps->p);
-                    if (ores != afs_ok) {
-                        memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-                        oev->fd = evs->fd;
-                        oev->ty = afs_ev_mkdir_fail;
-                        SOB_AFS_UPD_ADD_EV_();
-                    }
-                } else if (ps->cmd_after_init == proc_cmd_write_fsync_close_) {
-                    enum afs_res ores = proc_write_fsync_close_(&ps->p);
-                    if (ores != afs_ok) {
-                        memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-                        oev->fd = evs->fd;
-                        oev->ty = afs_ev_write_fsync_close_fail;
-                        SOB_AFS_UPD_ADD_EV_();
-                    }
-                } else if (ps->cmd_after_init != proc_cmd_none_) {
-                    oev->fd = evs->fd;
-                    oev->ty = proc_cmd_fail_ev_(ps->cmd_after_init);
-                    SOB_AFS_UPD_ADD_EV_();
-                    SOB_AFS_FAIL_("bad cmd_after_init (no errno)");
-                }
-                ps->cmd_after_init = proc_cmd_none_;
-                break;
-            case afs_ev_close:
-            case afs_ev_close_fail:
-                should_add_ev = 1;
-                ps->fd = -1;
-                break;
-            /* after these 3 events proc_ is unusable */
-            case afs_ev_init_fail:
-                should_add_ev = 0;
-                should_del = 1;
-                if (ps->cmd_after_init != proc_cmd_none_) {
-                    oev->fd = evs->fd;
-                    oev->ty = proc_cmd_fail_ev_(ps->cmd_after_init);
-                    SOB_AFS_UPD_ADD_EV_();
-                }
-                ps->cmd_after_init = proc_cmd_none_;
-                break;
-            case afs_ev_mkdir_fail:
-            case afs_ev_mkdir:
-            case afs_ev_write_fsync_close:
-            case afs_ev_write_fsync_close_fail:
-                should_add_ev = 1;
-                ps->fd = -1;
-                break;
-            /* do not del after ev_stop[_fail] because gotta call proc_stop */
-            case afs_ev_stop:
-            case afs_ev_stop_fail:
-                should_add_ev = 0;
-                ps->fd = -1;
-                ps->is_avail = 0;
-                break;
-            default:
-                should_add_ev = 1;
-                break;
-            };
-            if (afs_ev_is_fail(evs)) {
-                memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-            }
-            if (should_add_ev) {
-                should_add_ev = 0;
-                memcpy(oev, evs, sizeof(struct afs_ev));
-                SOB_AFS_UPD_ADD_EV_();
-            }
-            evs_len--;
-            evs++;
+    for (i = 0; c->group_timer_fd != -1 && i < fds_len; i++) {
+        if (fds[i].fd == c->group_timer_fd && fds[i].revents & POLLIN) {
+            group_flush_(c);
         }
-        if (r != afs_ok || should_del) { /* proc_ is destroyed and unusable */
-            /* will del same ps because we iterate same way as ps_del_ */
-            (void) ps_del_(c, ps->fd);
-            ps = NULL;
+    }
+    if (c->ring != NULL) {
+        /* ring_ is never destroyed before afs_stop */
+        (void) ring_update_(c->ring, fds, fds_len);
+        evs_len = ring_evs_(c->ring, &evs);
+        update_evs_(c, evs, evs_len, ring_fail_(c->ring));
+        /* an fsync queued behind other cmds is held only once it starts */
+        if (ring_is_held_(c->ring)) {
+            group_arm_(c);
+        }
+        if (c->is_stop_req) {
+            group_flush_(c);
+        }
+        ring_flush_(c->ring);
+    }
+    for (i = 0; c->procs != NULL && i < c->procs_maxlen; i++) {
+        struct proc_ * p = &c->procs[i];
+        enum afs_res r;
+        if (p->st == proc_st_uninit_) {
+            continue;
         }
-        ps = next_ps;
+        r = proc_update_(p, fds, fds_len);
+        evs_len = proc_evs_(p, &evs);
+        update_evs_(c, evs, evs_len, &p->fail);
+        if (r != afs_ok) { /* worker is destroyed, so are its fds */
+            ps_del_proc_(c, p);
+        }
+    }
+    if (! c->is_stop_req) {
+        /* the evs above released some fds */
+        ps_wait_bind_(c);
+    } else {
+        ps_wait_fail_(c);
     }
     if (c->is_stop_req) {
-        int all_stopped = 1;
-        ps = c->ps;
-        while (ps != NULL) {
-            if (ps->p.st != proc_st_uninit_) {
+        int all_stopped = (c->ring == NULL || ring_is_idle_(c->ring));
+        for (i = 0; c->procs != NULL && i < c->procs_maxlen; i++) {
+            if (c->procs[i].st != proc_st_uninit_) {
                 all_stopped = 0;
             }
-            ps = ps->next;
         }
         if (all_stopped) {
+            struct afs_ev * oev = c->evs + c->evs_len;
+            if (c->evs == NULL) {
+                SOB_PANIC("no evs");
+            }
             oev->fd = -1;
+            oev->tag = 0;
             oev->ty = afs_ev_stop;
             SOB_AFS_UPD_ADD_EV_();
         }
@@ -339,8 +732,8 @@ enum afs_res afs_get_rw_buf(struct afs_ctx * c,
             SOB_AFS_FAIL_("fd not found (no errno)");
             return afs_fail_bad_fd;
         }
-        *buf_out = ps->p.rw_buf;
-        *len_out = ps->p.rw_buf_len;
+        *buf_out = ps_buf_(c, ps);
+        *len_out = ps_buf_len_(c, ps);
         return afs_ok;
     } else {
         SOB_AFS_FAIL_("bad fd (no errno)");
@@ -351,47 +744,41 @@ enum afs_res afs_get_rw_buf(struct afs_ctx * c,
 enum afs_res afs_open(struct afs_ctx * c,
     const char * path, int flags, int * afs_fd_out)
 {
-    int was_init;
-    struct ps_ * ps = maybe_alloc_ps_(c, &was_init);
+    enum afs_res r;
+    struct proc_sqe_ q;
+    struct ps_ * ps = ps_alloc_(c);
     if (ps == NULL) {
         return afs_fail_alloc;
     }
 
-    if (strlen(path) + 1 > ps->p.rw_buf_len) {
+    if (strlen(path) + 1 > ps_buf_len_(c, ps)) {
+        (void) ps_del_(c, ps->fd);
         SOB_AFS_FAIL_("path does not fit in rw_buf (no errno)");
         return afs_fail_bad_arg;
     }
 
+    strcpy(ps_buf_(c, ps), path);
+    sqe_init_(&q, proc_cmd_open_);
+    q.open_flags = flags;
     *afs_fd_out = ps->fd;
-
-    if (ps->p.rw_buf == NULL) {
-        SOB_PANIC("rw_buf is NULL");
-    }
-    if (ps->p.shared == NULL) {
-        SOB_PANIC("shared is NULL");
-    }
-    strcpy(ps->p.rw_buf, path);
-    ps->p.shared->open_flags = flags;
-    if (was_init) {
-        enum afs_res r = proc_open_(&ps->p);
-        memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-        return r;
-    } else {
-        ps->is_avail = 0;
-        ps->cmd_after_init = proc_cmd_open_;
-        return afs_ok;
+    r = ps_submit_(c, ps, &q);
+    if (r != afs_ok) {
+        (void) ps_del_(c, ps->fd);
     }
+    return r;
 }
 
 enum afs_res afs_close(struct afs_ctx * c, int fd_from_afs)
 {
     if (fd_from_afs != -1) {
+        struct proc_sqe_ q;
         struct ps_ * ps = ps_get_(c, fd_from_afs);
-        if (ps == NULL || ! ps->is_avail) {
+        if (ps == NULL) {
             SOB_AFS_FAIL_("bad fd (no errno)");
             return afs_fail_bad_fd;
         }
-        return proc_close_(&ps->p);
+        sqe_init_(&q, proc_cmd_close_);
+        return ps_submit_(c, ps, &q);
     } else {
         return afs_fail_bad_fd;
     }
@@ -400,35 +787,92 @@ enum afs_res afs_close(struct afs_ctx * c, int fd_from_afs)
 enum afs_res afs_fsync(struct afs_ctx * c, int fd_from_afs)
 {
     if (fd_from_afs != -1) {
+        struct proc_sqe_ q;
         struct ps_ * ps = ps_get_(c, fd_from_afs);
-        if (ps == NULL || ! ps->is_avail) {
+        if (ps == NULL) {
             SOB_AFS_FAIL_("bad fd (no errno)");
             return afs_fail_bad_fd;
         }
-        return proc_fsync_(&ps->p);
+        sqe_init_(&q, proc_cmd_fsync_);
+        SOB_AFS_CHECK(ps_submit_(c, ps, &q));
+        if (c->group_window_us >= 0) {
+            if (ps->wait_sqes == NULL) {
+                /* else once the fd has a slot, see ps_wait_bind_ */
+                group_hold_(c);
+            }
+            c->group_stats.fsyncs++;
+        }
+        return afs_ok;
     } else {
         return afs_fail_bad_fd;
     }
 }
 
 enum afs_res afs_write(struct afs_ctx * c, int fd_from_afs, size_t len)
+{
+    return afs_write_from(c, fd_from_afs, 0, len);
+}
+
+enum afs_res afs_write_from(struct afs_ctx * c,
+    int fd_from_afs, size_t buf_off, size_t len)
 {
     if (fd_from_afs != -1) {
+        struct proc_sqe_ q;
         struct ps_ * ps = ps_get_(c, fd_from_afs);
-        if (ps == NULL || ! ps->is_avail) {
+        if (ps == NULL) {
             SOB_AFS_FAIL_("bad fd (no errno)");
             return afs_fail_bad_fd;
         }
-        if (ps->p.shared == NULL) {
-            SOB_AFS_FAIL_("shared is NULL (no errno)");
-            return afs_fail;
-        }
-        if (len > ps->p.rw_buf_len) {
+        if (len > ps_buf_len_(c, ps) || buf_off > ps_buf_len_(c, ps) - len) {
             SOB_AFS_FAIL_("write len out of bounds (no errno)");
             return afs_fail_bad_arg;
         }
-        ps->p.shared->write_len = len;
-        return proc_write_(&ps->p);
+        sqe_init_(&q, proc_cmd_write_);
+        q.buf_off = buf_off;
+        q.write_len = len;
+        return ps_submit_(c, ps, &q);
+    } else {
+        return afs_fail_bad_fd;
+    }
+}
+
+enum afs_res afs_writev(struct afs_ctx * c, int fd_from_afs,
+    const struct afs_slice * slices, size_t slices_len)
+{
+    return afs_pwritev(c, fd_from_afs, slices, slices_len, -1);
+}
+
+enum afs_res afs_pwritev(struct afs_ctx * c, int fd_from_afs,
+    const struct afs_slice * slices, size_t slices_len, long long off)
+{
+    if (fd_from_afs != -1) {
+        struct proc_sqe_ q;
+        struct ps_ * ps = ps_get_(c, fd_from_afs);
+        size_t buf_len;
+        size_t i;
+        if (ps == NULL) {
+            SOB_AFS_FAIL_("bad fd (no errno)");
+            return afs_fail_bad_fd;
+        }
+        if (slices_len == 0 || slices_len > SOB_AFS_SLICES_MAX || off < -1) {
+            SOB_AFS_FAIL_("bad slices (no errno)");
+            return afs_fail_bad_arg;
+        }
+        sqe_init_(&q, proc_cmd_writev_);
+        buf_len = ps_buf_len_(c, ps);
+        for (i = 0; i < slices_len; i++) {
+            if (slices[i].len > buf_len
+                || slices[i].off > buf_len - slices[i].len)
+            {
+                SOB_AFS_FAIL_("slice out of bounds (no errno)");
+                return afs_fail_bad_arg;
+            }
+            q.slices[i] = slices[i];
+            q.write_len += slices[i].len;
+        }
+        q.slices_len = slices_len;
+        q.write_off = off;
+        return ps_submit_(c, ps, &q);
     } else {
         return afs_fail_bad_fd;
     }
@@ -437,11 +881,28 @@ enum afs_res afs_write(struct afs_ctx * c, int fd_from_afs, size_t len)
 enum afs_res afs_readall(struct afs_ctx * c, int fd_from_afs)
 {
     if (fd_from_afs != -1) {
+        struct proc_sqe_ q;
+        struct ps_ * ps = ps_get_(c, fd_from_afs);
+        if (ps == NULL) {
+            return afs_fail_bad_fd;
+        }
+        sqe_init_(&q, proc_cmd_readall_);
+        return ps_submit_(c, ps, &q);
+    } else {
+        return afs_fail_bad_fd;
+    }
+}
+
+enum afs_res afs_readall_stream(struct afs_ctx * c, int fd_from_afs)
+{
+    if (fd_from_afs != -1) {
+        struct proc_sqe_ q;
         struct ps_ * ps = ps_get_(c, fd_from_afs);
-        if (ps == NULL || ! ps->is_avail) {
+        if (ps == NULL) {
             return afs_fail_bad_fd;
         }
-        return proc_readall_(&ps->p);
+        sqe_init_(&q, proc_cmd_readall_stream_);
+        return ps_submit_(c, ps, &q);
     } else {
         return afs_fail_bad_fd;
     }
@@ -449,42 +910,69 @@ enum afs_res afs_readall(struct afs_ctx * c, int fd_from_afs)
 
 enum afs_res afs_mkdir(struct afs_ctx * c, const char * path, int * afs_fd_out)
 {
-    int was_init;
-    struct ps_ * ps = maybe_alloc_ps_(c, &was_init);
+    enum afs_res r;
+    struct proc_sqe_ q;
+    struct ps_ * ps = ps_alloc_(c);
     if (ps == NULL) {
         return afs_fail_alloc;
     }
 
-    if (strlen(path) + 1 > ps->p.rw_buf_len) {
+    if (strlen(path) + 1 > ps_buf_len_(c, ps)) {
+        (void) ps_del_(c, ps->fd);
         SOB_AFS_FAIL_("path does not fit in rw_buf (no errno)");
         return afs_fail_bad_arg;
     }
 
+    strcpy(ps_buf_(c, ps), path);
+    sqe_init_(&q, proc_cmd_mkdir_);
     *afs_fd_out = ps->fd;
+    r = ps_submit_(c, ps, &q);
+    if (r != afs_ok) {
+        (void) ps_del_(c, ps->fd);
+    }
+    return r;
+}
 
-    if (ps->p.rw_buf == NULL) {
-        SOB_PANIC("rw_buf is NULL");
+enum afs_res afs_map(struct afs_ctx * c, const char * path, int * afs_fd_out)
+{
+    enum afs_res r;
+    struct proc_sqe_ q;
+    struct ps_ * ps = ps_alloc_(c);
+    if (ps == NULL) {
+        return afs_fail_alloc;
     }
-    if (ps->p.shared == NULL) {
-        SOB_PANIC("shared is NULL");
+
+    if (strlen(path) + 1 > ps_buf_len_(c, ps)) {
+        (void) ps_del_(c, ps->fd);
+        SOB_AFS_FAIL_("path does not fit in rw_buf (no errno)");
+        return afs_fail_bad_arg;
     }
-    strcpy(ps->p.rw_buf, path);
-    if (was_init) {
-        enum afs_res r = proc_mkdir_(&ps->p);
-        memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-        return r;
-    } else {
-        ps->is_avail = 0;
-        ps->cmd_after_init = proc_cmd_mkdir_;
-        return afs_ok;
+
+    strcpy(ps_buf_(c, ps), path);
+    sqe_init_(&q, proc_cmd_map_);
+    *afs_fd_out = ps->fd;
+    r = ps_submit_(c, ps, &q);
+    if (r != afs_ok) {
+        (void) ps_del_(c, ps->fd);
+    }
+    return r;
+}
+
+enum afs_res afs_unmap(struct afs_ctx * c, const char * data, size_t len)
+{
+    if (data == NULL) {
+        return afs_ok; /* empty file */
     }
+    if (munmap((void *) data, len) != 0) {
+        SOB_AFS_FAIL_("munmap");
+        return afs_fail;
+    }
+    return afs_ok;
 }
 
 enum afs_res afs_reserve(struct afs_ctx * c, int * afs_fd_out)
 {
-    int was_init;
-    struct ps_ * ps = maybe_alloc_ps_(c, &was_init);
-    (void) was_init;
+    struct ps_ * ps = ps_alloc_(c);
     if (ps != NULL) {
         *afs_fd_out = ps->fd;
         return afs_ok;
@@ -508,30 +996,70 @@ enum afs_res afs_write_fsync_close(struct afs_ctx * c,
         SOB_AFS_FAIL_("fd not found (no errno)");
         return afs_fail_bad_fd;
     }
-    if (ps->p.shared == NULL || ps->p.rw_buf == NULL) {
-        SOB_AFS_FAIL_("shared or rw_buf is NULL (no errno)");
-        return afs_fail;
-    }
     path_len = strlen(path) + 1;
-    if (write_len + path_len <= ps->p.rw_buf_len) {
-        ps->p.shared->open_flags = flags;
-        ps->p.shared->write_len = write_len;
-        memcpy((char *) ps->p.rw_buf + write_len, path, path_len);
-        if (ps->p.st == proc_st_avail_) {
-            enum afs_res r = proc_write_fsync_close_(&ps->p);
-            memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-            return r;
-        } else if (ps->p.st == proc_st_uninit_
-                || ps->p.st == proc_st_init_pend_) {
-            ps->is_avail = 0;
-            ps->cmd_after_init = proc_cmd_write_fsync_close_;
-            return afs_ok;
+    if (write_len + path_len <= ps_buf_len_(c, ps)) {
+        struct proc_sqe_ q;
+        sqe_init_(&q, proc_cmd_write_fsync_close_);
+        q.open_flags = flags;
+        q.write_len = write_len;
+        memcpy((char *) ps_buf_(c, ps) + write_len,
+            path, path_len);
+        return ps_submit_(c, ps, &q);
+    } else {
+        SOB_AFS_FAIL_("write len and path don't fit in the buf (no errno)");
+        return afs_fail_bad_arg;
+    }
+}
+
+enum afs_res afs_replace(struct afs_ctx * c,
+    int fd_from_afs, const char * path, size_t write_len)
+{
+    static const char tmp_suffix[] = ".tmp";
+    struct ps_ * ps;
+    size_t path_len;
+    size_t dir_len;
+    const char * slash;
+    if (fd_from_afs == -1) {
+        SOB_AFS_FAIL_("bad fd (no errno)");
+        return afs_fail_bad_fd;
+    }
+    ps = ps_get_(c, fd_from_afs);
+    if (ps == NULL) {
+        SOB_AFS_FAIL_("fd not found (no errno)");
+        return afs_fail_bad_fd;
+    }
+    path_len = strlen(path);
+    slash = strrchr(path, '/');
+    if (slash == NULL) {
+        dir_len = 1; /* "." */
+    } else if (slash == path) {
+        dir_len = 1; /* "/" */
+    } else {
+        dir_len = slash - path;
+    }
+    /* the data, then path.tmp, path and its dir */
+    if (write_len + path_len + sizeof(tmp_suffix)
+        + path_len + 1 + dir_len + 1 <= ps_buf_len_(c, ps))
+    {
+        struct proc_sqe_ q;
+        char * tmp_path = (char *) ps_buf_(c, ps) + write_len;
+        char * new_path = tmp_path + path_len + sizeof(tmp_suffix);
+        char * dir_path = new_path + path_len + 1;
+        sqe_init_(&q, proc_cmd_replace_);
+        q.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY | O_CLOEXEC;
+        q.write_len = write_len;
+        memcpy(tmp_path, path, path_len);
+        memcpy(tmp_path + path_len, tmp_suffix, sizeof(tmp_suffix));
+        memcpy(new_path, path, path_len + 1);
+        if (slash == NULL) {
+            memcpy(dir_path, ".", 2);
         } else {
-            SOB_AFS_FAIL_("proc busy or dead (no errno)");
-            return afs_fail;
+            memcpy(dir_path, path, dir_len);
+            dir_path[dir_len] = '\0';
         }
+        return ps_submit_(c, ps, &q);
     } else {
-        SOB_AFS_FAIL_("write len and path don't fit in the buf (no errno)");
+        SOB_AFS_FAIL_("write len and paths don't fit in the buf (no errno)");
         return afs_fail_bad_arg;
     }
 }
@@ -540,16 +1068,26 @@ enum afs_res afs_stop_prep(struct afs_ctx * c)
 {
     if (! c->is_stop_req) {
         enum afs_res res = afs_ok;
-        struct ps_ * ps = c->ps;
+        size_t i;
+        /* the workers exit after running what is queued */
+        group_flush_(c);
         c->is_stop_req = 1;
-        while (ps != NULL) {
-            enum afs_res r = proc_stop_prep_(&ps->p);
+        if (c->ring != NULL) {
+            /* afs_update reports afs_ev_stop once the ring is idle */
+            ring_wake_(c->ring);
+        }
+        for (i = 0; c->procs != NULL && i < c->procs_maxlen; i++) {
+            struct proc_ * p = &c->procs[i];
+            enum afs_res r;
+            if (p->st == proc_st_uninit_) {
+                continue;
+            }
+            r = proc_stop_prep_(p);
             if (r != afs_ok) {
                 /* XXX: will only keep last fail */
-                memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
+                memcpy(&c->fail, &p->fail, sizeof(struct sob_fail));
                 res = r;
             }
-            ps = ps->next;
         }
         return res;
     } else {
@@ -561,51 +1099,65 @@ enum afs_res afs_stop_prep(struct afs_ctx * c)
 enum afs_res afs_stop(struct afs_ctx * c)
 {
     enum afs_res res = afs_ok;
-    struct ps_ * ps = c->ps;
-    while (ps != NULL) {
-        struct ps_ * next_ps = ps->next;
-        enum afs_res r = proc_stop_(&ps->p);
+    size_t i;
+    if (c->ring != NULL && ! ring_is_idle_(c->ring)) {
+        SOB_AFS_FAIL_("ring is not ready to stop (no errno)");
+        res = afs_fail;
+    }
+    for (i = 0; c->procs != NULL && i < c->procs_maxlen; i++) {
+        struct proc_ * p = &c->procs[i];
+        enum afs_res r = proc_stop_(p);
         if (r != afs_ok) {
             /* XXX: will only keep last fail */
-            memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
+            memcpy(&c->fail, &p->fail, sizeof(struct sob_fail));
             res = r;
         }
-        free(ps);
-        ps = next_ps;
-    }
-    c->ps = NULL;
-    if (c->pfds != NULL) {
-        free(c->pfds);
-    }
-    if (c->evs != NULL) {
-        free(c->evs);
     }
-    c->pfds = NULL;
-    c->pfds_len = 0;
-    c->pfds_maxlen = 0;
-    c->evs = NULL;
-    c->evs_len = 0;
-    c->evs_maxlen = 0;
+    pool_free_(c);
     return res;
 }
 
 size_t afs_pollfds(struct afs_ctx * c, struct pollfd ** fds_out)
 {
-    const struct ps_ * ps = c->ps;
     struct pollfd * pfd = c->pfds;
+    size_t i;
     c->pfds_len = 0;
-    while (ps != NULL) {
+    if (c->procs != NULL && c->prefork_len > 0 && ! c->is_stop_req) {
+        /* one fork per iteration, off the path of any cmd */
+        pool_refill_(c, 1);
+    }
+    if (c->group_window_us == 0) {
+        /* the window is the loop iteration */
+        group_flush_(c);
+    } else if (c->group_timer_fd != -1) {
+        pfd->fd = c->group_timer_fd;
+        pfd->events = POLLIN;
+        pfd->revents = 0;
+        pfd++;
+        c->pfds_len++;
+    }
+    if (c->ring != NULL) {
+        /* sqes are batched until the loop is about to poll */
+        ring_flush_(c->ring);
+        pfd->fd = ring_fd_(c->ring);
+        pfd->events = POLLIN;
+        pfd->revents = 0;
+        pfd++;
+        c->pfds_len++;
+    }
+    for (i = 0; c->procs != NULL && i < c->procs_maxlen; i++) {
         if (c->pfds_len == c->pfds_maxlen) {
             SOB_PANIC("not enough pfds");
         }
-        pfd->fd = proc_fd_(&ps->p);
+        /* the evs of the last afs_update are handled by now */
+        proc_release_chunks_(&c->procs[i]);
+        pfd->fd = proc_fd_(&c->procs[i]);
         if (pfd->fd != -1) {
             pfd->events = POLLIN;
             pfd->revents = 0;
             pfd++;
             c->pfds_len++;
         }
-        ps = ps->next;
     }
     *fds_out = c->pfds;
     return c->pfds_len;
@@ -634,6 +1186,8 @@ int afs_ev_is_fail(const struct afs_ev * ev)
     case afs_ev_readall_fail:
     case afs_ev_mkdir_fail:
     case afs_ev_write_fsync_close_fail:
+    case afs_ev_map_fail:
+    case afs_ev_replace_fail:
         return 1;
     case afs_ev_init:
     case afs_ev_stop:
@@ -644,27 +1198,54 @@ int afs_ev_is_fail(const struct afs_ev * ev)
     case afs_ev_readall:
     case afs_ev_mkdir:
     case afs_ev_write_fsync_close:
+    case afs_ev_map:
+    case afs_ev_replace:
         return 0;
     }
     SOB_PANIC("unreacheable");
     return 0;
 }
 
-size_t afs_ev_write_len(const struct afs_ev * ev)
+int afs_ev_fd(const struct afs_ev * ev)
 {
-    return ev->d.write.len;
+    return ev->fd;
 }
 
-size_t afs_ev_readall_len(const struct afs_ev * ev)
+unsigned long afs_ev_tag(const struct afs_ev * ev)
+{
+    return ev->tag;
+}
+
+size_t afs_ev_write_len(const struct afs_ev * ev)
+{
+    return ev->d.write.len;
+}
+
+size_t afs_ev_readall_len(const struct afs_ev * ev)
 {
     return ev->d.readall.len;
 }
 
+size_t afs_ev_readall_off(const struct afs_ev * ev)
+{
+    return ev->d.readall.off;
+}
+
 const char * afs_ev_readall_data(const struct afs_ev * ev)
 {
     return ev->d.readall.data;
 }
 
+size_t afs_ev_map_len(const struct afs_ev * ev)
+{
+    return ev->d.map.len;
+}
+
+const char * afs_ev_map_data(const struct afs_ev * ev)
+{
+    return ev->d.map.data;
+}
+
 const char * afs_event_str(enum afs_event event)
 {
     switch (event) {
@@ -704,644 +1285,2762 @@ const char * afs_event_str(enum afs_event event)
         return "afs_ev_write_fsync_close";
     case afs_ev_write_fsync_close_fail:
         return "afs_ev_write_fsync_close_fail";
+    case afs_ev_map:
+        return "afs_ev_map";
+    case afs_ev_map_fail:
+        return "afs_ev_map_fail";
+    case afs_ev_replace:
+        return "afs_ev_replace";
+    case afs_ev_replace_fail:
+        return "afs_ev_replace_fail";
     }
     return "";
 }
 
-static struct ps_ * maybe_alloc_ps_(struct afs_ctx * c, int * was_init_out)
+/* starts the window on the first held fsync */
+static void group_arm_(struct afs_ctx * c)
 {
-    struct ps_ * ps = ps_get_(c, -1);
-    if (ps != NULL) { /* reuse free proc */
-        if (ps->p.st == proc_st_uninit_) {
-            enum afs_res r = proc_init_(&ps->p);
-            *was_init_out = 0;
-            if (r != afs_ok) {
-                memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-                /* ps->fd is still -1; will find the same one as ps_get_(-1) */
-                (void) ps_del_(c, -1);
-                return NULL;
-            }
-        } else {
-            *was_init_out = 1;
-        }
-        ps->fd = ps_next_fd_(c);
-        return ps;
-    } else {
-        enum afs_res r;
-        ps = ps_add_(c);
-        if (ps == NULL) {
-            return NULL;
-        }
-        *was_init_out = 0;
-        r = proc_init_(&ps->p);
-        if (r != afs_ok) {
-            memcpy(&c->fail, &ps->p.fail, sizeof(struct sob_fail));
-            (void) ps_del_(c, ps->fd);
-            return NULL;
+    if (c->is_group_armed) {
+        return;
+    }
+    c->is_group_armed = 1;
+    c->group_first_us = group_now_us_();
+    if (c->group_timer_fd != -1) {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = c->group_window_us / 1000000;
+        its.it_value.tv_nsec = (c->group_window_us % 1000000) * 1000;
+        if (timerfd_settime(c->group_timer_fd, 0, &its, NULL) != 0) {
+            /* the fsyncs still go with the next flush */
+            SOB_AFS_FAIL_("timerfd_settime");
         }
-        return ps;
     }
 }
 
-static struct ps_ * ps_add_(struct afs_ctx * c)
+/* counts an fsync into the window */
+static void group_hold_(struct afs_ctx * c)
 {
-    size_t ps_len = ps_len_(c);
-    struct ps_ * parent = c->ps;
-    struct ps_ * ps = malloc(sizeof(struct ps_));
-    if (ps == NULL) {
-        SOB_AFS_FAIL_("malloc ps");
-        return NULL;
-    }
-    ps_len++;
+    unsigned long now = group_now_us_();
+    group_arm_(c);
+    c->group_held++;
+    c->group_start_sum_us += now;
+}
 
-    if (c->pfds_maxlen < ps_len) {
-        size_t new_pfds_len = ps_len + evs_pfds_prealloc_len_;
-        struct pollfd * new_pfds = malloc(sizeof(struct pollfd) * new_pfds_len);
-        if (new_pfds == NULL) {
-            SOB_AFS_FAIL_("malloc pfds");
-            free(ps);
-            return NULL;
-        }
-        c->pfds = new_pfds;
-        c->pfds_maxlen = new_pfds_len;
-        memset(c->pfds, 0, sizeof(struct pollfd) * c->pfds_maxlen);
-    }
-    if (c->evs_maxlen < ps_len * proc_evs_maxlen_) {
-        size_t new_evs_len = \
-             (ps_len + evs_pfds_prealloc_len_) * proc_evs_maxlen_;
-        struct afs_ev * new_evs = malloc(sizeof(struct afs_ev) * new_evs_len);
-        if (new_evs == NULL) {
-            SOB_AFS_FAIL_("malloc evs");
-            free(ps);
-            return NULL;
-        }
-        c->evs = new_evs;
-        c->evs_maxlen = new_evs_len;
-        memset(c->evs, 0, sizeof(struct afs_ev) * c->evs_maxlen);
+/* submits what every worker and the ring hold, at once */
+static void group_flush_(struct afs_ctx * c)
+{
+    unsigned long now;
+    unsigned long held_us;
+    size_t i;
+    if (! c->is_group_armed) {
+        return;
+    }
+    c->is_group_armed = 0;
+    if (c->group_timer_fd != -1) {
+        struct itimerspec its;
+        char throwaway[8];
+        memset(&its, 0, sizeof(its));
+        (void) timerfd_settime(c->group_timer_fd, 0, &its, NULL);
+        (void) read(c->group_timer_fd, throwaway, sizeof(throwaway));
     }
+    now = group_now_us_();
+    held_us = now - c->group_first_us;
+    c->group_stats.flushes++;
+    c->group_stats.held_us_total += now * c->group_held
+        - c->group_start_sum_us;
+    if (held_us > c->group_stats.held_us_max) {
+        c->group_stats.held_us_max = held_us;
+    }
+    c->group_held = 0;
+    c->group_start_sum_us = 0;
 
-    ps->fd = ps_next_fd_(c);
-    ps->next = NULL;
-    ps->cmd_after_init = proc_cmd_none_;
-    ps->is_avail = 0;
-    if (parent != NULL) {
-        while (parent->next != NULL) {
-            parent = parent->next;
-        }
-        parent->next = ps;
-    } else {
-        ps->fd = 0;
-        c->ps = ps;
+    for (i = 0; c->procs != NULL && i < c->procs_maxlen; i++) {
+        c->group_stats.syncs += proc_group_flush_(&c->procs[i]);
+    }
+    if (c->ring != NULL) {
+        c->group_stats.syncs += ring_group_flush_(c->ring);
     }
-    return ps;
 }
 
-static enum afs_res ps_del_(struct afs_ctx * c, int fd)
+static unsigned long group_now_us_(void)
 {
-    struct ps_ * parent = NULL;
-    struct ps_ * ps = c->ps;
-    while (ps != NULL) {
-        if (ps->fd == fd) {
-            if (parent != NULL) {
-                parent->next = ps->next;
-            } else {
-                c->ps = ps->next;
+    struct timespec ts;
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static enum afs_res pool_alloc_(struct afs_ctx * c)
+{
+    size_t i;
+    size_t sqes_len = c->slots_len * c->queue_depth + 1;
+    size_t proc_evs_maxlen = sqes_len + c->chunks_len + proc_evs_extra_len_;
+    /* the ring gets as many fds as the workers would serve */
+    size_t slots_maxlen = c->procs_maxlen * c->slots_len;
+    size_t wait_evs_len;
+
+    c->ps_len = (c->fds_maxlen > slots_maxlen) ? c->fds_maxlen : slots_maxlen;
+    /* for ps_wait_fail_ */
+    wait_evs_len = (c->ps_len - slots_maxlen) * c->queue_depth;
+    c->ps = malloc(sizeof(struct ps_) * c->ps_len);
+    if (c->ps == NULL) {
+        SOB_AFS_FAIL_("malloc fd table");
+        c->ps_len = 0;
+        return afs_fail_alloc;
+    }
+    for (i = 0; i < c->ps_len; i++) {
+        c->ps[i].fd = -1;
+        c->ps[i].p = NULL;
+        c->ps[i].slot = 0;
+        c->ps[i].gen = 0;
+        c->ps[i].next_free = i + 1;
+        c->ps[i].wait_sqes = NULL;
+        c->ps[i].wait_buf = NULL;
+        c->ps[i].wait_next = NULL;
+    }
+    c->ps_free = 0;
+    c->slots_used = 0;
+    c->wait_head = NULL;
+    c->wait_tail = NULL;
+    c->ps_gens = INT_MAX / c->ps_len;
+
+    if (c->group_window_us > 0) {
+        c->group_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+            TFD_NONBLOCK | TFD_CLOEXEC);
+        if (c->group_timer_fd == -1) {
+            SOB_AFS_FAIL_("timerfd_create");
+            pool_free_(c);
+            return afs_fail;
+        }
+    }
+
+    if (c->backend == afs_backend_uring) {
+        struct sob_fail ring_fail;
+        if (ring_init_(&c->ring, slots_maxlen, c->queue_depth, c->chunk_len,
+                c->group_window_us >= 0, &ring_fail) == afs_ok)
+        {
+            /* +1 for the group commit timer */
+            c->pfds_maxlen = 1 + 1;
+            c->pfds = malloc(sizeof(struct pollfd) * c->pfds_maxlen);
+            /* as in ring_init_, +1 for afs_ev_stop */
+            c->evs_maxlen = slots_maxlen * (c->queue_depth + 1)
+                + proc_evs_extra_len_ + 1 + wait_evs_len;
+            c->evs = malloc(sizeof(struct afs_ev) * c->evs_maxlen);
+            if (c->pfds == NULL || c->evs == NULL) {
+                SOB_AFS_FAIL_("malloc pool");
+                pool_free_(c);
+                return afs_fail_alloc;
             }
-            free(ps);
             return afs_ok;
         }
-        parent = ps;
-        ps = ps->next;
+        /* old kernel or built without SOB_AFS_URING */
+        c->backend = afs_backend_fork;
     }
-    SOB_AFS_FAIL_("fd not found (no errno)");
-    return afs_fail_bad_fd;
-}
 
-static struct ps_ * ps_get_(struct afs_ctx * c, int fd)
-{
-    struct ps_ * ps = c->ps;
-    while (ps != NULL) {
-        if (ps->fd == fd) {
-            return ps;
-        }
-        ps = ps->next;
+    c->procs = malloc(sizeof(struct proc_) * c->procs_maxlen);
+    c->slot_ctls = malloc(sizeof(struct proc_slot_ctl_)
+        * c->procs_maxlen * c->slots_len);
+    c->proc_evs = malloc(sizeof(struct afs_ev)
+        * c->procs_maxlen * proc_evs_maxlen);
+    c->map_fds = malloc(sizeof(int) * c->procs_maxlen * sqes_len);
+    /* +1 for the group commit timer */
+    c->pfds_maxlen = c->procs_maxlen + 1;
+    c->pfds = malloc(sizeof(struct pollfd) * c->pfds_maxlen);
+    /* +1 for afs_ev_stop */
+    c->evs_maxlen = c->procs_maxlen * proc_evs_maxlen + 1 + wait_evs_len;
+    c->evs = malloc(sizeof(struct afs_ev) * c->evs_maxlen);
+    if (c->procs == NULL || c->slot_ctls == NULL || c->proc_evs == NULL
+            || c->map_fds == NULL
+            || c->pfds == NULL || c->evs == NULL) {
+        SOB_AFS_FAIL_("malloc pool");
+        pool_free_(c);
+        return afs_fail_alloc;
     }
-    return NULL;
-}
+    memset(c->pfds, 0, sizeof(struct pollfd) * c->pfds_maxlen);
+    memset(c->evs, 0, sizeof(struct afs_ev) * c->evs_maxlen);
 
-static int ps_next_fd_(struct afs_ctx * c)
-{
-    int fd = 0;
-    struct ps_ * ps = c->ps;
-    while (ps != NULL) {
-        if (ps->fd >= fd) {
-            fd = ps->fd + 1;
+    for (i = 0; i < c->procs_maxlen; i++) {
+        struct proc_ * p = &c->procs[i];
+        size_t j;
+        p->is_stop_req = 0;
+        p->st = proc_st_uninit_;
+        p->evs = &c->proc_evs[i * proc_evs_maxlen];
+        p->evs_len = 0;
+        p->shared = NULL;
+        p->sqes = NULL;
+        p->cqes = NULL;
+        p->sqes_len = sqes_len;
+        p->sq_tail = 0;
+        p->cq_head = 0;
+        p->queue_depth = c->queue_depth;
+        p->chunks = NULL;
+        p->chunks_mem = NULL;
+        p->chunks_len = c->chunks_len;
+        p->chunk_len = c->chunk_len;
+        p->stream_head = 0;
+        p->stream_seen = 0;
+        p->map_fds = &c->map_fds[i * sqes_len];
+        p->map_fds_head = 0;
+        p->map_fds_len = 0;
+        p->is_group = (c->group_window_us >= 0);
+        p->held = NULL;
+        p->held_head = 0;
+        p->held_len = 0;
+        p->held_unflushed = 0;
+        p->slots_mem = NULL;
+        p->slot_stride = 0;
+        p->rw_buf_len = 0;
+        p->slots = &c->slot_ctls[i * c->slots_len];
+        p->slots_len = c->slots_len;
+        p->slots_used = 0;
+        p->mmap_start = NULL;
+        p->mmap_len = 0;
+        p->pid = 0;
+        p->fd = -1;
+        for (j = 0; j < p->slots_len; j++) {
+            p->slots[j].st = proc_slot_st_free_;
+            p->slots[j].afs_fd = -1;
+            p->slots[j].queued = 0;
+            p->slots[j].is_readall_queued = 0;
+            p->slots[j].is_fsync_held = 0;
         }
-        ps = ps->next;
     }
-    return fd;
+    return afs_ok;
 }
 
-static size_t ps_len_(struct afs_ctx * c)
+static void pool_free_(struct afs_ctx * c)
 {
-    size_t r = 0;
-    struct ps_ * ps = c->ps;
-    while (ps != NULL) {
-        r++;
-        ps = ps->next;
+    size_t i;
+    if (c->ring != NULL) {
+        ring_destroy_(c->ring);
+        c->ring = NULL;
     }
-    return r;
+    /* free(NULL) is fine */
+    free(c->procs);
+    free(c->slot_ctls);
+    free(c->proc_evs);
+    free(c->map_fds);
+    for (i = 0; c->ps != NULL && i < c->ps_len; i++) {
+        free(c->ps[i].wait_sqes);
+    }
+    free(c->ps);
+    free(c->pfds);
+    free(c->evs);
+    c->procs = NULL;
+    c->slot_ctls = NULL;
+    c->proc_evs = NULL;
+    c->map_fds = NULL;
+    c->ps = NULL;
+    c->ps_len = 0;
+    c->ps_free = 0;
+    c->slots_used = 0;
+    c->wait_head = NULL;
+    c->wait_tail = NULL;
+    if (c->group_timer_fd != -1) {
+        close(c->group_timer_fd);
+        c->group_timer_fd = -1;
+    }
+    c->is_group_armed = 0;
+    c->pfds = NULL;
+    c->pfds_len = 0;
+    c->pfds_maxlen = 0;
+    c->evs = NULL;
+    c->evs_len = 0;
+    c->evs_maxlen = 0;
 }
 
-static enum afs_res proc_init_(struct proc_ * p)
+/* prefers an empty live worker, then spawning one, then the least loaded */
+static struct proc_ * pool_pick_(struct afs_ctx * c)
 {
-    int sv[2]; /* [0] for parent, [1] for child */
-    pid_t pid;
-    size_t pgs = sysconf(_SC_PAGESIZE);
-
-    p->evs_len = 0;
-    p->is_stop_req = 0;
-    /* if something goes wrong we might accidentally kill ourselves
-     * but not others; should never happen though */
-    p->pid = 0;
-
-    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
-        SOB_AFS_PROC_FAIL_("socketpair");
-        return afs_fail;
+    struct proc_ * best = NULL;
+    struct proc_ * unspawned = NULL;
+    size_t i;
+    for (i = 0; i < c->procs_maxlen; i++) {
+        struct proc_ * p = &c->procs[i];
+        if (p->st == proc_st_uninit_) {
+            if (unspawned == NULL) {
+                unspawned = p;
+            }
+        } else if (p->st != proc_st_dead_
+                && p->slots_used < p->slots_len
+                && (best == NULL || p->slots_used < best->slots_used)) {
+            best = p;
+        }
     }
-    fcntl(sv[0], F_SETFD, fcntl(sv[0], F_GETFD) | O_NONBLOCK);
-    fcntl(sv[1], F_SETFD, fcntl(sv[1], F_GETFD) & ~O_NONBLOCK);
-
-    /* make size a multiple of page size; mmap_len > 0 */
-    p->mmap_len = sizeof(struct proc_shared_) + rw_buf_len_;
-    p->mmap_len = ((p->mmap_len - 1) / pgs + 1) * pgs;
-    p->mmap_start = mmap(NULL, p->mmap_len,
-        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (p->mmap_start == MAP_FAILED) {
-        SOB_AFS_PROC_FAIL_("mmap");
-        close(sv[0]);
-        close(sv[1]);
-        return afs_fail;
+    if (unspawned != NULL && (best == NULL || best->slots_used > 0)) {
+        if (proc_init_(unspawned) == afs_ok) {
+            return unspawned;
+        }
+        memcpy(&c->fail, &unspawned->fail, sizeof(struct sob_fail));
+        /* a loaded worker is still better than nothing */
     }
-    p->shared = (struct proc_shared_ *)p->mmap_start;
-    p->shared->cmd = proc_cmd_none_;
-    p->shared->res = proc_res_none_;
-    p->shared->st = proc_child_st_not_started_;
-    p->shared->write_len = 0;
-    p->shared->open_flags = 0;
-    p->shared->written = 0;
-    p->shared->read_len = 0;
-
-    p->rw_buf = ((char *) p->mmap_start) + sizeof(struct proc_shared_);
-    p->rw_buf_len = p->mmap_len - sizeof(struct proc_shared_);
-
-    pid = fork();
-    if (pid == -1) {
-        SOB_AFS_PROC_FAIL_("fork");
-        close(sv[0]);
-        close(sv[1]);
-        munmap(p->mmap_start, p->mmap_len);
-        p->mmap_start = NULL;
-        p->mmap_len = 0;
-        p->rw_buf = NULL;
-        p->rw_buf_len = 0;
-        p->shared = NULL;
-        return afs_fail;
-    } else if (pid == 0) { /* child */
-        close(sv[0]);
-        int r = proc_child_worker_(sv[1],
-            p->shared, p->rw_buf, p->rw_buf_len);
-        _exit(r);
+    if (best == NULL && unspawned == NULL) {
+        SOB_AFS_FAIL_("all workers are full (no errno)");
     }
-    /* parent continues */
-    close(sv[1]);
-
-    p->pid = pid;
-    p->fd = sv[0];
-    p->st = proc_st_init_pend_;
-
-    /* ask child to notify us when started */
-    p->shared->cmd = proc_cmd_none_;
-    return proc_notify_child_(p);
+    return best;
 }
 
-static enum afs_res proc_open_(struct proc_ * p)
+/* spawns workers until prefork_len of them have no fds */
+static void pool_refill_(struct afs_ctx * c, size_t spawn_maxlen)
 {
-    return proc_send_cmd_(p, proc_cmd_open_);
+    size_t idle_len = 0;
+    size_t i;
+    for (i = 0; i < c->procs_maxlen; i++) {
+        const struct proc_ * p = &c->procs[i];
+        if ((p->st == proc_st_init_pend_ || p->st == proc_st_avail_)
+            && p->slots_used == 0)
+        {
+            idle_len++;
+        }
+    }
+    for (i = 0; i < c->procs_maxlen && spawn_maxlen > 0
+        && idle_len < c->prefork_len; i++)
+    {
+        struct proc_ * p = &c->procs[i];
+        if (p->st != proc_st_uninit_) {
+            continue;
+        }
+        if (proc_init_(p) != afs_ok) {
+            /* tried again on the next afs_pollfds */
+            memcpy(&c->fail, &p->fail, sizeof(struct sob_fail));
+            return;
+        }
+        idle_len++;
+        spawn_maxlen--;
+    }
 }
 
-static enum afs_res proc_close_(struct proc_ * p)
+static struct ps_ * ps_alloc_(struct afs_ctx * c)
 {
-    return proc_send_cmd_(p, proc_cmd_close_);
-}
+    struct ps_ * ps;
+    size_t i;
+    int fd;
 
-static enum afs_res proc_fsync_(struct proc_ * p)
-{
-    return proc_send_cmd_(p, proc_cmd_fsync_);
-}
+    if (c->is_stop_req) {
+        SOB_AFS_FAIL_("stop requested (no errno)");
+        return NULL;
+    }
+    if (c->procs == NULL && c->ring == NULL && pool_alloc_(c) != afs_ok) {
+        return NULL;
+    }
+    if (c->ps_free == c->ps_len) {
+        SOB_AFS_FAIL_("all fds are in use (no errno)");
+        return NULL;
+    }
 
-static enum afs_res proc_write_(struct proc_ * p)
-{
-    return proc_send_cmd_(p, proc_cmd_write_);
+    i = c->ps_free;
+    ps = &c->ps[i];
+    fd = (int) (ps->gen * c->ps_len + i);
+    if (c->wait_head != NULL
+        || c->slots_used == c->procs_maxlen * c->slots_len)
+    {
+        /* behind the ones already waiting, so they get slots in order */
+        if (! ps_wait_(c, ps)) {
+            return NULL;
+        }
+    } else if (! ps_bind_(c, ps, fd)) {
+        return NULL;
+    }
+    ps->fd = fd;
+    c->ps_free = ps->next_free;
+    return ps;
 }
 
-static enum afs_res proc_readall_(struct proc_ * p)
+/* gives the ps a slot of a worker or of the ring */
+static int ps_bind_(struct afs_ctx * c, struct ps_ * ps, int fd)
 {
-    return proc_send_cmd_(p, proc_cmd_readall_);
+    struct proc_ * p = NULL;
+    if (c->ring == NULL) {
+        p = pool_pick_(c);
+        if (p == NULL) {
+            return 0;
+        }
+    }
+    ps->p = p;
+    if (p != NULL) {
+        if (! proc_slot_alloc_(p, fd, &ps->slot)) {
+            /* pool_pick_ never returns a full worker */
+            SOB_PANIC("no free slot");
+        }
+    } else if (! ring_slot_alloc_(c->ring, fd, &ps->slot)) {
+        /* slots_used counts the slots of the ring as well */
+        SOB_PANIC("no free slot");
+    }
+    c->slots_used++;
+    return 1;
 }
 
-static enum afs_res proc_mkdir_(struct proc_ * p)
+/* the sqes and the rw_buf of a waiting ps are one malloc */
+static int ps_wait_(struct afs_ctx * c, struct ps_ * ps)
 {
-    return proc_send_cmd_(p, proc_cmd_mkdir_);
+    ps->wait_sqes = malloc(sizeof(struct proc_sqe_) * c->queue_depth
+        + rw_buf_len_);
+    if (ps->wait_sqes == NULL) {
+        SOB_AFS_FAIL_("malloc fd wait");
+        return 0;
+    }
+    ps->wait_buf = (char *) (ps->wait_sqes + c->queue_depth);
+    ps->wait_ctl.st = proc_slot_st_used_;
+    ps->wait_ctl.afs_fd = -1;
+    ps->wait_ctl.queued = 0;
+    ps->wait_ctl.is_readall_queued = 0;
+    ps->wait_ctl.is_fsync_held = 0;
+    ps->wait_next = NULL;
+    ps->p = NULL;
+    ps->slot = 0;
+    if (c->wait_tail != NULL) {
+        c->wait_tail->wait_next = ps;
+    } else {
+        c->wait_head = ps;
+    }
+    c->wait_tail = ps;
+    return 1;
 }
 
-static enum afs_res proc_write_fsync_close_(struct proc_ * p)
+/* takes the ps off the fifo; the caller frees wait_sqes */
+static void ps_unwait_(struct afs_ctx * c, struct ps_ * ps)
 {
-    return proc_send_cmd_(p, proc_cmd_write_fsync_close_);
+    struct ps_ * prev = NULL;
+    struct ps_ * it = c->wait_head;
+    while (it != ps) {
+        prev = it;
+        it = it->wait_next;
+    }
+    if (prev != NULL) {
+        prev->wait_next = ps->wait_next;
+    } else {
+        c->wait_head = ps->wait_next;
+    }
+    if (c->wait_tail == ps) {
+        c->wait_tail = prev;
+    }
+    ps->wait_sqes = NULL;
+    ps->wait_buf = NULL;
+    ps->wait_next = NULL;
 }
 
-static enum afs_res proc_update_(struct proc_ * p,
-    const struct pollfd * fds, size_t fds_len)
+/* gives the free slots to the waiting fds, oldest first, with the
+ * rw_buf and the cmds they got meanwhile */
+static void ps_wait_bind_(struct afs_ctx * c)
 {
-    short revents = 0;
-    if (p->fd != -1) {
+    while (c->wait_head != NULL
+        && c->slots_used < c->procs_maxlen * c->slots_len)
+    {
+        struct ps_ * ps = c->wait_head;
+        struct proc_sqe_ * sqes = ps->wait_sqes;
+        size_t queued = ps->wait_ctl.queued;
         size_t i;
-        for (i = 0; i < fds_len; i++) {
-            if (fds[i].fd == p->fd) {
-                revents = fds[i].revents;
+        if (! ps_bind_(c, ps, ps->fd)) {
+            /* XXX: a fork failed; tried again on the next afs_update */
+            return;
+        }
+        ps_unwait_(c, ps);
+        memcpy(ps_buf_(c, ps), sqes + c->queue_depth, rw_buf_len_);
+        for (i = 0; i < queued; i++) {
+            if (sqes[i].cmd == proc_cmd_fsync_ && c->group_window_us >= 0) {
+                group_hold_(c);
+            }
+            if (ps_send_(c, ps, &sqes[i]) != afs_ok) {
+                /* a fresh slot of a live worker takes up to queue_depth */
+                SOB_PANIC("waiting cmd not taken");
             }
         }
+        free(sqes);
     }
-
-    p->evs_len = 0;
-
-    switch (p->st) {
-    case proc_st_init_pend_:
-        return proc_update_init_pend_(p, revents);
-    case proc_st_busy_:
-        return proc_update_busy_(p, revents);
-    case proc_st_avail_:
-        return proc_update_avail_(p, revents);
-    case proc_st_dead_:
-        return proc_update_dead_(p);
-    case proc_st_uninit_:
-        /* should never get there although legal */
-        if (p->is_stop_req) {
-            p->is_stop_req = 0;
-            SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_stop));
-        }
-        SOB_AFS_PROC_FAIL_("uninit (no errno)");
-        return afs_fail; /* child is terminated, nothing will work */
-    };
-    SOB_PANIC("unreacheable");
-    return afs_fail;
 }
 
-static size_t proc_evs_(struct proc_ * p, struct afs_ev ** evs_out)
+static void * ps_buf_(const struct afs_ctx * c, const struct ps_ * ps)
 {
-    *evs_out = p->evs;
-    return p->evs_len;
+    if (ps->wait_sqes != NULL) {
+        return ps->wait_buf;
+    } else if (ps->p != NULL) {
+        return proc_slot_buf_(ps->p, ps->slot);
+    } else {
+        return ring_slot_buf_(c->ring, ps->slot);
+    }
 }
 
-static int proc_fd_(const struct proc_ * p)
+static size_t ps_buf_len_(const struct afs_ctx * c, const struct ps_ * ps)
 {
-    return p->fd;
+    if (ps->wait_sqes != NULL) {
+        return rw_buf_len_; /* no more than the slot it gets */
+    } else if (ps->p != NULL) {
+        return ps->p->rw_buf_len;
+    } else {
+        return ring_buf_len_(c->ring);
+    }
 }
 
-static enum afs_res proc_stop_prep_(struct proc_ * p)
+static enum afs_res ps_submit_(struct afs_ctx * c,
+    struct ps_ * ps, struct proc_sqe_ * q)
 {
-    if (! p->is_stop_req) {
-        p->is_stop_req = 1;
-        if (p->st == proc_st_avail_) {
-            SOB_AFS_CHECK(proc_send_cmd_(p, proc_cmd_exit_));
-            return afs_ok;
-        } else if (p->st == proc_st_busy_) {
-            return afs_ok; /* is_stop_req will send cmd_exit in update_busy_ */
-        } else {
-            SOB_AFS_PROC_FAIL_("bad st (no errno)");
+    if (c->is_stop_req) {
+        SOB_AFS_FAIL_("stop requested (no errno)");
+        return afs_fail;
+    }
+    q->tag = c->tag;
+    if (ps->wait_sqes != NULL) {
+        /* sent once the fd has a slot, see ps_wait_bind_ */
+        if (! slot_ctl_queue_(&ps->wait_ctl, q->cmd, c->queue_depth,
+                &c->fail))
+        {
             return afs_fail;
         }
-    } else {
-        SOB_AFS_PROC_FAIL_("stop_prep already pending (no errno)");
-        return afs_fail;
+        memcpy(&ps->wait_sqes[ps->wait_ctl.queued - 1], q,
+            sizeof(struct proc_sqe_));
+        return afs_ok;
     }
+    return ps_send_(c, ps, q);
 }
 
-static enum afs_res proc_stop_(struct proc_ * p)
+static enum afs_res ps_send_(struct afs_ctx * c,
+    struct ps_ * ps, const struct proc_sqe_ * q)
 {
-    /* actually stops in update_ */
-    if (p->st != proc_st_uninit_) {
-        SOB_AFS_PROC_FAIL_("not ready to stop (no errno)");
-        return afs_fail;
+    enum afs_res r;
+    if (ps->p != NULL && ps->p->slots[ps->slot].is_fsync_held
+        && is_release_cmd_(q->cmd))
+    {
+        /* the sync needs the fd, and the worker runs its queue in order */
+        group_flush_(c);
     }
-    return afs_ok;
+    if (ps->p != NULL) {
+        r = proc_submit_(ps->p, ps->slot, q);
+        if (r != afs_ok) {
+            memcpy(&c->fail, &ps->p->fail, sizeof(struct sob_fail));
+        }
+    } else {
+        r = ring_submit_(c->ring, ps->slot, q);
+        if (r != afs_ok) {
+            memcpy(&c->fail, ring_fail_(c->ring), sizeof(struct sob_fail));
+        }
+    }
+    return r;
 }
 
-static enum afs_res proc_update_init_pend_(struct proc_ * p, short revents)
+static enum afs_res ps_del_(struct afs_ctx * c, int fd)
 {
-    if (p->is_stop_req) {
-        p->is_stop_req = 0;
-        proc_destroy_child_(p);
-        SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_init_fail));
-        SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_stop));
-        return afs_fail;
+    struct ps_ * ps = ps_get_(c, fd);
+    if (ps == NULL) {
+        SOB_AFS_FAIL_("fd not found (no errno)");
+        return afs_fail_bad_fd;
     }
-
-    if (revents & POLLHUP || revents & POLLERR) {
-        proc_destroy_child_(p);
-        SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_init_fail));
-        SOB_AFS_PROC_FAIL_("child died (no errno)");
-        return afs_fail;
-    } else if (revents & POLLIN) {
-        char throwaway;
-        read(p->fd, &throwaway, 1);
-        if (p->shared->res == proc_res_ok_) {
-            p->st = proc_st_avail_;
-            SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_init));
-            return afs_ok;
-        } else { /* should never happen */
-            proc_destroy_child_(p);
-            SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_init_fail));
-            SOB_AFS_PROC_FAIL_("child failed cmd_none (no errno)");
-            return afs_fail;
+    if (ps->wait_sqes == NULL) { /* else it has no slot yet */
+        if (ps->p != NULL) {
+            proc_slot_free_(ps->p, ps->slot);
+        } else {
+            ring_slot_free_(c->ring, ps->slot);
         }
-    } else { /* still waiting */
-        return afs_ok;
     }
+    ps_free_(c, ps);
+    return afs_ok;
 }
 
-static enum afs_res proc_update_avail_(struct proc_ * p, short revents)
+/* the slots of a destroyed worker are reset already */
+static void ps_del_proc_(struct afs_ctx * c, const struct proc_ * p)
 {
-    if (revents & POLLHUP || revents & POLLERR) {
-        proc_destroy_child_(p);
-        SOB_AFS_PROC_FAIL_("child died (no errno)");
-        return afs_fail;
-    } else {
-        return afs_ok;
+    size_t i;
+    for (i = 0; i < c->ps_len; i++) {
+        if (c->ps[i].fd != -1 && c->ps[i].p == p) {
+            ps_free_(c, &c->ps[i]);
+        }
     }
 }
 
-static enum afs_res proc_update_busy_(struct proc_ * p, short revents)
+static struct ps_ * ps_get_(struct afs_ctx * c, int fd)
 {
-    if (revents & POLLHUP || revents & POLLERR) {
-        SOB_AFS_PROC_CHECK_EV_(
-            proc_add_ev_(p, proc_cmd_fail_ev_(p->shared->cmd)));
-        proc_destroy_child_(p); /* p->shared is NULL afterwards */
-        SOB_AFS_PROC_FAIL_("child died (no errno)");
-        return afs_fail;
-    } else if (revents & POLLIN) {
-        char throwaway;
-        (void) read(p->fd, &throwaway, 1);
+    struct ps_ * ps;
+    if (fd < 0 || c->ps_len == 0) {
+        return NULL;
+    }
+    ps = &c->ps[(size_t) fd % c->ps_len];
+    /* the gen is a part of the fd, so this also catches stale ones */
+    return (ps->fd == fd) ? ps : NULL;
+}
+
+static void ps_free_(struct afs_ctx * c, struct ps_ * ps)
+{
+    if (ps->wait_sqes != NULL) {
+        struct proc_sqe_ * sqes = ps->wait_sqes;
+        ps_unwait_(c, ps);
+        free(sqes);
+    } else {
+        c->slots_used--;
+    }
+    ps->fd = -1;
+    ps->gen = (ps->gen + 1) % c->ps_gens;
+    ps->next_free = c->ps_free;
+    c->ps_free = ps - c->ps;
+}
+
+static void sqe_init_(struct proc_sqe_ * q, enum proc_cmd_ cmd)
+{
+    q->cmd = cmd;
+    q->slot = 0;
+    q->tag = 0;
+    q->buf_off = 0;
+    q->write_len = 0;
+    q->open_flags = 0;
+    q->slices_len = 0;
+    q->write_off = -1;
+}
+
+/* admits one more cmd on the fd; shared by the workers and the ring */
+static int slot_ctl_queue_(struct proc_slot_ctl_ * ctl,
+    enum proc_cmd_ cmd, size_t queue_depth, struct sob_fail * fail)
+{
+    errno = 0;
+    if (ctl->st != proc_slot_st_used_) {
+        SOB_FAIL_INIT(fail, "fd is closing (no errno)");
+        return 0;
+    }
+    if (ctl->queued >= queue_depth) {
+        SOB_FAIL_INIT(fail, "fd queue is full (no errno)");
+        return 0;
+    }
+    if (cmd == proc_cmd_readall_ && ctl->is_readall_queued) {
+        SOB_FAIL_INIT(fail, "readall is already queued (no errno)");
+        return 0;
+    }
+    ctl->queued++;
+    if (cmd == proc_cmd_readall_) {
+        ctl->is_readall_queued = 1;
+    }
+    if (is_release_cmd_(cmd)) {
+        ctl->st = proc_slot_st_closing_;
+    }
+    return 1;
+}
+
+/* the afs fd is released after these */
+static int is_release_cmd_(enum proc_cmd_ cmd)
+{
+    switch (cmd) {
+    case proc_cmd_close_:
+    case proc_cmd_mkdir_:
+    case proc_cmd_write_fsync_close_:
+    case proc_cmd_map_:
+    case proc_cmd_replace_:
+        return 1;
+    default:
+        return 0;
+    };
+}
+
+static void slot_ctl_done_(struct proc_slot_ctl_ * ctl, enum proc_cmd_ cmd)
+{
+    ctl->queued--;
+    if (cmd == proc_cmd_readall_) {
+        ctl->is_readall_queued = 0;
+    }
+}
+
+/* fills a success event for a completed cmd */
+static void cqe_ev_(struct afs_ev * ev, const struct proc_sqe_ * q,
+    const struct proc_cqe_ * cq, void * rw_buf)
+{
+    ev->tag = q->tag;
+    switch (q->cmd) {
+        case proc_cmd_none_:
+        case proc_cmd_exit_:
+        case proc_cmd_group_sync_:
+            SOB_PANIC("not a slot cmd");
+            break;
+        case proc_cmd_open_:
+            ev->ty = afs_ev_open;
+            break;
+        case proc_cmd_close_:
+            ev->ty = afs_ev_close;
+            break;
+        case proc_cmd_fsync_:
+            ev->ty = afs_ev_fsync;
+            break;
+        case proc_cmd_write_:
+        case proc_cmd_writev_:
+            ev->ty = afs_ev_write;
+            ev->d.write.len = cq->written;
+            break;
+        case proc_cmd_readall_:
+            ev->ty = afs_ev_readall;
+            ev->d.readall.len = cq->read_len;
+            ev->d.readall.off = 0;
+            ev->d.readall.data = rw_buf;
+            break;
+        case proc_cmd_readall_stream_:
+            /* the chunks went before it */
+            ev->ty = afs_ev_readall;
+            ev->d.readall.len = 0;
+            ev->d.readall.off = cq->read_len;
+            ev->d.readall.data = NULL;
+            break;
+        case proc_cmd_mkdir_:
+            ev->ty = afs_ev_mkdir;
+            break;
+        case proc_cmd_write_fsync_close_:
+            ev->ty = afs_ev_write_fsync_close;
+            ev->d.write.len = cq->written;
+            break;
+        case proc_cmd_replace_:
+            ev->ty = afs_ev_replace;
+            ev->d.write.len = cq->written;
+            break;
+        case proc_cmd_map_:
+            /* the caller maps the fd it got */
+            ev->ty = afs_ev_map;
+            ev->d.map.len = 0;
+            ev->d.map.data = NULL;
+            break;
+    };
+}
+
+/* points the iovecs at the slices of a writev; returns their count */
+static size_t iov_init_(struct iovec * iov, const struct proc_sqe_ * q,
+    char * rw_buf)
+{
+    size_t i;
+    for (i = 0; i < q->slices_len; i++) {
+        iov[i].iov_base = rw_buf + q->slices[i].off;
+        iov[i].iov_len = q->slices[i].len;
+    }
+    return q->slices_len;
+}
+
+/* drops what a short write has written */
+static struct iovec * iov_skip_(struct iovec * iov, size_t * iov_len,
+    size_t len)
+{
+    while (*iov_len > 0 && len >= iov->iov_len) {
+        len -= iov->iov_len;
+        iov++;
+        (*iov_len)--;
+    }
+    if (*iov_len > 0) {
+        iov->iov_base = (char *) iov->iov_base + len;
+        iov->iov_len -= len;
+    }
+    return iov;
+}
+
+/* fstat of an open fd and mmap do no io, so it is fine in the loop;
+ * pages are faulted in as they are read. takes the fd */
+static int map_fd_(int fd, struct afs_ev * ev, struct sob_fail * fail)
+{
+    struct stat st;
+    void * data;
+    if (fstat(fd, &st) != 0) {
+        SOB_FAIL_INIT(fail, "fstat");
+        close(fd);
+        return 0;
+    }
+    if (! S_ISREG(st.st_mode)) {
+        errno = 0;
+        SOB_FAIL_INIT(fail, "not a regular file (no errno)");
+        close(fd);
+        return 0;
+    }
+    ev->d.map.len = st.st_size;
+    ev->d.map.data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            SOB_FAIL_INIT(fail, "mmap");
+            close(fd);
+            return 0;
+        }
+        ev->d.map.data = data;
+    }
+    close(fd); /* the mapping keeps the file */
+    return 1;
+}
+
+static enum afs_res proc_init_(struct proc_ * p)
+{
+    int sv[2]; /* [0] for parent, [1] for child */
+    pid_t pid;
+    size_t pgs = sysconf(_SC_PAGESIZE);
+    size_t queues_len;
+    size_t chunk_stride;
+    size_t i;
+    struct proc_child_ ch;
+
+    p->evs_len = 0;
+    p->is_stop_req = 0;
+    p->slots_used = 0;
+    p->sq_tail = 0;
+    p->cq_head = 0;
+    p->stream_head = 0;
+    p->stream_seen = 0;
+    /* if something goes wrong we might accidentally kill ourselves
+     * but not others; should never happen though */
+    p->pid = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        SOB_AFS_PROC_FAIL_("socketpair");
+        return afs_fail;
+    }
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) & ~O_NONBLOCK);
+
+    /* first pages are for proc_shared_, the queues and the held fsyncs,
+     * then for chunks, then one page multiple per slot */
+    queues_len = sizeof(struct proc_shared_)
+        + p->sqes_len * (sizeof(struct proc_sqe_) + sizeof(struct proc_cqe_)
+            + sizeof(struct proc_held_))
+        + p->chunks_len * sizeof(struct proc_chunk_);
+    queues_len = ((queues_len - 1) / pgs + 1) * pgs;
+    chunk_stride = ((p->chunk_len - 1) / pgs + 1) * pgs;
+    p->slot_stride = ((rw_buf_len_ - 1) / pgs + 1) * pgs;
+    p->mmap_len = queues_len + chunk_stride * p->chunks_len
+        + p->slot_stride * p->slots_len;
+    p->mmap_start = mmap(NULL, p->mmap_len,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p->mmap_start == MAP_FAILED) {
+        SOB_AFS_PROC_FAIL_("mmap");
+        close(sv[0]);
+        close(sv[1]);
+        return afs_fail;
+    }
+    p->shared = (struct proc_shared_ *)p->mmap_start;
+    p->shared->sq_tail = 0;
+    p->shared->cq_tail = 0;
+    p->shared->stream_head = 0;
+    p->shared->stream_tail = 0;
+    p->shared->is_child_asleep = 0;
+    p->shared->is_parent_notified = 0;
+    p->shared->st = proc_child_st_not_started_;
+    p->sqes = (struct proc_sqe_ *) (p->shared + 1);
+    p->cqes = (struct proc_cqe_ *) (p->sqes + p->sqes_len);
+    p->chunks = (struct proc_chunk_ *) (p->cqes + p->sqes_len);
+    p->held = (struct proc_held_ *) (p->chunks + p->chunks_len);
+    p->chunk_len = chunk_stride; /* the spare bytes are used too */
+    p->chunks_mem = ((char *) p->mmap_start) + queues_len;
+
+    p->slots_mem = p->chunks_mem + chunk_stride * p->chunks_len;
+    p->rw_buf_len = p->slot_stride;
+    for (i = 0; i < p->slots_len; i++) {
+        p->slots[i].st = proc_slot_st_free_;
+        p->slots[i].afs_fd = -1;
+        p->slots[i].queued = 0;
+        p->slots[i].is_readall_queued = 0;
+        p->slots[i].is_fsync_held = 0;
+    }
+    p->held_head = 0;
+    p->held_len = 0;
+    p->held_unflushed = 0;
+
+    pid = fork();
+    if (pid == -1) {
+        SOB_AFS_PROC_FAIL_("fork");
+        close(sv[0]);
+        close(sv[1]);
+        munmap(p->mmap_start, p->mmap_len);
+        p->mmap_start = NULL;
+        p->mmap_len = 0;
+        p->slots_mem = NULL;
+        p->rw_buf_len = 0;
+        p->shared = NULL;
+        p->sqes = NULL;
+        p->cqes = NULL;
+        p->chunks = NULL;
+        p->chunks_mem = NULL;
+        p->held = NULL;
+        return afs_fail;
+    } else if (pid == 0) { /* child */
+        close(sv[0]);
+        ch.parent_fd = sv[1];
+        ch.s = p->shared;
+        ch.sqes = p->sqes;
+        ch.cqes = p->cqes;
+        ch.sqes_len = p->sqes_len;
+        ch.chunks = p->chunks;
+        ch.chunks_mem = p->chunks_mem;
+        ch.chunks_len = p->chunks_len;
+        ch.chunk_len = p->chunk_len;
+        ch.held = p->held;
+        ch.slots_mem = p->slots_mem;
+        ch.slot_stride = p->slot_stride;
+        ch.slots_len = p->slots_len;
+        _exit(proc_child_worker_(&ch));
+    }
+    /* parent continues */
+    close(sv[1]);
+
+    p->pid = pid;
+    p->fd = sv[0];
+    /* the child notifies us when started; cmds may be queued meanwhile */
+    p->st = proc_st_init_pend_;
+    return afs_ok;
+}
+
+static int proc_slot_alloc_(struct proc_ * p, int afs_fd, size_t * slot_out)
+{
+    size_t i;
+    for (i = 0; i < p->slots_len; i++) {
+        if (p->slots[i].st == proc_slot_st_free_) {
+            p->slots[i].st = proc_slot_st_used_;
+            p->slots[i].afs_fd = afs_fd;
+            p->slots[i].queued = 0;
+            p->slots[i].is_readall_queued = 0;
+            p->slots[i].is_fsync_held = 0;
+            p->slots_used++;
+            *slot_out = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void proc_slot_free_(struct proc_ * p, size_t slot)
+{
+    if (p->slots[slot].st != proc_slot_st_free_) {
+        p->slots[slot].st = proc_slot_st_free_;
+        p->slots[slot].afs_fd = -1;
+        p->slots_used--;
+    }
+}
+
+static void * proc_slot_buf_(const struct proc_ * p, size_t slot)
+{
+    return p->slots_mem + slot * p->slot_stride;
+}
+
+static enum afs_res proc_submit_(struct proc_ * p,
+    size_t slot, const struct proc_sqe_ * q)
+{
+    struct proc_sqe_ * sqe;
+    if (p->st == proc_st_uninit_ || p->st == proc_st_dead_) {
+        SOB_AFS_PROC_FAIL_("bad st (no errno)");
+        return afs_fail;
+    }
+    if (! slot_ctl_queue_(&p->slots[slot], q->cmd, p->queue_depth,
+            &p->fail))
+    {
+        return afs_fail;
+    }
+    if (q->cmd == proc_cmd_fsync_ && p->is_group) {
+        /* counted in queued like any cmd, so it fits in held */
+        struct proc_held_ * h = &p->held[(p->held_head + p->held_len)
+            % p->sqes_len];
+        h->slot = slot;
+        h->tag = q->tag;
+        p->held_len++;
+        p->held_unflushed++;
+        p->slots[slot].is_fsync_held = 1;
+        return afs_ok;
+    }
+    /* slot_ctl_queue_ keeps the unreaped cmds below sqes_len */
+    sqe = &p->sqes[p->sq_tail % p->sqes_len];
+    memcpy(sqe, q, sizeof(struct proc_sqe_));
+    sqe->slot = slot;
+    return proc_push_(p);
+}
+
+/* publishes the sqe at sq_tail and wakes the child if it sleeps */
+static enum afs_res proc_push_(struct proc_ * p)
+{
+    p->sq_tail++;
+    __atomic_store_n(&p->shared->sq_tail, p->sq_tail, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->shared->is_child_asleep, __ATOMIC_SEQ_CST)) {
+        /* on fail the worker is dead and proc_update_dead_ reports
+         * the queued cmds, this one included */
+        (void) proc_notify_child_(p);
+    }
+    return afs_ok;
+}
+
+/* one fdatasync per file stands for all the held fsyncs on it; the child
+ * runs the queue in order, so it covers whatever was written before them.
+ * gives the fdatasyncs it makes */
+static size_t proc_group_flush_(struct proc_ * p)
+{
+    struct proc_sqe_ * sqe;
+    size_t syncs = 0;
+    size_t i;
+    if (p->held_unflushed == 0 || p->shared == NULL) {
+        return 0;
+    }
+    sqe = &p->sqes[p->sq_tail % p->sqes_len];
+    sqe_init_(sqe, proc_cmd_group_sync_);
+    sqe->buf_off = (p->held_head + p->held_len - p->held_unflushed)
+        % p->sqes_len;
+    for (i = 0; i < p->held_unflushed; i++) {
+        const struct proc_held_ * h = &p->held[(sqe->buf_off + i)
+            % p->sqes_len];
+        syncs += p->slots[h->slot].is_fsync_held;
+        p->slots[h->slot].is_fsync_held = 0;
+    }
+    sqe->write_len = p->held_unflushed;
+    p->held_unflushed = 0;
+    (void) proc_push_(p);
+    return syncs;
+}
+
+/* makes events for the cmds the child has completed */
+static enum afs_res proc_reap_(struct proc_ * p)
+{
+    size_t cq_tail;
+    size_t stream_tail;
+    __atomic_store_n(&p->shared->is_parent_notified, 0, __ATOMIC_SEQ_CST);
+    cq_tail = __atomic_load_n(&p->shared->cq_tail, __ATOMIC_SEQ_CST);
+    /* after cq_tail, so a completed stream has all of its chunks here */
+    stream_tail = __atomic_load_n(&p->shared->stream_tail, __ATOMIC_SEQ_CST);
+    while (p->cq_head != cq_tail) {
+        size_t i = p->cq_head % p->sqes_len;
+        const struct proc_sqe_ * q = &p->sqes[i];
+        const struct proc_cqe_ * cq = &p->cqes[i];
+        struct proc_slot_ctl_ * ctl;
+
+        if (q->cmd == proc_cmd_readall_stream_) {
+            SOB_AFS_CHECK(proc_reap_chunks_(p, stream_tail, p->cq_head));
+        }
+        p->cq_head++;
+
+        if (q->cmd == proc_cmd_exit_) {
+            /* child should've already terminated at this point */
+            proc_destroy_child_(p);
+            if (p->is_stop_req) {
+                p->is_stop_req = 0;
+                SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_stop, -1, 0));
+            }
+            SOB_AFS_PROC_FAIL_("exit successful (no errno)");
+            return afs_fail; /* because child is destroyed */
+        }
+
+        if (q->cmd == proc_cmd_group_sync_) {
+            SOB_AFS_CHECK(proc_reap_held_(p, q, cq));
+            continue;
+        }
 
-        if (p->shared->res == proc_res_ok_) {
+        ctl = &p->slots[q->slot];
+        slot_ctl_done_(ctl, q->cmd);
+        if (cq->res == proc_res_ok_) {
             struct afs_ev * ev = NULL;
-            if (p->shared->cmd != proc_cmd_none_) {
-                ev = proc_add_ev_(p, afs_ev_init); /* this ty is unused */
-                SOB_AFS_PROC_CHECK_EV_(ev);
+            /* this ty is unused */
+            ev = proc_add_ev_(p, afs_ev_init, ctl->afs_fd, q->tag);
+            SOB_AFS_PROC_CHECK_EV_(ev);
+            cqe_ev_(ev, q, cq, proc_slot_buf_(p, q->slot));
+            if (q->cmd == proc_cmd_map_ && ! proc_map_(p, ev)) {
+                ev->ty = afs_ev_map_fail;
             }
-            switch (p->shared->cmd) {
-                case proc_cmd_none_:
-                    break; /* should never happen although legal */
-                case proc_cmd_exit_:
-                    p->is_stop_req = 0;
-                    /* child should've already terminated at this point */
-                    proc_destroy_child_(p);
-                    if (p->is_stop_req) {
-                        SOB_AFS_PROC_CHECK_EV_(
-                            proc_add_ev_(p, afs_ev_stop));
-                    }
-                    SOB_AFS_PROC_FAIL_("exit successful (no errno)");
-                    return afs_fail; /* because child is destroyed */
-                case proc_cmd_open_:
-                    ev->ty = afs_ev_open;
-                    break;
-                case proc_cmd_close_:
-                    ev->ty = afs_ev_close;
-                    break;
-                case proc_cmd_fsync_:
-                    ev->ty = afs_ev_fsync;
-                    break;
-                case proc_cmd_write_:
-                    ev->ty = afs_ev_write;
-                    ev->d.write.len = p->shared->written;
-                    break;
-                case proc_cmd_readall_:
-                    ev->ty = afs_ev_readall;
-                    ev->d.readall.len = p->shared->read_len;
-                    ev->d.readall.data = p->rw_buf;
-                    break;
-                case proc_cmd_mkdir_:
-                    ev->ty = afs_ev_mkdir;
-                    break;
-                case proc_cmd_write_fsync_close_:
-                    ev->ty = afs_ev_write_fsync_close;
-                    ev->d.write.len = p->shared->written;
-                    break;
-            };
-            p->shared->cmd = proc_cmd_none_;
         } else {
-            memcpy(&p->fail, &p->shared->fail, sizeof(struct sob_fail));
-            /* gotta watch out for proc_cmd_exit_ so that it never fails */
+            memcpy(&p->fail, &cq->fail, sizeof(struct sob_fail));
             /* child is still intact so it's not afs_fail */
-            SOB_AFS_PROC_CHECK_EV_(
-                proc_add_ev_(p, proc_cmd_fail_ev_(p->shared->cmd)));
+            SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p,
+                proc_cmd_fail_ev_(q->cmd), ctl->afs_fd, q->tag));
         }
-        p->st = proc_st_avail_;
+    }
+    /* of the stream that is still running */
+    return proc_reap_chunks_(p, stream_tail, cq_tail);
+}
+
+/* completes the fsyncs the sync stood for, each by its file */
+static enum afs_res proc_reap_held_(struct proc_ * p,
+    const struct proc_sqe_ * q, const struct proc_cqe_ * cq)
+{
+    size_t i;
+    if (cq->res != proc_res_ok_) {
+        memcpy(&p->fail, &cq->fail, sizeof(struct sob_fail));
+    }
+    for (i = 0; i < q->write_len && p->held_len > 0; i++) {
+        const struct proc_held_ * h = &p->held[p->held_head];
+        struct proc_slot_ctl_ * ctl = &p->slots[h->slot];
+        p->held_head = (p->held_head + 1) % p->sqes_len;
+        p->held_len--;
+        slot_ctl_done_(ctl, proc_cmd_fsync_);
+        SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, (h->res == proc_res_ok_)
+            ? afs_ev_fsync : afs_ev_fsync_fail, ctl->afs_fd, h->tag));
+    }
+    return afs_ok;
+}
+
+static enum afs_res proc_reap_chunks_(struct proc_ * p,
+    size_t stream_tail, size_t sqe)
+{
+    while (p->stream_seen != stream_tail) {
+        size_t i = p->stream_seen % p->chunks_len;
+        const struct proc_chunk_ * chunk = &p->chunks[i];
+        const struct proc_sqe_ * q = &p->sqes[sqe % p->sqes_len];
+        struct afs_ev * ev;
+        if (chunk->sqe != sqe) {
+            return afs_ok;
+        }
+        ev = proc_add_ev_(p, afs_ev_readall, p->slots[q->slot].afs_fd, q->tag);
+        SOB_AFS_PROC_CHECK_EV_(ev);
+        ev->d.readall.len = chunk->len;
+        ev->d.readall.off = chunk->off;
+        ev->d.readall.data = p->chunks_mem + i * p->chunk_len;
+        p->stream_seen++;
+    }
+    return afs_ok;
+}
+
+/* lets the child reuse the chunks of the evs taken by now */
+static void proc_release_chunks_(struct proc_ * p)
+{
+    if (p->shared == NULL || p->stream_head == p->stream_seen) {
+        return;
+    }
+    p->stream_head = p->stream_seen;
+    __atomic_store_n(&p->shared->stream_head, p->stream_head,
+        __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->shared->is_child_asleep, __ATOMIC_SEQ_CST)) {
+        /* on fail the worker is dead; afs_update finds out */
+        (void) proc_notify_child_(p);
+    }
+}
+
+/* drains the wakeup bytes, keeping the fds of proc_cmd_map_ */
+static enum afs_res proc_recv_(struct proc_ * p)
+{
+    while (1) {
+        char throwaway[16];
+        union {
+            struct cmsghdr h; /* for alignment */
+            char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr * cmsg;
+        ssize_t r;
+
+        iov.iov_base = throwaway;
+        iov.iov_len = sizeof(throwaway);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        r = recvmsg(p->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        } else if (r <= 0) {
+            /* EAGAIN, or hup which the caller handles */
+            return afs_ok;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            int fd;
+            if (cmsg->cmsg_level != SOL_SOCKET
+                || cmsg->cmsg_type != SCM_RIGHTS)
+            {
+                continue;
+            }
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            if (p->map_fds_len == p->sqes_len) {
+                /* never happens: one fd per queued cmd at most */
+                close(fd);
+                continue;
+            }
+            p->map_fds[(p->map_fds_head + p->map_fds_len) % p->sqes_len] = fd;
+            p->map_fds_len++;
+        }
+        /* the kernel stops a read at a message with fds, one fd each */
+        if (msg.msg_flags & MSG_CTRUNC) {
+            errno = 0;
+            SOB_AFS_PROC_FAIL_("fds cut (no errno)");
+            return afs_fail;
+        }
+    }
+}
+
+/* the child sends the fd before publishing the cqe, so it is here by now */
+static int proc_map_(struct proc_ * p, struct afs_ev * ev)
+{
+    int fd;
+    if (p->map_fds_len == 0 && proc_recv_(p) != afs_ok) {
+        return 0;
+    }
+    if (p->map_fds_len == 0) {
+        errno = 0;
+        SOB_AFS_PROC_FAIL_("no fd for map (no errno)");
+        return 0;
+    }
+    fd = p->map_fds[p->map_fds_head];
+    p->map_fds_head = (p->map_fds_head + 1) % p->sqes_len;
+    p->map_fds_len--;
+    return map_fd_(fd, ev, &p->fail);
+}
+
+static enum afs_res proc_update_(struct proc_ * p,
+    const struct pollfd * fds, size_t fds_len)
+{
+    short revents = 0;
+    if (p->fd != -1) {
+        size_t i;
+        for (i = 0; i < fds_len; i++) {
+            if (fds[i].fd == p->fd) {
+                revents = fds[i].revents;
+            }
+        }
+    }
+
+    p->evs_len = 0;
+
+    switch (p->st) {
+    case proc_st_init_pend_:
+    case proc_st_avail_:
+        return proc_update_live_(p, revents);
+    case proc_st_dead_:
+        return proc_update_dead_(p);
+    case proc_st_uninit_:
+        /* should never get there although legal */
+        if (p->is_stop_req) {
+            p->is_stop_req = 0;
+            SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_stop, -1, 0));
+        }
+        SOB_AFS_PROC_FAIL_("uninit (no errno)");
+        return afs_fail; /* child is terminated, nothing will work */
+    };
+    SOB_PANIC("unreacheable");
+    return afs_fail;
+}
+
+static size_t proc_evs_(struct proc_ * p, struct afs_ev ** evs_out)
+{
+    *evs_out = p->evs;
+    return p->evs_len;
+}
+
+static int proc_fd_(const struct proc_ * p)
+{
+    return p->fd;
+}
+
+static enum afs_res proc_stop_prep_(struct proc_ * p)
+{
+    if (! p->is_stop_req) {
+        struct proc_sqe_ * sqe = &p->sqes[p->sq_tail % p->sqes_len];
+        p->is_stop_req = 1;
+        /* queued cmds are run first; sqes_len has room for this one */
+        sqe_init_(sqe, proc_cmd_exit_);
+        return proc_push_(p);
+    } else {
+        SOB_AFS_PROC_FAIL_("stop_prep already pending (no errno)");
+        return afs_fail;
+    }
+}
+
+static enum afs_res proc_stop_(struct proc_ * p)
+{
+    /* actually stops in update_ */
+    if (p->st != proc_st_uninit_) {
+        SOB_AFS_PROC_FAIL_("not ready to stop (no errno)");
+        return afs_fail;
+    }
+    return afs_ok;
+}
+
+static enum afs_res proc_update_live_(struct proc_ * p, short revents)
+{
+    if (revents & POLLIN) {
+        /* a byte per notification; a few may pile up */
+        (void) proc_recv_(p);
+    }
+    if (p->st == proc_st_init_pend_ && __atomic_load_n(&p->shared->st,
+            __ATOMIC_SEQ_CST) == proc_child_st_running_)
+    {
+        p->st = proc_st_avail_;
+        SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_init, -1, 0));
+    }
+    /* the child may have completed something before dying */
+    if (p->st == proc_st_avail_ && proc_reap_(p) != afs_ok) {
+        return afs_fail;
+    }
+    if (revents & POLLHUP || revents & POLLERR) {
+        SOB_AFS_PROC_FAIL_("child died (no errno)");
+        if (p->st == proc_st_init_pend_) {
+            SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_init_fail, -1, 0));
+        }
+        return proc_die_(p);
+    }
+    return afs_ok;
+}
+
+static enum afs_res proc_update_dead_(struct proc_ * p)
+{
+    if (p->is_stop_req) {
+        p->is_stop_req = 0;
+        SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_stop_fail, -1, 0));
+    }
+    SOB_AFS_PROC_FAIL_("child is dead (no errno)");
+    return proc_die_(p);
+}
+
+static enum afs_res proc_notify_child_(struct proc_ * p)
+{
+    while (1) {
+        char throwaway = 0;
+        if (write(p->fd, &throwaway, 1) == 1) {
+            return afs_ok;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return afs_ok; /* the child has plenty of wakeups to read */
+        } else {
+            SOB_AFS_PROC_FAIL_("write");
+            p->st = proc_st_dead_;
+            return afs_fail;
+        }
+    }
+}
+
+/* fails every queued or running cmd and destroys the child */
+static enum afs_res proc_die_(struct proc_ * p)
+{
+    size_t i;
+    for (i = p->cq_head; p->shared != NULL && i != p->sq_tail; i++) {
+        const struct proc_sqe_ * q = &p->sqes[i % p->sqes_len];
+        if (q->cmd != proc_cmd_exit_ && q->cmd != proc_cmd_group_sync_) {
+            SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, proc_cmd_fail_ev_(q->cmd),
+                p->slots[q->slot].afs_fd, q->tag));
+        }
+    }
+    /* flushed or not */
+    for (i = 0; i < p->held_len; i++) {
+        const struct proc_held_ * h = &p->held[(p->held_head + i)
+            % p->sqes_len];
+        SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_fsync_fail,
+            p->slots[h->slot].afs_fd, h->tag));
+    }
+    proc_destroy_child_(p); /* p->shared is NULL afterwards */
+    return afs_fail;
+}
+
+static void proc_destroy_child_(struct proc_ * p)
+{
+    size_t i;
+    if (p->pid > 0) {
+        (void) kill(p->pid, SIGKILL);
+        /* MAY BLOCK; if so we have bigger problems though */
+        while (1) {
+            int wstatus;
+            int r = waitpid(p->pid, &wstatus, 0);
+            if (r == -1 && errno == EINTR) {
+                continue;
+            } else {
+                /* even if waitpid fails the zombie is already reaped */
+                break;
+            }
+        }
+        p->pid = 0;
+    }
+
+    close(p->fd);
+    p->fd = -1;
+    for (i = 0; i < p->map_fds_len; i++) {
+        close(p->map_fds[(p->map_fds_head + i) % p->sqes_len]);
+    }
+    p->map_fds_head = 0;
+    p->map_fds_len = 0;
+    munmap(p->mmap_start, p->mmap_len);
+    p->mmap_start = NULL;
+    p->mmap_len = 0;
+    p->slots_mem = NULL;
+    p->rw_buf_len = 0;
+    p->shared = NULL;
+    p->sqes = NULL;
+    p->cqes = NULL;
+    p->chunks = NULL;
+    p->chunks_mem = NULL;
+    p->held = NULL;
+    p->sq_tail = 0;
+    p->cq_head = 0;
+    p->stream_head = 0;
+    p->stream_seen = 0;
+
+    /* afs drops the fds of a destroyed worker */
+    for (i = 0; i < p->slots_len; i++) {
+        p->slots[i].st = proc_slot_st_free_;
+        p->slots[i].afs_fd = -1;
+        p->slots[i].queued = 0;
+        p->slots[i].is_readall_queued = 0;
+        p->slots[i].is_fsync_held = 0;
+    }
+    p->slots_used = 0;
+    p->held_head = 0;
+    p->held_len = 0;
+    p->held_unflushed = 0;
+
+    p->st = proc_st_uninit_;
+}
+
+static struct afs_ev * proc_add_ev_(struct proc_ * p,
+    enum afs_event ty, int afs_fd, unsigned long tag)
+{
+    if (p->evs_len < p->sqes_len + p->chunks_len + proc_evs_extra_len_) {
+        struct afs_ev * r = &p->evs[p->evs_len];
+        p->evs_len++;
+        r->ty = ty;
+        r->fd = afs_fd; /* its internal, not actual fd */
+        r->tag = tag;
+        return r;
+    } else {
+        return NULL;
+    }
+}
+
+#ifdef SOB_AFS_URING
+
+/* a slot runs its cmd as a chain of ops with one sqe in flight at a time;
+ * the step is the op in flight */
+enum ring_step_ {
+    ring_step_none_ = 0,
+    ring_step_fail_, /* nop carrying a fail found before any io */
+    ring_step_open_,
+    ring_step_close_,
+    ring_step_fsync_,
+    ring_step_write_,
+    ring_step_read_,
+    ring_step_mkdir_,
+    ring_step_mkdir_open_,
+    ring_step_mkdir_fsync_,
+    ring_step_mkdir_open_parent_,
+    ring_step_mkdir_fsync_parent_,
+    ring_step_tmp_open_,
+    ring_step_tmp_write_,
+    ring_step_tmp_fsync_,
+    ring_step_stream_,
+    ring_step_map_open_,
+    ring_step_map_fadvise_,
+    ring_step_writev_,
+    ring_step_rename_
+};
+
+struct ring_slot_ {
+    struct proc_slot_ctl_ ctl;
+    struct proc_sqe_ * q; /* queue_depth of them, running one at q_head */
+    size_t q_head;
+    size_t q_len;
+    struct proc_cqe_ cq; /* of the running one */
+    enum ring_step_ step;
+    /* with the group commit, an fsync leaves the queue to wait for
+     * ring_group_flush_, and the cmds after it go on */
+    unsigned long * sync_tags; /* queue_depth; of the waiting fsyncs */
+    size_t sync_len;
+    size_t sync_flight; /* the first ones, the fdatasync in flight is for */
+    int is_close_held; /* its close waits for them */
+    int is_exist; /* mkdir found the dir already there */
+    int fd; /* actual fd */
+    int tmp_fd; /* used by mkdir, write_fsync_close, replace and map */
+    char * rw_buf;
+    char * stream_buf; /* two chunks, on first readall_stream */
+    size_t stream_i; /* the half being read into */
+    struct iovec iov_mem[SOB_AFS_SLICES_MAX]; /* of the running writev */
+    struct iovec * iov;
+    size_t iov_len;
+};
+
+struct ring_ {
+    struct sob_fail fail;
+    int fd;
+    int evfd; /* registered with the ring, polled by the caller */
+    struct ring_slot_ * slots;
+    size_t slots_len;
+    struct proc_sqe_ * queued; /* queue_depth per slot */
+    size_t queue_depth;
+    size_t chunk_len;
+    int is_group;
+    size_t held_len; /* fsyncs waiting for ring_group_flush_ */
+    unsigned long * sync_tags;
+    char * bufs;
+    struct afs_ev * evs; /* evs_maxlen */
+    size_t evs_len;
+    size_t evs_maxlen;
+    size_t inflight; /* queued or submitted sqes */
+    unsigned to_submit;
+
+    void * sq_mem;
+    size_t sq_mem_len;
+    void * cq_mem; /* same as sq_mem with IORING_FEAT_SINGLE_MMAP */
+    size_t cq_mem_len;
+    struct io_uring_sqe * sqes;
+    size_t sqes_len;
+    unsigned * sq_tail;
+    unsigned * sq_array;
+    unsigned sq_mask;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe * cqes;
+};
+
+static const char ring_parent_path_[] = "..";
+
+static int ring_probe_(int fd);
+static struct io_uring_sqe * ring_sqe_(struct ring_ * r,
+    size_t slot, enum ring_step_ step, int opcode, int fd);
+static void ring_start_(struct ring_ * r, size_t slot);
+static void ring_step_(struct ring_ * r, size_t slot, int res);
+static void ring_stream_chunk_(struct ring_ * r, size_t slot, int res);
+static void ring_done_(struct ring_ * r, size_t slot, enum proc_res_ res);
+static void ring_next_(struct ring_ * r, size_t slot);
+static void ring_synced_(struct ring_ * r, size_t slot, int res);
+static struct afs_ev * ring_add_ev_(struct ring_ * r, size_t slot);
+static void ring_read_chunk_(struct ring_ * r, size_t slot);
+static void ring_writev_(struct ring_ * r, size_t slot);
+static void ring_close_tmp_(struct ring_slot_ * rs);
+
+#define SOB_AFS_RING_FAIL_(msg) SOB_FAIL_INIT(&r->fail, msg);
+/* the fail is reported from ring_update_ like any other */
+#define SOB_AFS_RING_DEFER_FAIL_(msg) \
+    do { \
+        errno = 0; \
+        SOB_AFS_PROC_C_FAIL_(msg); \
+        (void) ring_sqe_(r, slot, ring_step_fail_, IORING_OP_NOP, -1); \
+    } while (0)
+/* res is -errno of a cqe */
+#define SOB_AFS_RING_STEP_FAIL_(res, msg) \
+    do { \
+        errno = -(res); \
+        SOB_AFS_PROC_C_FAIL_(msg); \
+        ring_done_(r, slot, proc_res_fail_); \
+        return; \
+    } while (0)
+
+static enum afs_res ring_init_(struct ring_ ** r_out,
+    size_t slots_len, size_t queue_depth, size_t chunk_len, int is_group,
+    struct sob_fail * fail_out)
+{
+    struct io_uring_params params;
+    struct ring_ * r;
+    size_t i;
+
+    r = malloc(sizeof(struct ring_));
+    if (r == NULL) {
+        SOB_FAIL_INIT(fail_out, "malloc ring");
+        return afs_fail_alloc;
+    }
+    r->fd = -1;
+    r->evfd = -1;
+    r->slots_len = 0; /* until the slots are set up */
+    r->evs_len = 0;
+    r->inflight = 0;
+    r->to_submit = 0;
+    r->sq_mem = MAP_FAILED;
+    r->cq_mem = MAP_FAILED;
+    r->sqes = MAP_FAILED;
+    r->queue_depth = queue_depth;
+    r->chunk_len = chunk_len;
+    r->is_group = is_group;
+    r->held_len = 0;
+    /* a slot has the ev of its cmd and those of its fsyncs at most */
+    r->evs_maxlen = slots_len * (queue_depth + 1) + proc_evs_extra_len_;
+    r->slots = malloc(sizeof(struct ring_slot_) * slots_len);
+    r->queued = malloc(sizeof(struct proc_sqe_) * slots_len * queue_depth);
+    r->sync_tags = malloc(sizeof(unsigned long) * slots_len * queue_depth);
+    r->bufs = malloc(rw_buf_len_ * slots_len);
+    r->evs = malloc(sizeof(struct afs_ev) * r->evs_maxlen);
+    if (r->slots == NULL || r->queued == NULL || r->sync_tags == NULL
+        || r->bufs == NULL || r->evs == NULL)
+    {
+        SOB_FAIL_INIT(fail_out, "malloc ring");
+        ring_destroy_(r);
+        return afs_fail_alloc;
+    }
+    for (i = 0; i < slots_len; i++) {
+        struct ring_slot_ * rs = &r->slots[i];
+        rs->ctl.st = proc_slot_st_free_;
+        rs->ctl.afs_fd = -1;
+        rs->q = r->queued + queue_depth * i;
+        rs->q_head = 0;
+        rs->q_len = 0;
+        rs->step = ring_step_none_;
+        rs->sync_tags = r->sync_tags + queue_depth * i;
+        rs->sync_len = 0;
+        rs->sync_flight = 0;
+        rs->is_close_held = 0;
+        rs->fd = -1;
+        rs->tmp_fd = -1;
+        rs->rw_buf = r->bufs + rw_buf_len_ * i;
+        rs->stream_buf = NULL;
+        rs->stream_i = 0;
+    }
+    r->slots_len = slots_len;
+
+    memset(&params, 0, sizeof(params));
+    r->fd = syscall(SYS_io_uring_setup, (unsigned) slots_len, &params);
+    if (r->fd == -1) {
+        SOB_FAIL_INIT(fail_out, "io_uring_setup");
+        ring_destroy_(r);
+        return afs_fail;
+    }
+    /* offset -1 for the current position; cqes are never dropped */
+    if (! (params.features & IORING_FEAT_RW_CUR_POS)
+        || ! (params.features & IORING_FEAT_NODROP)
+        || ! ring_probe_(r->fd))
+    {
+        errno = 0;
+        SOB_FAIL_INIT(fail_out, "io_uring is too old (no errno)");
+        ring_destroy_(r);
+        return afs_fail;
+    }
+
+    r->sq_mem_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_mem_len = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_mem_len > r->sq_mem_len) {
+            r->sq_mem_len = r->cq_mem_len;
+        }
+        r->cq_mem_len = 0;
+    }
+    r->sq_mem = mmap(NULL, r->sq_mem_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_mem != MAP_FAILED && r->cq_mem_len == 0) {
+        r->cq_mem = r->sq_mem;
+    } else if (r->sq_mem != MAP_FAILED) {
+        r->cq_mem = mmap(NULL, r->cq_mem_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED, r->fd, IORING_OFF_SQES);
+    if (r->sq_mem == MAP_FAILED || r->cq_mem == MAP_FAILED
+        || r->sqes == MAP_FAILED)
+    {
+        SOB_FAIL_INIT(fail_out, "mmap ring");
+        ring_destroy_(r);
+        return afs_fail;
+    }
+    r->sq_tail = (unsigned *) ((char *) r->sq_mem + params.sq_off.tail);
+    r->sq_array = (unsigned *) ((char *) r->sq_mem + params.sq_off.array);
+    r->sq_mask = *(unsigned *) ((char *) r->sq_mem + params.sq_off.ring_mask);
+    r->cq_head = (unsigned *) ((char *) r->cq_mem + params.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_mem + params.cq_off.tail);
+    r->cq_mask = *(unsigned *) ((char *) r->cq_mem + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_mem + params.cq_off.cqes);
+
+    r->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->evfd == -1) {
+        SOB_FAIL_INIT(fail_out, "eventfd");
+        ring_destroy_(r);
+        return afs_fail;
+    }
+    if (syscall(SYS_io_uring_register, r->fd,
+            IORING_REGISTER_EVENTFD, &r->evfd, 1) != 0)
+    {
+        SOB_FAIL_INIT(fail_out, "io_uring_register eventfd");
+        ring_destroy_(r);
+        return afs_fail;
+    }
+
+    *r_out = r;
+    return afs_ok;
+}
+
+/* every op used by ring_step_ must be there */
+static int ring_probe_(int fd)
+{
+    static const int ops[] = {
+        IORING_OP_NOP, IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_FSYNC,
+        IORING_OP_WRITE, IORING_OP_READ, IORING_OP_MKDIRAT, IORING_OP_FADVISE,
+        IORING_OP_WRITEV, IORING_OP_RENAMEAT
+    };
+    enum { probe_ops_len = 256 };
+    struct io_uring_probe * probe;
+    size_t i;
+    int is_ok = 1;
+
+    probe = calloc(1, sizeof(struct io_uring_probe)
+        + sizeof(struct io_uring_probe_op) * probe_ops_len);
+    if (probe == NULL) {
+        return 0;
+    }
+    if (syscall(SYS_io_uring_register, fd,
+            IORING_REGISTER_PROBE, probe, probe_ops_len) != 0)
+    {
+        free(probe);
+        return 0;
+    }
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op
+            || ! (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            is_ok = 0;
+        }
+    }
+    free(probe);
+    return is_ok;
+}
+
+static void ring_destroy_(struct ring_ * r)
+{
+    size_t i;
+    /* the kernel cancels whatever is still in flight */
+    if (r->fd != -1) {
+        close(r->fd);
+    }
+    if (r->evfd != -1) {
+        close(r->evfd);
+    }
+    if (r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_mem != MAP_FAILED && r->cq_mem != r->sq_mem) {
+        munmap(r->cq_mem, r->cq_mem_len);
+    }
+    if (r->sq_mem != MAP_FAILED) {
+        munmap(r->sq_mem, r->sq_mem_len);
+    }
+    for (i = 0; r->slots != NULL && i < r->slots_len; i++) {
+        if (r->slots[i].fd != -1) {
+            close(r->slots[i].fd);
+        }
+        ring_close_tmp_(&r->slots[i]);
+        free(r->slots[i].stream_buf);
+    }
+    /* free(NULL) is fine */
+    free(r->slots);
+    free(r->queued);
+    free(r->sync_tags);
+    free(r->bufs);
+    free(r->evs);
+    free(r);
+}
+
+static enum afs_res ring_update_(struct ring_ * r,
+    const struct pollfd * fds, size_t fds_len)
+{
+    size_t i;
+    unsigned head;
+    unsigned tail;
+    r->evs_len = 0;
+
+    for (i = 0; i < fds_len; i++) {
+        if (fds[i].fd == r->evfd && fds[i].revents & POLLIN) {
+            uint64_t throwaway;
+            (void) read(r->evfd, &throwaway, sizeof(throwaway));
+        }
+    }
+
+    /* the cq is reaped even without POLLIN; it is cheap */
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe * cqe = &r->cqes[head & r->cq_mask];
+        size_t slot = cqe->user_data;
+        int res = cqe->res;
+        head++;
+        /* the cqe is copied out, so the kernel may reuse it */
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if (slot >= r->slots_len * 2) {
+            SOB_PANIC("bad cqe user_data %lu", (unsigned long) slot);
+        }
+        r->inflight--;
+        if (slot >= r->slots_len) {
+            ring_synced_(r, slot - r->slots_len, res);
+        } else {
+            ring_step_(r, slot, res);
+        }
+    }
+    return afs_ok;
+}
+
+static size_t ring_evs_(struct ring_ * r, struct afs_ev ** evs_out)
+{
+    *evs_out = r->evs;
+    return r->evs_len;
+}
+
+static int ring_fd_(const struct ring_ * r)
+{
+    return r->evfd;
+}
+
+static int ring_is_idle_(const struct ring_ * r)
+{
+    return r->inflight == 0 && r->held_len == 0;
+}
+
+static int ring_is_held_(const struct ring_ * r)
+{
+    return r->held_len > 0;
+}
+
+/* one fdatasync per file goes out for all the fsyncs waiting on it, at
+ * once for all files. each fsync started after the cmds before it were
+ * done, so it covers them. its user_data is past the slots, as the slot
+ * may have a cmd in flight too. a file with one in flight already waits
+ * for the next flush */
+static size_t ring_group_flush_(struct ring_ * r)
+{
+    size_t i;
+    size_t n = 0;
+    for (i = 0; i < r->slots_len && r->held_len > 0; i++) {
+        struct ring_slot_ * rs = &r->slots[i];
+        struct io_uring_sqe * sqe;
+        if (rs->sync_len == 0 || rs->sync_flight > 0) {
+            continue;
+        }
+        rs->sync_flight = rs->sync_len;
+        r->held_len -= rs->sync_len;
+        n++;
+        sqe = ring_sqe_(r, i, rs->step, IORING_OP_FSYNC, rs->fd);
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = r->slots_len + i;
+    }
+    return n;
+}
+
+/* gives each fsync the fdatasync stood for its ev */
+static void ring_synced_(struct ring_ * r, size_t slot, int res)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    size_t i;
+    if (res < 0) {
+        errno = -res;
+        SOB_AFS_RING_FAIL_("fdatasync");
+    }
+    for (i = 0; i < rs->sync_flight; i++) {
+        struct afs_ev * ev = ring_add_ev_(r, slot);
+        ev->ty = (res < 0) ? afs_ev_fsync_fail : afs_ev_fsync;
+        ev->tag = rs->sync_tags[i];
+        slot_ctl_done_(&rs->ctl, proc_cmd_fsync_);
+    }
+    rs->sync_len -= rs->sync_flight;
+    memmove(rs->sync_tags, rs->sync_tags + rs->sync_flight,
+        sizeof(unsigned long) * rs->sync_len);
+    rs->sync_flight = 0;
+    if (rs->sync_len == 0 && rs->is_close_held) {
+        rs->is_close_held = 0;
+        ring_start_(r, slot);
+    }
+}
+
+static void ring_flush_(struct ring_ * r)
+{
+    while (r->to_submit > 0) {
+        long n = syscall(SYS_io_uring_enter, r->fd, r->to_submit, 0, 0,
+            NULL, 0);
+        if (n >= 0) {
+            r->to_submit -= n;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            /* EAGAIN or EBUSY: completions are pending, so the eventfd
+             * fires and the next afs_pollfds retries */
+            SOB_AFS_RING_FAIL_("io_uring_enter");
+            break;
+        }
+    }
+}
+
+static void ring_wake_(struct ring_ * r)
+{
+    uint64_t one = 1;
+    (void) write(r->evfd, &one, sizeof(one));
+}
+
+static const struct sob_fail * ring_fail_(const struct ring_ * r)
+{
+    return &r->fail;
+}
+
+static int ring_slot_alloc_(struct ring_ * r, int afs_fd, size_t * slot_out)
+{
+    size_t i;
+    for (i = 0; i < r->slots_len; i++) {
+        if (r->slots[i].ctl.st == proc_slot_st_free_) {
+            r->slots[i].ctl.st = proc_slot_st_used_;
+            r->slots[i].ctl.afs_fd = afs_fd;
+            r->slots[i].ctl.queued = 0;
+            r->slots[i].ctl.is_readall_queued = 0;
+            r->slots[i].ctl.is_fsync_held = 0;
+            *slot_out = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void ring_slot_free_(struct ring_ * r, size_t slot)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    if (rs->q_len > 0) {
+        /* never happens: afs only drops fds after their last event */
+        SOB_PANIC("freeing a running slot");
+    }
+    if (rs->fd != -1) {
+        close(rs->fd);
+        rs->fd = -1;
+    }
+    rs->ctl.st = proc_slot_st_free_;
+    rs->ctl.afs_fd = -1;
+}
+
+static void * ring_slot_buf_(const struct ring_ * r, size_t slot)
+{
+    return r->slots[slot].rw_buf;
+}
+
+static size_t ring_buf_len_(const struct ring_ * r)
+{
+    return rw_buf_len_;
+}
+
+static enum afs_res ring_submit_(struct ring_ * r,
+    size_t slot, const struct proc_sqe_ * q)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    if (! slot_ctl_queue_(&rs->ctl, q->cmd, r->queue_depth, &r->fail)) {
+        return afs_fail;
+    }
+    memcpy(&rs->q[(rs->q_head + rs->q_len) % r->queue_depth], q,
+        sizeof(struct proc_sqe_));
+    rs->q_len++;
+    if (rs->q_len == 1) {
+        ring_start_(r, slot);
+    }
+    return afs_ok;
+}
+
+/* queues the first op of the cmd at q_head */
+static void ring_start_(struct ring_ * r, size_t slot)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    const struct proc_sqe_ * q = &rs->q[rs->q_head];
+    struct proc_cqe_ * cq = &rs->cq;
+    struct io_uring_sqe * sqe;
+    int is_open_needed = 1;
+
+    cq->res = proc_res_none_;
+    cq->written = 0;
+    cq->read_len = 0;
+
+    switch (q->cmd) {
+    case proc_cmd_open_:
+        if (rs->fd != -1) {
+            SOB_AFS_RING_DEFER_FAIL_("already open (no errno)");
+            break;
+        }
+        sqe = ring_sqe_(r, slot, ring_step_open_, IORING_OP_OPENAT, AT_FDCWD);
+        sqe->addr = (uintptr_t) rs->rw_buf;
+        sqe->open_flags = q->open_flags;
+        sqe->len = 00600;
+        is_open_needed = 0;
+        break;
+    case proc_cmd_close_:
+        if (rs->sync_len > 0) {
+            rs->is_close_held = 1; /* ring_synced_ starts it */
+            return;
+        }
+        if (rs->fd != -1) {
+            (void) ring_sqe_(r, slot, ring_step_close_, IORING_OP_CLOSE,
+                rs->fd);
+        }
+        break;
+    case proc_cmd_fsync_:
+        if (rs->fd != -1 && r->is_group) {
+            /* its ev comes from ring_synced_ */
+            rs->sync_tags[rs->sync_len] = q->tag;
+            rs->sync_len++;
+            r->held_len++;
+            ring_next_(r, slot);
+            return;
+        } else if (rs->fd != -1) {
+            (void) ring_sqe_(r, slot, ring_step_fsync_, IORING_OP_FSYNC,
+                rs->fd);
+        }
+        break;
+    case proc_cmd_write_:
+        if (rs->fd != -1) {
+            sqe = ring_sqe_(r, slot, ring_step_write_, IORING_OP_WRITE,
+                rs->fd);
+            sqe->addr = (uintptr_t) (rs->rw_buf + q->buf_off);
+            sqe->len = q->write_len;
+            sqe->off = (__u64) -1;
+        }
+        break;
+    case proc_cmd_writev_:
+        if (rs->fd != -1) {
+            rs->iov = rs->iov_mem;
+            rs->iov_len = iov_init_(rs->iov_mem, q, rs->rw_buf);
+            ring_writev_(r, slot);
+        }
+        break;
+    case proc_cmd_readall_:
+        if (rs->fd != -1) {
+            sqe = ring_sqe_(r, slot, ring_step_read_, IORING_OP_READ, rs->fd);
+            sqe->addr = (uintptr_t) rs->rw_buf;
+            sqe->len = rw_buf_len_;
+            sqe->off = (__u64) -1;
+        }
+        break;
+    case proc_cmd_readall_stream_:
+        if (rs->fd == -1) {
+            break;
+        }
+        if (rs->stream_buf == NULL) {
+            rs->stream_buf = malloc(r->chunk_len * 2);
+        }
+        if (rs->stream_buf == NULL) {
+            SOB_AFS_RING_DEFER_FAIL_("malloc stream");
+            is_open_needed = 0;
+            break;
+        }
+        ring_read_chunk_(r, slot);
+        break;
+    case proc_cmd_mkdir_:
+        sqe = ring_sqe_(r, slot, ring_step_mkdir_, IORING_OP_MKDIRAT, AT_FDCWD);
+        sqe->addr = (uintptr_t) rs->rw_buf;
+        sqe->len = 00700;
+        is_open_needed = 0;
+        break;
+    case proc_cmd_write_fsync_close_:
+    case proc_cmd_replace_:
+        sqe = ring_sqe_(r, slot, ring_step_tmp_open_, IORING_OP_OPENAT,
+            AT_FDCWD);
+        sqe->addr = (uintptr_t) (rs->rw_buf + q->write_len);
+        sqe->open_flags = q->open_flags;
+        sqe->len = 00600;
+        is_open_needed = 0;
+        break;
+    case proc_cmd_map_:
+        sqe = ring_sqe_(r, slot, ring_step_map_open_, IORING_OP_OPENAT,
+            AT_FDCWD);
+        sqe->addr = (uintptr_t) rs->rw_buf;
+        sqe->open_flags = O_RDONLY | O_NOCTTY | O_CLOEXEC;
+        is_open_needed = 0;
+        break;
+    case proc_cmd_none_:
+    case proc_cmd_exit_:
+    case proc_cmd_group_sync_:
+        SOB_AFS_RING_DEFER_FAIL_("not a slot cmd (no errno)");
+        is_open_needed = 0;
+        break;
+    };
+    if (is_open_needed && rs->fd == -1) {
+        SOB_AFS_RING_DEFER_FAIL_("not open (no errno)");
+    }
+}
+
+/* never runs out: one sqe per slot at most and sq_entries >= slots_len */
+static struct io_uring_sqe * ring_sqe_(struct ring_ * r,
+    size_t slot, enum ring_step_ step, int opcode, int fd)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail & r->sq_mask;
+    struct io_uring_sqe * sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = slot;
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    r->inflight++;
+    r->slots[slot].step = step;
+    return sqe;
+}
+
+/* takes the result of the op in flight and queues the next one */
+static void ring_step_(struct ring_ * r, size_t slot, int res)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    const struct proc_sqe_ * q = &rs->q[rs->q_head];
+    struct proc_cqe_ * cq = &rs->cq;
+    struct io_uring_sqe * sqe;
+    int dir_flags = O_RDONLY;
+#ifdef O_DIRECTORY
+    dir_flags |= O_DIRECTORY;
+#endif
+
+    switch (rs->step) {
+    case ring_step_none_:
+        SOB_PANIC("cqe for an idle slot");
+        return;
+    case ring_step_fail_:
+        ring_done_(r, slot, proc_res_fail_);
+        return;
+    case ring_step_open_:
+        if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, "open");
+        }
+        rs->fd = res;
+        break;
+    case ring_step_close_:
+        /* like close(2) in a worker, a fail still releases the fd */
+        rs->fd = -1;
+        break;
+    case ring_step_fsync_:
+        if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, "fsync");
+        }
+        break;
+    case ring_step_write_:
+    case ring_step_tmp_write_:
+        if (res < 0 && res != -EINTR && res != -EAGAIN) {
+            ring_close_tmp_(rs);
+            SOB_AFS_RING_STEP_FAIL_(res, "write");
+        }
+        if (res > 0) {
+            cq->written += res;
+        }
+        if (cq->written < q->write_len) { /* interrupted */
+            int fd = (rs->step == ring_step_write_) ? rs->fd : rs->tmp_fd;
+            sqe = ring_sqe_(r, slot, rs->step, IORING_OP_WRITE, fd);
+            sqe->addr = (uintptr_t) (rs->rw_buf + q->buf_off + cq->written);
+            sqe->len = q->write_len - cq->written;
+            sqe->off = (__u64) -1;
+            return;
+        }
+        if (rs->step == ring_step_tmp_write_) {
+            (void) ring_sqe_(r, slot, ring_step_tmp_fsync_, IORING_OP_FSYNC,
+                rs->tmp_fd);
+            return;
+        }
+        break;
+    case ring_step_read_:
+        if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, "read");
+        }
+        cq->read_len = res;
+        break;
+    case ring_step_mkdir_:
+        if (res < 0 && res != -EEXIST) {
+            SOB_AFS_RING_STEP_FAIL_(res, "mkdir");
+        }
+        rs->is_exist = (res == -EEXIST);
+        /* XXX: unsure if necessary to fsync the dir itself */
+        sqe = ring_sqe_(r, slot, ring_step_mkdir_open_, IORING_OP_OPENAT,
+            AT_FDCWD);
+        sqe->addr = (uintptr_t) rs->rw_buf;
+        sqe->open_flags = dir_flags;
+        return;
+    case ring_step_mkdir_open_:
+        if (res < 0 && rs->is_exist && res == -ENOTDIR) {
+            SOB_AFS_RING_STEP_FAIL_(res,
+                "file with same name as dir (no errno)");
+        } else if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, "open dir");
+        }
+        rs->tmp_fd = res;
+        if (rs->is_exist) {
+            ring_close_tmp_(rs);
+            break;
+        }
+        (void) ring_sqe_(r, slot, ring_step_mkdir_fsync_, IORING_OP_FSYNC,
+            rs->tmp_fd);
+        return;
+    case ring_step_mkdir_fsync_:
+        if (res < 0) {
+            ring_close_tmp_(rs);
+            SOB_AFS_RING_STEP_FAIL_(res, "fsync dir");
+        }
+        /* the dir itself is still open; its parent is relative to it */
+        sqe = ring_sqe_(r, slot, ring_step_mkdir_open_parent_,
+            IORING_OP_OPENAT, rs->tmp_fd);
+        sqe->addr = (uintptr_t) ring_parent_path_;
+        sqe->open_flags = dir_flags;
+        return;
+    case ring_step_mkdir_open_parent_:
+        ring_close_tmp_(rs);
+        if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, "open dir");
+        }
+        rs->tmp_fd = res;
+        (void) ring_sqe_(r, slot, ring_step_mkdir_fsync_parent_,
+            IORING_OP_FSYNC, rs->tmp_fd);
+        return;
+    case ring_step_mkdir_fsync_parent_:
+    case ring_step_tmp_fsync_:
+        ring_close_tmp_(rs);
+        if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, (rs->step == ring_step_tmp_fsync_)
+                ? "fsync" : "fsync dir");
+        }
+        if (rs->step == ring_step_tmp_fsync_
+            && q->cmd == proc_cmd_replace_)
+        {
+            const char * tmp_path = rs->rw_buf + q->write_len;
+            sqe = ring_sqe_(r, slot, ring_step_rename_, IORING_OP_RENAMEAT,
+                AT_FDCWD);
+            sqe->addr = (uintptr_t) tmp_path;
+            sqe->len = AT_FDCWD;
+            sqe->addr2 = (uintptr_t) (tmp_path + strlen(tmp_path) + 1);
+            return;
+        }
+        break;
+    case ring_step_rename_:
+        if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, "rename");
+        }
+        {
+            const char * new_path = rs->rw_buf + q->write_len;
+            new_path += strlen(new_path) + 1;
+            /* then the same as the parent of a new dir */
+            sqe = ring_sqe_(r, slot, ring_step_mkdir_open_parent_,
+                IORING_OP_OPENAT, AT_FDCWD);
+            sqe->addr = (uintptr_t) (new_path + strlen(new_path) + 1);
+            sqe->open_flags = dir_flags;
+        }
+        return;
+    case ring_step_tmp_open_:
+        if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, "open");
+        }
+        rs->tmp_fd = res;
+        sqe = ring_sqe_(r, slot, ring_step_tmp_write_, IORING_OP_WRITE,
+            rs->tmp_fd);
+        sqe->addr = (uintptr_t) rs->rw_buf;
+        sqe->len = q->write_len;
+        sqe->off = (__u64) -1;
+        return;
+    case ring_step_stream_:
+        ring_stream_chunk_(r, slot, res);
+        return;
+    case ring_step_map_open_:
+        if (res < 0) {
+            SOB_AFS_RING_STEP_FAIL_(res, "open");
+        }
+        rs->tmp_fd = res;
+        sqe = ring_sqe_(r, slot, ring_step_map_fadvise_, IORING_OP_FADVISE,
+            rs->tmp_fd);
+        sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+        return;
+    case ring_step_map_fadvise_:
+        /* only a hint, so its res does not matter; ring_done_ maps it */
+        break;
+    case ring_step_writev_:
+        if (res < 0 && res != -EINTR && res != -EAGAIN) {
+            SOB_AFS_RING_STEP_FAIL_(res, "writev");
+        }
+        if (res > 0) {
+            cq->written += res;
+            rs->iov = iov_skip_(rs->iov, &rs->iov_len, res);
+        }
+        if (cq->written < q->write_len) { /* interrupted */
+            ring_writev_(r, slot);
+            return;
+        }
+        break;
+    };
+    ring_done_(r, slot, proc_res_ok_);
+}
+
+/* every chunk is an ev; the next read goes to the other half, so the
+ * chunk stays valid until the next cqe of the slot, after afs_pollfds */
+static void ring_stream_chunk_(struct ring_ * r, size_t slot, int res)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    const struct proc_sqe_ * q = &rs->q[rs->q_head];
+    struct proc_cqe_ * cq = &rs->cq;
+    struct afs_ev * ev;
+
+    if (res == -EINTR || res == -EAGAIN) {
+        ring_read_chunk_(r, slot);
+        return;
+    } else if (res < 0) {
+        SOB_AFS_RING_STEP_FAIL_(res, "read");
+    } else if (res == 0) {
+        ring_done_(r, slot, proc_res_ok_);
+        return;
+    }
+    ev = ring_add_ev_(r, slot);
+    ev->ty = afs_ev_readall;
+    ev->tag = q->tag;
+    ev->d.readall.len = res;
+    ev->d.readall.off = cq->read_len;
+    ev->d.readall.data = rs->stream_buf + r->chunk_len * rs->stream_i;
+    cq->read_len += res;
+    rs->stream_i = 1 - rs->stream_i;
+    ring_read_chunk_(r, slot);
+}
+
+/* the rest of the slices; the iovecs stay put until the cqe */
+static void ring_writev_(struct ring_ * r, size_t slot)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    const struct proc_sqe_ * q = &rs->q[rs->q_head];
+    struct io_uring_sqe * sqe = ring_sqe_(r, slot, ring_step_writev_,
+        IORING_OP_WRITEV, rs->fd);
+    sqe->addr = (uintptr_t) rs->iov;
+    sqe->len = rs->iov_len;
+    sqe->off = (q->write_off == -1)
+        ? (__u64) -1 : (__u64) (q->write_off + rs->cq.written);
+}
+
+static void ring_read_chunk_(struct ring_ * r, size_t slot)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    struct io_uring_sqe * sqe = ring_sqe_(r, slot, ring_step_stream_,
+        IORING_OP_READ, rs->fd);
+    sqe->addr = (uintptr_t) (rs->stream_buf + r->chunk_len * rs->stream_i);
+    sqe->len = r->chunk_len;
+    sqe->off = (__u64) -1;
+}
+
+static void ring_done_(struct ring_ * r, size_t slot, enum proc_res_ res)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    const struct proc_sqe_ * q = &rs->q[rs->q_head];
+    struct proc_cqe_ * cq = &rs->cq;
+    struct afs_ev * ev = ring_add_ev_(r, slot);
+
+    cq->res = res;
+    if (res == proc_res_ok_) {
+        cqe_ev_(ev, q, cq, rs->rw_buf);
+        if (q->cmd == proc_cmd_map_) {
+            if (! map_fd_(rs->tmp_fd, ev, &r->fail)) {
+                ev->ty = afs_ev_map_fail;
+            }
+            rs->tmp_fd = -1;
+        }
+    } else {
+        memcpy(&r->fail, &cq->fail, sizeof(struct sob_fail));
+        ev->ty = proc_cmd_fail_ev_(q->cmd);
+        ev->tag = q->tag;
+    }
+    slot_ctl_done_(&rs->ctl, q->cmd);
+    ring_next_(r, slot);
+}
+
+/* drops the cmd at q_head and starts the one after it */
+static void ring_next_(struct ring_ * r, size_t slot)
+{
+    struct ring_slot_ * rs = &r->slots[slot];
+    rs->step = ring_step_none_;
+    rs->q_head = (rs->q_head + 1) % r->queue_depth;
+    rs->q_len--;
+    if (rs->q_len > 0) {
+        ring_start_(r, slot);
+    }
+}
+
+/* the next op is submitted in ring_flush_, after afs_update took
+ * the evs; so one ev per slot at most */
+static struct afs_ev * ring_add_ev_(struct ring_ * r, size_t slot)
+{
+    struct afs_ev * ev;
+    if (r->evs_len >= r->evs_maxlen) {
+        SOB_PANIC("ring evs overflow");
+    }
+    ev = &r->evs[r->evs_len];
+    r->evs_len++;
+    ev->fd = r->slots[slot].ctl.afs_fd;
+    return ev;
+}
+
+/* fsynced already or failed, so close(2) here does not block */
+static void ring_close_tmp_(struct ring_slot_ * rs)
+{
+    if (rs->tmp_fd != -1) {
+        close(rs->tmp_fd);
+        rs->tmp_fd = -1;
+    }
+}
+
+#undef SOB_AFS_RING_FAIL_
+#undef SOB_AFS_RING_DEFER_FAIL_
+#undef SOB_AFS_RING_STEP_FAIL_
+
+#else /* SOB_AFS_URING */
+
+/* built without io_uring; pool_alloc_ falls back to the workers */
+
+static enum afs_res ring_init_(struct ring_ ** r_out,
+    size_t slots_len, size_t queue_depth, size_t chunk_len, int is_group,
+    struct sob_fail * fail_out)
+{
+    errno = 0;
+    SOB_FAIL_INIT(fail_out, "built without SOB_AFS_URING (no errno)");
+    return afs_fail;
+}
+
+static void ring_destroy_(struct ring_ * r)
+{
+    SOB_PANIC("no ring");
+}
+
+static size_t ring_group_flush_(struct ring_ * r)
+{
+    SOB_PANIC("no ring");
+    return 0;
+}
+
+static int ring_is_held_(const struct ring_ * r)
+{
+    SOB_PANIC("no ring");
+    return 0;
+}
+
+static enum afs_res ring_update_(struct ring_ * r,
+    const struct pollfd * fds, size_t fds_len)
+{
+    SOB_PANIC("no ring");
+    return afs_fail;
+}
+
+static size_t ring_evs_(struct ring_ * r, struct afs_ev ** evs_out)
+{
+    SOB_PANIC("no ring");
+    return 0;
+}
+
+static int ring_fd_(const struct ring_ * r)
+{
+    SOB_PANIC("no ring");
+    return -1;
+}
+
+static int ring_is_idle_(const struct ring_ * r)
+{
+    SOB_PANIC("no ring");
+    return 1;
+}
 
-        if (p->is_stop_req) {
-            SOB_AFS_CHECK(proc_send_cmd_(p, proc_cmd_exit_));
-        }
-        return afs_ok;
-    } else {
-        return afs_ok;
-    }
+static void ring_flush_(struct ring_ * r)
+{
+    SOB_PANIC("no ring");
 }
 
-static enum afs_res proc_update_dead_(struct proc_ * p)
+static void ring_wake_(struct ring_ * r)
 {
-    if (p->is_stop_req) {
-        p->is_stop_req = 0;
-        SOB_AFS_PROC_CHECK_EV_(proc_add_ev_(p, afs_ev_stop_fail));
-    }
-    proc_destroy_child_(p);
-    SOB_AFS_PROC_FAIL_("child is dead (no errno)");
-    return afs_fail;
+    SOB_PANIC("no ring");
 }
 
-static enum afs_res proc_send_cmd_(struct proc_ * p, enum proc_cmd_ cmd)
+static const struct sob_fail * ring_fail_(const struct ring_ * r)
 {
-    if (p->st != proc_st_avail_) {
-        SOB_AFS_PROC_FAIL_("bad st (no errno)");
-        return afs_fail;
-    }
-    if (p->shared->st != proc_child_st_idle_) {
-        /* should never happen */
-        SOB_AFS_PROC_FAIL_("bad child st (no errno)");
-        return afs_fail;
-    }
-    p->st = proc_st_busy_;
-    p->shared->cmd = cmd;
-    return proc_notify_child_(p);
+    SOB_PANIC("no ring");
+    return NULL;
 }
 
-static enum afs_res proc_notify_child_(struct proc_ * p)
+static int ring_slot_alloc_(struct ring_ * r, int afs_fd, size_t * slot_out)
 {
-    while (1) {
-        char throwaway;
-        if (write(p->fd, &throwaway, 1) == 1) {
-            return afs_ok;
-        } else if (errno == EINTR) {
-            continue;
-        } else {
-            SOB_AFS_PROC_FAIL_("write");
-            p->st = proc_st_dead_;
-            return afs_fail;
-        }
-    }
+    SOB_PANIC("no ring");
+    return 0;
 }
 
-static void proc_destroy_child_(struct proc_ * p)
+static void ring_slot_free_(struct ring_ * r, size_t slot)
 {
-    if (p->pid > 0) {
-        (void) kill(p->pid, SIGKILL);
-        /* MAY BLOCK; if so we have bigger problems though */
-        while (1) {
-            int wstatus;
-            int r = waitpid(p->pid, &wstatus, 0);
-            if (r == -1 && errno == EINTR) {
-                continue;
-            } else {
-                /* even if waitpid fails the zombie is already reaped */
-                break;
-            }
-        }
-        p->pid = 0;
-    }
+    SOB_PANIC("no ring");
+}
 
-    close(p->fd);
-    p->fd = -1;
-    munmap(p->mmap_start, p->mmap_len);
-    p->mmap_start = NULL;
-    p->mmap_len = 0;
-    p->rw_buf = NULL;
-    p->rw_buf_len = 0;
-    p->shared = NULL;
+static void * ring_slot_buf_(const struct ring_ * r, size_t slot)
+{
+    SOB_PANIC("no ring");
+    return NULL;
+}
 
-    p->st = proc_st_uninit_;
+static size_t ring_buf_len_(const struct ring_ * r)
+{
+    SOB_PANIC("no ring");
+    return 0;
 }
 
-static struct afs_ev * proc_add_ev_(struct proc_ * p, enum afs_event ty)
+static enum afs_res ring_submit_(struct ring_ * r,
+    size_t slot, const struct proc_sqe_ * q)
 {
-    if (p->evs_len < proc_evs_maxlen_) {
-        struct afs_ev * r = &p->evs[p->evs_len];
-        p->evs_len++;
-        r->ty = ty;
-        r->fd = -1; /* afs will fill fd (its internal, not actual fd) */
-        return r;
-    } else {
-        return NULL;
-    }
+    SOB_PANIC("no ring");
+    return afs_fail;
 }
 
-static int proc_child_worker_(int parent_fd,
-    struct proc_shared_ * s, void * rw_buf, size_t rw_buf_len)
+#endif /* SOB_AFS_URING */
+
+static int proc_child_worker_(const struct proc_child_ * ch)
 {
     /* child process; spawned in proc_init_ */
 
-    int fd = -1;
+    struct proc_shared_ * s = ch->s;
+    int * fds; /* actual fd per slot */
+    size_t sq_head = 0;
+    size_t i;
 
     if (s->st != proc_child_st_not_started_) {
         /* sanity check */
         return 126;
     }
-    s->st = proc_child_st_idle_;
+    fds = malloc(sizeof(int) * ch->slots_len);
+    if (fds == NULL) {
+        return 125;
+    }
+    for (i = 0; i < ch->slots_len; i++) {
+        fds[i] = -1;
+    }
+    __atomic_store_n(&s->st, proc_child_st_running_, __ATOMIC_SEQ_CST);
+    if (! proc_child_notify_(ch)) {
+        return 127;
+    }
 
     while (1) {
-        char throwaway;
+        const struct proc_sqe_ * q;
+        struct proc_cqe_ * cq;
         int should_exit = 0;
 
-        /* wait for signal from parent */
-        if (read(parent_fd, &throwaway, 1) != 1) {
-            if (errno == EINTR) {
-                continue;
-            } else {
+        if (sq_head == __atomic_load_n(&s->sq_tail, __ATOMIC_SEQ_CST)) {
+            if (! proc_child_sleep_(ch, &s->sq_tail, sq_head)) {
                 /* should not happen during normal operation */
                 return 1;
             }
+            continue;
         }
 
-        s->st = proc_child_st_busy_;
-        s->res = proc_res_none_;
-
-        switch (s->cmd) {
+        q = &ch->sqes[sq_head % ch->sqes_len];
+        cq = &ch->cqes[sq_head % ch->sqes_len];
+        cq->written = 0;
+        cq->read_len = 0;
+        switch (q->cmd) {
         case proc_cmd_none_:
-            s->res = proc_res_ok_;
+            cq->res = proc_res_ok_;
             break;
         case proc_cmd_exit_:
             /* should never fail.
              * if does so in the future, process should still be useful */
             should_exit = 1;
-            s->res = proc_res_ok_;
+            cq->res = proc_res_ok_;
             break;
-        case proc_cmd_open_:
-            s->res = proc_child_open_(s, &fd, rw_buf, rw_buf_len);
-            break;
-        case proc_cmd_close_:
-            s->res = proc_child_close_(s, &fd);
-            break;
-        case proc_cmd_fsync_:
-            s->res = proc_child_fsync_(s, fd);
-            break;
-        case proc_cmd_write_:
-            s->res = proc_child_write_(s, fd, rw_buf, rw_buf_len);
-            break;
-        case proc_cmd_readall_:
-            s->res = proc_child_readall_(s, fd, rw_buf, rw_buf_len);
-            break;
-        case proc_cmd_mkdir_:
-            s->res = proc_child_mkdir_(s, rw_buf, rw_buf_len);
+        case proc_cmd_group_sync_:
+            cq->res = proc_child_group_sync_(ch, q, cq, fds);
             break;
-        case proc_cmd_write_fsync_close_:
-            s->res = proc_child_write_fsync_close_(s, rw_buf, rw_buf_len);
+        default:
+            if (q->slot < ch->slots_len) {
+                cq->res = proc_child_cmd_(ch, sq_head, cq, &fds[q->slot]);
+            } else {
+                errno = 0;
+                SOB_AFS_PROC_C_FAIL_("bad slot (no errno)");
+                cq->res = proc_res_fail_;
+            }
             break;
         };
 
-        s->st = proc_child_st_idle_;
-
-        while (1) {
-            /* notify parent */
-            if (write(parent_fd, &throwaway, 1) != 1) {
-                if (errno == EINTR) {
-                    continue;
-                } else {
-                    /* should not happen during normal operation */
-                    SOB_AFS_PROC_C_FAIL_("write");
-                    s->st = proc_child_st_not_started_;
-                    return 127;
-                }
-            }
-            break;
+        sq_head++;
+        __atomic_store_n(&s->cq_tail, sq_head, __ATOMIC_SEQ_CST);
+        if (! proc_child_notify_(ch)) {
+            /* should not happen during normal operation */
+            return 127;
         }
 
         if (should_exit) {
-            s->st = proc_child_st_not_started_;
             return 0;
         }
     }
 
     /* should never get there */
-    SOB_AFS_PROC_C_FAIL_("unexpected exit");
+    SOB_FAIL_INIT(&s->fail, "unexpected exit");
     return 128;
 }
 
-static enum proc_res_ proc_child_open_(struct proc_shared_ * s, int * fd,
-    void * rw_buf, size_t rw_buf_len)
+/* one byte until the parent reaps; it clears is_parent_notified first */
+static int proc_child_notify_(const struct proc_child_ * ch)
+{
+    char throwaway = 0;
+    if (__atomic_exchange_n(&ch->s->is_parent_notified, 1,
+            __ATOMIC_SEQ_CST))
+    {
+        return 1;
+    }
+    while (1) {
+        if (write(ch->parent_fd, &throwaway, 1) == 1) {
+            return 1;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            SOB_FAIL_INIT(&ch->s->fail, "write");
+            return 0;
+        }
+    }
+}
+
+/* until the parent moves *watch off val;
+ * the parent writes a byte only when it sees us asleep */
+static int proc_child_sleep_(const struct proc_child_ * ch,
+    const size_t * watch, size_t val)
+{
+    struct proc_shared_ * s = ch->s;
+    __atomic_store_n(&s->is_child_asleep, 1, __ATOMIC_SEQ_CST);
+    if (val == __atomic_load_n(watch, __ATOMIC_SEQ_CST)) {
+        char throwaway[16];
+        ssize_t r = read(ch->parent_fd, throwaway, sizeof(throwaway));
+        if (r == 0 || (r == -1 && errno != EINTR)) {
+            return 0;
+        }
+    }
+    __atomic_store_n(&s->is_child_asleep, 0, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+static enum proc_res_ proc_child_cmd_(const struct proc_child_ * ch,
+    size_t sqe, struct proc_cqe_ * cq, int * fd)
+{
+    const struct proc_sqe_ * q = &ch->sqes[sqe % ch->sqes_len];
+    char * rw_buf = ch->slots_mem + q->slot * ch->slot_stride;
+    size_t rw_buf_len = ch->slot_stride;
+    switch (q->cmd) {
+    case proc_cmd_open_:
+        return proc_child_open_(q, cq, fd, rw_buf, rw_buf_len);
+    case proc_cmd_close_:
+        return proc_child_close_(q, cq, fd);
+    case proc_cmd_fsync_:
+        return proc_child_fsync_(q, cq, *fd);
+    case proc_cmd_write_:
+        return proc_child_write_(q, cq, *fd, rw_buf, rw_buf_len);
+    case proc_cmd_writev_:
+        return proc_child_writev_(q, cq, *fd, rw_buf);
+    case proc_cmd_readall_:
+        return proc_child_readall_(q, cq, *fd, rw_buf, rw_buf_len);
+    case proc_cmd_readall_stream_:
+        return proc_child_stream_(ch, sqe, cq, *fd);
+    case proc_cmd_map_:
+        return proc_child_map_(ch, q, cq, rw_buf);
+    case proc_cmd_mkdir_:
+        return proc_child_mkdir_(q, cq, rw_buf, rw_buf_len);
+    case proc_cmd_write_fsync_close_:
+        return proc_child_write_fsync_close_(q, cq, rw_buf, rw_buf_len);
+    case proc_cmd_replace_:
+        return proc_child_replace_(q, cq, rw_buf, rw_buf_len);
+    case proc_cmd_none_:
+    case proc_cmd_exit_:
+    case proc_cmd_group_sync_:
+        break;
+    };
+    SOB_AFS_PROC_C_FAIL_("not a slot cmd (no errno)");
+    return proc_res_fail_;
+}
+
+/* a chunk is published as soon as it is read; the parent hands out
+ * stream_head back once afs_pollfds is called after its ev */
+static enum proc_res_ proc_child_stream_(const struct proc_child_ * ch,
+    size_t sqe, struct proc_cqe_ * cq, int fd)
+{
+    struct proc_shared_ * s = ch->s;
+    size_t tail = s->stream_tail;
+    size_t off = 0;
+
+    if (fd == -1) {
+        SOB_AFS_PROC_C_FAIL_("not open (no errno)");
+        return proc_res_fail_;
+    }
+    while (1) {
+        struct proc_chunk_ * chunk;
+        char * data;
+        ssize_t r;
+
+        while (tail - __atomic_load_n(&s->stream_head, __ATOMIC_SEQ_CST)
+            == ch->chunks_len)
+        {
+            if (! proc_child_sleep_(ch, &s->stream_head,
+                    tail - ch->chunks_len))
+            {
+                SOB_AFS_PROC_C_FAIL_("read parent");
+                return proc_res_fail_;
+            }
+        }
+        chunk = &ch->chunks[tail % ch->chunks_len];
+        data = ch->chunks_mem + (tail % ch->chunks_len) * ch->chunk_len;
+        r = read(fd, data, ch->chunk_len);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        } else if (r == -1) {
+            SOB_AFS_PROC_C_FAIL_("read");
+            return proc_res_fail_;
+        } else if (r == 0) {
+            cq->read_len = off;
+            return proc_res_ok_;
+        }
+        chunk->sqe = sqe;
+        chunk->off = off;
+        chunk->len = r;
+        off += r;
+        tail++;
+        __atomic_store_n(&s->stream_tail, tail, __ATOMIC_SEQ_CST);
+        if (! proc_child_notify_(ch)) {
+            SOB_AFS_PROC_C_FAIL_("write parent");
+            return proc_res_fail_;
+        }
+    }
+}
+
+/* an fdatasync per file of the batch, however many fsyncs wait on it;
+ * each fsync gets the result of its file */
+static enum proc_res_ proc_child_group_sync_(const struct proc_child_ * ch,
+    const struct proc_sqe_ * q, struct proc_cqe_ * cq, const int * fds)
+{
+    enum proc_res_ res = proc_res_ok_;
+    size_t i;
+    for (i = 0; i < q->write_len; i++) {
+        struct proc_held_ * h = &ch->held[(q->buf_off + i) % ch->sqes_len];
+        size_t j;
+        h->res = proc_res_none_;
+        /* a batch is a few fsyncs, so it is cheaper than a set of slots */
+        for (j = 0; j < i && h->res == proc_res_none_; j++) {
+            const struct proc_held_ * h_j = &ch->held[(q->buf_off + j)
+                % ch->sqes_len];
+            if (h_j->slot == h->slot) {
+                h->res = h_j->res;
+            }
+        }
+        if (h->res != proc_res_none_) {
+            continue;
+        }
+        if (h->slot >= ch->slots_len || fds[h->slot] == -1) {
+            errno = 0;
+            SOB_AFS_PROC_C_FAIL_("not open (no errno)");
+            h->res = proc_res_fail_;
+        } else if (fdatasync(fds[h->slot]) != 0) {
+            SOB_AFS_PROC_C_FAIL_("fdatasync");
+            h->res = proc_res_fail_;
+        } else {
+            h->res = proc_res_ok_;
+        }
+        if (h->res != proc_res_ok_) {
+            res = proc_res_fail_;
+        }
+    }
+    return res;
+}
+
+/* opens and hints the kernel to read it ahead, then hands the fd over;
+ * the parent maps it when it reaps the cqe */
+static enum proc_res_ proc_child_map_(const struct proc_child_ * ch,
+    const struct proc_sqe_ * q, struct proc_cqe_ * cq, char * rw_buf)
+{
+    char throwaway = 0;
+    union {
+        struct cmsghdr h; /* for alignment */
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr * cmsg;
+    int fd = open(rw_buf, O_RDONLY | O_NOCTTY);
+    if (fd == -1) {
+        SOB_AFS_PROC_C_FAIL_("open");
+        return proc_res_fail_;
+    }
+    /* only a hint */
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+    iov.iov_base = &throwaway;
+    iov.iov_len = 1;
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    while (sendmsg(ch->parent_fd, &msg, 0) != 1) {
+        if (errno != EINTR) {
+            SOB_AFS_PROC_C_FAIL_("sendmsg");
+            close(fd);
+            return proc_res_fail_;
+        }
+    }
+    close(fd);
+    return proc_res_ok_;
+}
+
+static enum proc_res_ proc_child_open_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int * fd, char * rw_buf, size_t rw_buf_len)
 {
     if (*fd != -1) {
         SOB_AFS_PROC_C_FAIL_("already open (no errno)");
         return proc_res_fail_;
     } else {
-        *fd = open((const char *) rw_buf, s->open_flags, 00600);
+        *fd = open(rw_buf, q->open_flags, 00600);
         if (*fd == -1) {
             SOB_AFS_PROC_C_FAIL_("open");
             return proc_res_fail_;
@@ -1351,7 +4050,8 @@ static enum proc_res_ proc_child_open_(struct proc_shared_ * s, int * fd,
     }
 }
 
-static enum proc_res_ proc_child_close_(struct proc_shared_ * s, int * fd)
+static enum proc_res_ proc_child_close_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int * fd)
 {
     if (*fd == -1) {
         SOB_AFS_PROC_C_FAIL_("not open (no errno)");
@@ -1363,7 +4063,8 @@ static enum proc_res_ proc_child_close_(struct proc_shared_ * s, int * fd)
     }
 }
 
-static enum proc_res_ proc_child_fsync_(struct proc_shared_ * s, int fd)
+static enum proc_res_ proc_child_fsync_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int fd)
 {
     if (fd == -1) {
         SOB_AFS_PROC_C_FAIL_("not open (no errno)");
@@ -1378,25 +4079,25 @@ static enum proc_res_ proc_child_fsync_(struct proc_shared_ * s, int fd)
     }
 }
 
-static enum proc_res_ proc_child_write_(struct proc_shared_ * s, int fd,
-    void * rw_buf, size_t rw_buf_len)
+static enum proc_res_ proc_child_write_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int fd, char * rw_buf, size_t rw_buf_len)
 {
     if (fd == -1) {
         SOB_AFS_PROC_C_FAIL_("not open (no errno)");
         return proc_res_fail_;
     } else {
-        const char * write_buf = rw_buf;
-        size_t write_len = s->write_len;
-        s->written = 0;
+        const char * write_buf = rw_buf + q->buf_off;
+        size_t write_len = q->write_len;
+        cq->written = 0;
         while (1) {
             ssize_t written = write(fd, write_buf, write_len);
             if (written == write_len) {
-                s->written += written;
+                cq->written += written;
                 return proc_res_ok_;
             } else if (written != -1) { /* interrupted */
                 write_buf += written;
                 write_len -= written;
-                s->written += written;
+                cq->written += written;
                 continue;
             } else {
                 if (errno == EINTR) {
@@ -1411,27 +4112,56 @@ static enum proc_res_ proc_child_write_(struct proc_shared_ * s, int fd,
     }
 }
 
-static enum proc_res_ proc_child_readall_(struct proc_shared_ * s, int fd,
-    void * rw_buf, size_t rw_buf_len)
+/* one syscall for all the slices unless it is interrupted;
+ * with O_APPEND they all land at the end together */
+static enum proc_res_ proc_child_writev_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int fd, char * rw_buf)
+{
+    struct iovec iov_mem[SOB_AFS_SLICES_MAX];
+    struct iovec * iov = iov_mem;
+    size_t iov_len = iov_init_(iov_mem, q, rw_buf);
+    if (fd == -1) {
+        SOB_AFS_PROC_C_FAIL_("not open (no errno)");
+        return proc_res_fail_;
+    }
+    cq->written = 0;
+    while (cq->written < q->write_len) {
+        ssize_t written = (q->write_off == -1)
+            ? writev(fd, iov, iov_len)
+            : pwritev(fd, iov, iov_len, q->write_off + cq->written);
+        if (written == -1 && errno == EINTR) {
+            continue; /* no data was written */
+        } else if (written == -1) {
+            SOB_AFS_PROC_C_FAIL_("writev");
+            return proc_res_fail_;
+        }
+        cq->written += written;
+        iov = iov_skip_(iov, &iov_len, written);
+    }
+    return proc_res_ok_;
+}
+
+static enum proc_res_ proc_child_readall_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, int fd, char * rw_buf, size_t rw_buf_len)
 {
     if (fd == -1) {
         SOB_AFS_PROC_C_FAIL_("not open (no errno)");
         return proc_res_fail_;
     } else {
-        s->read_len = 0;
+        cq->read_len = 0;
         ssize_t read_len = read(fd, rw_buf, rw_buf_len);
         if (read_len < 0) {
             SOB_AFS_PROC_C_FAIL_("read");
             return proc_res_fail_;
         } else {
-            s->read_len = read_len;
+            cq->read_len = read_len;
             return proc_res_ok_;
         }
     }
 }
 
-static enum proc_res_ proc_child_mkdir_(struct proc_shared_ * s,
-    void * rw_buf, size_t rw_buf_len)
+static enum proc_res_ proc_child_mkdir_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, char * rw_buf, size_t rw_buf_len)
 {
     int dirfd;
     int openflags;
@@ -1493,15 +4223,15 @@ static enum proc_res_ proc_child_mkdir_(struct proc_shared_ * s,
     return proc_res_ok_;
 }
 
-static enum proc_res_ proc_child_write_fsync_close_(struct proc_shared_ * s,
-    void * rw_buf, size_t rw_buf_len)
+static enum proc_res_ proc_child_write_fsync_close_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, char * rw_buf, size_t rw_buf_len)
 {
     const char * write_buf = rw_buf;
-    size_t write_len = s->write_len;
+    size_t write_len = q->write_len;
     int fd;
-    s->written = 0;
+    cq->written = 0;
 
-    fd = open((const char *) rw_buf + write_len, s->open_flags, 00600);
+    fd = open(rw_buf + write_len, q->open_flags, 00600);
     if (fd == -1) {
         SOB_AFS_PROC_C_FAIL_("open");
         return proc_res_fail_;
@@ -1511,12 +4241,12 @@ static enum proc_res_ proc_child_write_fsync_close_(struct proc_shared_ * s,
     while (1) {
         ssize_t written = write(fd, write_buf, write_len);
         if (written == write_len) {
-            s->written += written;
+            cq->written += written;
             break;
         } else if (written != -1) { /* interrupted */
             write_buf += written;
             write_len -= written;
-            s->written += written;
+            cq->written += written;
             continue;
         } else {
             if (errno == EINTR) {
@@ -1540,6 +4270,44 @@ static enum proc_res_ proc_child_write_fsync_close_(struct proc_shared_ * s,
     return proc_res_ok_;
 }
 
+/* write_fsync_close of path.tmp, then rename over path and fsync its dir */
+static enum proc_res_ proc_child_replace_(const struct proc_sqe_ * q,
+    struct proc_cqe_ * cq, char * rw_buf, size_t rw_buf_len)
+{
+    const char * tmp_path = rw_buf + q->write_len;
+    const char * new_path = tmp_path + strlen(tmp_path) + 1;
+    const char * dir_path = new_path + strlen(new_path) + 1;
+    int openflags;
+    int dirfd;
+    enum proc_res_ res;
+
+    res = proc_child_write_fsync_close_(q, cq, rw_buf, rw_buf_len);
+    if (res != proc_res_ok_) {
+        return res;
+    }
+    if (rename(tmp_path, new_path) != 0) {
+        SOB_AFS_PROC_C_FAIL_("rename");
+        return proc_res_fail_;
+    }
+
+    openflags = O_RDONLY;
+#ifdef O_DIRECTORY
+    openflags |= O_DIRECTORY;
+#endif
+    dirfd = open(dir_path, openflags);
+    if (dirfd == -1) {
+        SOB_AFS_PROC_C_FAIL_("open dir");
+        return proc_res_fail_;
+    }
+    if (fsync(dirfd) != 0) {
+        close(dirfd);
+        SOB_AFS_PROC_C_FAIL_("fsync dir");
+        return proc_res_fail_;
+    }
+    close(dirfd);
+    return proc_res_ok_;
+}
+
 static enum afs_event proc_cmd_fail_ev_(enum proc_cmd_ cmd)
 {
     switch (cmd) {
@@ -1554,13 +4322,21 @@ static enum afs_event proc_cmd_fail_ev_(enum proc_cmd_ cmd)
     case proc_cmd_fsync_:
         return afs_ev_fsync_fail;
     case proc_cmd_write_:
+    case proc_cmd_writev_:
         return afs_ev_write_fail;
     case proc_cmd_readall_:
+    case proc_cmd_readall_stream_:
         return afs_ev_readall_fail;
+    case proc_cmd_map_:
+        return afs_ev_map_fail;
+    case proc_cmd_group_sync_:
+        return afs_ev_fsync_fail;
     case proc_cmd_mkdir_:
         return afs_ev_mkdir_fail;
     case proc_cmd_write_fsync_close_:
         return afs_ev_write_fsync_close_fail;
+    case proc_cmd_replace_:
+        return afs_ev_replace_fail;
     };
     SOB_PANIC("unreacheable");
     return afs_ev_init_fail;
@@ -1669,15 +4445,27 @@ int main(int argc, char ** argv) {
     int fd_b;
     int mkdir_fd;
     int fd_write;
+    int fd_stream;
+    int fd_map_a;
+    int fd_map_b;
+    struct afs_group_stats group_stats;
+    int fd_journal;
+    void * journal_rw_buf = NULL;
+    size_t journal_rw_buf_len = 0;
+    struct afs_slice slices[2];
+    size_t copied_len = 0;
+    size_t streamed_len = 0;
     struct afs_ctx c_;
     struct afs_ctx * c = &c_;
-    struct afs_ev evs[10];
+    struct afs_ev evs[20];
+    size_t i;
     void * b_rw_buf = NULL;
     size_t b_rw_buf_len = 0;
     void * write_rw_buf = NULL;
     size_t write_rw_buf_len = 0;
     int should_wait_write = 0;
     const char write_str[] = "Hello, world!\n";
+    const char replace_str[] = "Bye, world!\n";
 
     if (argc != 3) {
         fprintf(stderr, "pass source path and dest path\n");
@@ -1686,7 +4474,14 @@ int main(int argc, char ** argv) {
     path_a = argv[1];
     path_b = argv[2];
 
-    afs_init(c);
+    afs_init(c, (getenv("SOB_AFS_DEMO_URING") != NULL)
+        ? afs_backend_uring : afs_backend_fork);
+    /* 3 fds on 2 workers to have them share one */
+    SOB_AFS_DEMO_CHECK_(afs_set_pool(c, 2, 2));
+    /* small, to get many chunks */
+    SOB_AFS_DEMO_CHECK_(afs_set_stream(c, 2, 4096));
+    SOB_AFS_DEMO_CHECK_(afs_set_group_commit(c, 1000));
+    SOB_AFS_DEMO_CHECK_(afs_prefork(c, 1));
 
     SOB_AFS_DEMO_CHECK_(
         afs_mkdir(c, "/tmp/SOB_AFS_DEMO", &mkdir_fd));
@@ -1698,6 +4493,8 @@ int main(int argc, char ** argv) {
     evs[1].ty = afs_ev_open;
     evs[2].ty = afs_ev_mkdir;
     SOB_AFS_DEMO_WAIT_EVS_(c, evs, 3);
+    fprintf(stderr, "backend: %s\n",
+        (afs_get_backend(c) == afs_backend_uring) ? "uring" : "fork");
 
     while (1) {
         SOB_AFS_DEMO_CHECK_(afs_readall(c, fd_a));
@@ -1718,18 +4515,115 @@ int main(int argc, char ** argv) {
         }
         memcpy(b_rw_buf, evs[0].d.readall.data, evs[0].d.readall.len);
         SOB_AFS_DEMO_CHECK_(afs_write(c, fd_b, evs[0].d.readall.len));
+        copied_len += evs[0].d.readall.len;
         should_wait_write = 1;
     }
 
+    /* queued at once; both fsyncs of fd_b go with one fdatasync, and
+     * fd_b is closed only after it */
+    afs_set_tag(c, 1);
     SOB_AFS_DEMO_CHECK_(afs_fsync(c, fd_b));
-    evs[0].ty = afs_ev_fsync;
-    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
-
+    SOB_AFS_DEMO_CHECK_(afs_fsync(c, fd_b));
+    afs_set_tag(c, 2);
     SOB_AFS_DEMO_CHECK_(afs_close(c, fd_a));
     SOB_AFS_DEMO_CHECK_(afs_close(c, fd_b));
+    afs_set_tag(c, 0);
+    evs[0].ty = afs_ev_fsync;
+    evs[1].ty = afs_ev_fsync;
+    evs[2].ty = afs_ev_close;
+    evs[3].ty = afs_ev_close;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 4);
+    if (afs_ev_tag(&evs[0]) != 1 || afs_ev_tag(&evs[2]) != 2) {
+        SOB_PANIC("bad tags");
+    }
+    afs_get_group_stats(c, &group_stats);
+    fprintf(stderr, "group commit: %lu fsyncs, %lu syncs, %lu flushes\n",
+        group_stats.fsyncs, group_stats.syncs, group_stats.flushes);
+    if (group_stats.fsyncs != 2 || group_stats.syncs != 1) {
+        SOB_PANIC("fsyncs were not held together");
+    }
+
+    SOB_AFS_DEMO_CHECK_(
+        afs_open(c, path_a, O_RDONLY | O_NOCTTY, &fd_stream));
+    evs[0].ty = afs_ev_open;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
+    SOB_AFS_DEMO_CHECK_(afs_readall_stream(c, fd_stream));
+    while (1) {
+        struct afs_ev * stream_evs;
+        ssize_t stream_evs_len = update_(__LINE__, c, &stream_evs);
+        ssize_t i;
+        int is_done = 0;
+        if (stream_evs_len < 0) {
+            SOB_PANIC("stream never finished");
+        }
+        for (i = 0; i < stream_evs_len; i++) {
+            const struct afs_ev * ev = &stream_evs[i];
+            if (ev->ty != afs_ev_readall) {
+                continue;
+            }
+            if (afs_ev_readall_off(ev) != streamed_len) {
+                SOB_PANIC("chunk at %lu, expected %lu",
+                    (unsigned long) afs_ev_readall_off(ev),
+                    (unsigned long) streamed_len);
+            }
+            if (afs_ev_readall_len(ev) == 0) {
+                is_done = 1;
+            }
+            streamed_len += afs_ev_readall_len(ev);
+        }
+        if (is_done) {
+            break;
+        }
+    }
+    if (streamed_len != copied_len) {
+        SOB_PANIC("streamed %lu, copied %lu",
+            (unsigned long) streamed_len, (unsigned long) copied_len);
+    }
+    SOB_AFS_DEMO_CHECK_(afs_close(c, fd_stream));
     evs[0].ty = afs_ev_close;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
+
+    /* wait_evs_ fills the first ev of a ty, so one at a time */
+    SOB_AFS_DEMO_CHECK_(afs_map(c, path_a, &fd_map_a));
+    evs[0].ty = afs_ev_map;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
+    SOB_AFS_DEMO_CHECK_(afs_map(c, path_b, &fd_map_b));
+    evs[1].ty = afs_ev_map;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs + 1, 1);
+    if (afs_ev_map_len(&evs[0]) != copied_len
+        || afs_ev_map_len(&evs[1]) != copied_len
+        || memcmp(afs_ev_map_data(&evs[0]), afs_ev_map_data(&evs[1]),
+            copied_len) != 0)
+    {
+        SOB_PANIC("mapped files differ");
+    }
+    SOB_AFS_DEMO_CHECK_(afs_unmap(c,
+        afs_ev_map_data(&evs[0]), afs_ev_map_len(&evs[0])));
+    SOB_AFS_DEMO_CHECK_(afs_unmap(c,
+        afs_ev_map_data(&evs[1]), afs_ev_map_len(&evs[1])));
+
+    /* two records in one cmd */
+    SOB_AFS_DEMO_CHECK_(afs_open(c, "/tmp/SOB_AFS_DEMO/journal.txt",
+        O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_NOCTTY, &fd_journal));
+    evs[0].ty = afs_ev_open;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
+    SOB_AFS_DEMO_CHECK_(afs_get_rw_buf(c, fd_journal,
+        &journal_rw_buf, &journal_rw_buf_len));
+    memcpy(journal_rw_buf, "paid\n", 5);
+    memcpy((char *) journal_rw_buf + 100, "unlocked\n", 9);
+    slices[0].off = 0;
+    slices[0].len = 5;
+    slices[1].off = 100;
+    slices[1].len = 9;
+    SOB_AFS_DEMO_CHECK_(afs_writev(c, fd_journal, slices, 2));
+    SOB_AFS_DEMO_CHECK_(afs_close(c, fd_journal));
+    evs[0].ty = afs_ev_write;
     evs[1].ty = afs_ev_close;
     SOB_AFS_DEMO_WAIT_EVS_(c, evs, 2);
+    if (afs_ev_write_len(&evs[0]) != 5 + 9) {
+        SOB_PANIC("writev wrote %lu",
+            (unsigned long) afs_ev_write_len(&evs[0]));
+    }
 
     SOB_AFS_DEMO_CHECK_(afs_reserve(c, &fd_write));
     SOB_AFS_DEMO_CHECK_(
@@ -1743,6 +4637,60 @@ int main(int argc, char ** argv) {
     evs[0].ty = afs_ev_write_fsync_close;
     SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
 
+    SOB_AFS_DEMO_CHECK_(afs_reserve(c, &fd_write));
+    SOB_AFS_DEMO_CHECK_(
+        afs_get_rw_buf(c, fd_write, &write_rw_buf, &write_rw_buf_len));
+    memcpy(write_rw_buf, replace_str, sizeof(replace_str) - 1);
+    SOB_AFS_DEMO_CHECK_(afs_replace(c, fd_write,
+        "/tmp/SOB_AFS_DEMO/hello.txt", sizeof(replace_str) - 1));
+    evs[0].ty = afs_ev_replace;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
+    SOB_AFS_DEMO_CHECK_(afs_map(c, "/tmp/SOB_AFS_DEMO/hello.txt", &fd_map_a));
+    evs[0].ty = afs_ev_map;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
+    if (afs_ev_map_len(&evs[0]) != sizeof(replace_str) - 1
+        || memcmp(afs_ev_map_data(&evs[0]), replace_str,
+            sizeof(replace_str) - 1) != 0)
+    {
+        SOB_PANIC("file was not replaced");
+    }
+    SOB_AFS_DEMO_CHECK_(afs_unmap(c,
+        afs_ev_map_data(&evs[0]), afs_ev_map_len(&evs[0])));
+
+    /* one more fd than the pool serves, so the last one waits for a slot
+     * with its cmds queued */
+    for (i = 0; i < 5; i++) {
+        char wait_path[64];
+        sprintf(wait_path, "/tmp/SOB_AFS_DEMO/wait_%lu.txt",
+            (unsigned long) i);
+        SOB_AFS_DEMO_CHECK_(afs_open(c, wait_path,
+            O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, &fd_write));
+        SOB_AFS_DEMO_CHECK_(
+            afs_get_rw_buf(c, fd_write, &write_rw_buf, &write_rw_buf_len));
+        /* past the path, which the open reads when it runs */
+        memcpy((char *) write_rw_buf + 100, write_str, sizeof(write_str) - 1);
+        SOB_AFS_DEMO_CHECK_(
+            afs_write_from(c, fd_write, 100, sizeof(write_str) - 1));
+        SOB_AFS_DEMO_CHECK_(afs_fsync(c, fd_write));
+        SOB_AFS_DEMO_CHECK_(afs_close(c, fd_write));
+        evs[i * 4].ty = afs_ev_open;
+        evs[i * 4 + 1].ty = afs_ev_write;
+        evs[i * 4 + 2].ty = afs_ev_fsync;
+        evs[i * 4 + 3].ty = afs_ev_close;
+    }
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 20);
+    SOB_AFS_DEMO_CHECK_(afs_map(c, "/tmp/SOB_AFS_DEMO/wait_4.txt", &fd_map_a));
+    evs[0].ty = afs_ev_map;
+    SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
+    if (afs_ev_map_len(&evs[0]) != sizeof(write_str) - 1
+        || memcmp(afs_ev_map_data(&evs[0]), write_str,
+            sizeof(write_str) - 1) != 0)
+    {
+        SOB_PANIC("waiting fd wrote wrong data");
+    }
+    SOB_AFS_DEMO_CHECK_(afs_unmap(c,
+        afs_ev_map_data(&evs[0]), afs_ev_map_len(&evs[0])));
+
     SOB_AFS_DEMO_CHECK_(afs_stop_prep(c));
     evs[0].ty = afs_ev_stop;
     SOB_AFS_DEMO_WAIT_EVS_(c, evs, 1);
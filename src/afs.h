@@ -16,6 +16,23 @@
 
 struct afs_ctx;
 
+/* a part of the rw_buf for afs_writev */
+struct afs_slice {
+    size_t off;
+    size_t len;
+};
+#define SOB_AFS_SLICES_MAX 8
+
+/* see afs_set_group_commit */
+struct afs_group_stats {
+    unsigned long flushes; /* windows closed */
+    unsigned long fsyncs; /* afs_fsync calls held; fsyncs / syncs is
+                           * the batching factor */
+    unsigned long syncs; /* fdatasync calls actually made, one per file */
+    unsigned long held_us_total; /* summed over the fsyncs */
+    unsigned long held_us_max; /* of a window */
+};
+
 struct afs_ev;
 enum afs_event {
     afs_ev_init,
@@ -36,6 +53,15 @@ enum afs_event {
     afs_ev_mkdir_fail,
     afs_ev_write_fsync_close,
     afs_ev_write_fsync_close_fail,
+    afs_ev_map,
+    afs_ev_map_fail,
+    afs_ev_replace,
+    afs_ev_replace_fail,
+};
+
+enum afs_backend {
+    afs_backend_fork, /* pool of worker processes doing blocking io */
+    afs_backend_uring /* io_uring; falls back to afs_backend_fork */
 };
 
 enum afs_res {
@@ -49,7 +75,64 @@ enum afs_res {
 struct sob_fail * afs_get_fail(struct afs_ctx * c);
 
 /* no afs_ev_init or afs_ev_init_fail */
-void afs_init(struct afs_ctx * c);
+void afs_init(struct afs_ctx * c, enum afs_backend backend);
+
+/* the one actually used; known after afs_prefork or the first afs_open,
+ * afs_mkdir or afs_reserve. afs_backend_uring needs a build with SOB_AFS_URING
+ * and linux 5.15+ */
+enum afs_backend afs_get_backend(const struct afs_ctx * c);
+
+/* before the first afs_open, afs_mkdir or afs_reserve;
+ * up to workers_maxlen child processes, each serving up to fds_per_worker
+ * afs fds one cmd at a time (4 of 8 by default).
+ * with afs_backend_uring a single ring serves
+ * workers_maxlen * fds_per_worker afs fds. more afs fds wait for a slot,
+ * see afs_set_fds_maxlen */
+enum afs_res afs_set_pool(struct afs_ctx * c,
+    size_t workers_maxlen, size_t fds_per_worker);
+
+/* before the first afs_open, afs_mkdir or afs_reserve;
+ * up to fds_maxlen afs fds at once (1024 by default, never fewer than the
+ * pool serves), beyond that afs_open, afs_mkdir, afs_map and afs_reserve
+ * fail. the ones the pool has no slot for wait until afs_update releases
+ * others, oldest first: their cmds are queued as usual and run then, and
+ * their rw_buf is a copy of its own that moves to the slot, so get it
+ * again after afs_update. afs_stop_prep fails the cmds still waiting */
+enum afs_res afs_set_fds_maxlen(struct afs_ctx * c, size_t fds_maxlen);
+
+/* before the first afs_open, afs_mkdir or afs_reserve;
+ * cmds on an afs fd are run in order, up to depth of them may be queued
+ * without waiting for their events. nothing may follow afs_close,
+ * afs_write_fsync_close or afs_mkdir, and only one afs_readall may be
+ * queued per fd as it reads into the rw_buf */
+enum afs_res afs_set_queue_depth(struct afs_ctx * c, size_t depth);
+
+/* before the first afs_open, afs_mkdir or afs_reserve;
+ * afs_readall_stream reads ahead up to chunks_len chunks of chunk_len
+ * (4 of 64KiB by default). with io_uring it is one chunk ahead */
+enum afs_res afs_set_stream(struct afs_ctx * c,
+    size_t chunks_len, size_t chunk_len);
+
+/* before the first afs_open, afs_mkdir or afs_reserve;
+ * with window_us >= 0 afs_fsync is held for up to window_us, or until
+ * the next afs_pollfds when it is 0, and then the held ones are flushed
+ * together: one fdatasync per file, all files at once, completes all the
+ * fsyncs of the file. the cmds after a held fsync go on, so its
+ * afs_ev_fsync may come after their evs; afs_close waits for it.
+ * -1 (off) by default */
+enum afs_res afs_set_group_commit(struct afs_ctx * c, long window_us);
+
+void afs_get_group_stats(const struct afs_ctx * c,
+    struct afs_group_stats * stats_out);
+
+/* after the other afs_set_* calls; allocates the pool now and spawns
+ * workers_len workers (up to workers_maxlen), so the first cmds do not
+ * wait for a fork. afs_pollfds then spawns one more whenever fewer than
+ * workers_len have no fds. does nothing else with io_uring */
+enum afs_res afs_prefork(struct afs_ctx * c, size_t workers_len);
+
+/* every cmd submitted after this gets the tag on its event; 0 by default */
+void afs_set_tag(struct afs_ctx * c, unsigned long tag);
 
 enum afs_res afs_open(struct afs_ctx * c,
     const char * path, int flags, int * afs_fd_out);
@@ -58,22 +141,61 @@ enum afs_res afs_close(struct afs_ctx * c, int fd_from_afs);
 
 enum afs_res afs_fsync(struct afs_ctx * c, int fd_from_afs);
 
-/* used as path for afs_open, buffer for afs_write and afs_readall */
+/* used as path for afs_open, buffer for afs_write and afs_readall;
+ * a queued cmd reads it when it runs, so leave its part alone till then.
+ * it moves once if the afs fd waited for a slot, see afs_set_fds_maxlen */
 enum afs_res afs_get_rw_buf(struct afs_ctx * c,
     int fd_from_afs, void ** buf_out, size_t * len_out);
 
 enum afs_res afs_write(struct afs_ctx * c, int fd_from_afs, size_t len);
 
+/* writes len bytes at rw_buf + buf_off; lets several writes be queued */
+enum afs_res afs_write_from(struct afs_ctx * c,
+    int fd_from_afs, size_t buf_off, size_t len);
+
+/* writes up to SOB_AFS_SLICES_MAX slices of the rw_buf with a single
+ * writev and gives a single afs_ev_write with their total. on an fd
+ * opened with O_APPEND the slices are appended together, so several
+ * records cost one cmd */
+enum afs_res afs_writev(struct afs_ctx * c, int fd_from_afs,
+    const struct afs_slice * slices, size_t slices_len);
+
+/* same, with pwritev at off */
+enum afs_res afs_pwritev(struct afs_ctx * c, int fd_from_afs,
+    const struct afs_slice * slices, size_t slices_len, long long off);
+
 enum afs_res afs_readall(struct afs_ctx * c, int fd_from_afs);
 
+/* for files of any size: gives afs_ev_readall per chunk, with its offset,
+ * and then one with len 0 and the total as offset. chunk data is valid
+ * until the next afs_pollfds; does not touch the rw_buf */
+enum afs_res afs_readall_stream(struct afs_ctx * c, int fd_from_afs);
+
 enum afs_res afs_mkdir(struct afs_ctx * c, const char * path, int * afs_fd_out);
 
+/* opens and maps the file read-only, off the loop; afs_ev_map gives the
+ * data, valid until afs_unmap. the afs fd is released after the ev.
+ * the file is mapped shared, so it is meant for files nobody truncates */
+enum afs_res afs_map(struct afs_ctx * c, const char * path, int * afs_fd_out);
+
+/* takes afs_ev_map_data and afs_ev_map_len */
+enum afs_res afs_unmap(struct afs_ctx * c, const char * data, size_t len);
+
 enum afs_res afs_reserve(struct afs_ctx * c, int * afs_fd_out);
 
 enum afs_res afs_write_fsync_close(struct afs_ctx * c,
     int fd_from_afs,
     const char * path, int flags, size_t write_len);
 
+/* the first write_len bytes of the rw_buf replace the file at path:
+ * they are written to path.tmp, which is fsynced and renamed over path,
+ * and then the dir of path is fsynced, all as one cmd with one
+ * afs_ev_replace or afs_ev_replace_fail. path is either the old or the
+ * new file at any point, but path.tmp may be left behind by a fail.
+ * like afs_write_fsync_close, takes the afs fd from afs_reserve */
+enum afs_res afs_replace(struct afs_ctx * c,
+    int fd_from_afs, const char * path, size_t write_len);
+
 enum afs_res afs_stop_prep(struct afs_ctx * c);
 
 enum afs_res afs_stop(struct afs_ctx * c);
@@ -92,12 +214,23 @@ int afs_ev_is_fail(const struct afs_ev * ev);
 
 int afs_ev_fd(const struct afs_ev * ev);
 
+/* see afs_set_tag */
+unsigned long afs_ev_tag(const struct afs_ev * ev);
+
 size_t afs_ev_write_len(const struct afs_ev * ev);
 
 size_t afs_ev_readall_len(const struct afs_ev * ev);
 
 const char * afs_ev_readall_data(const struct afs_ev * ev);
 
+/* of the chunk for afs_readall_stream, 0 for afs_readall */
+size_t afs_ev_readall_off(const struct afs_ev * ev);
+
+size_t afs_ev_map_len(const struct afs_ev * ev);
+
+/* NULL for an empty file */
+const char * afs_ev_map_data(const struct afs_ev * ev);
+
 const char * afs_event_str(enum afs_event event);
 
 #endif /* SOB_AFS_H_SENTRY */
@@ -1,7 +1,10 @@
 #include <unistd.h> /* for close */
 #include <stdio.h> /* for perror */
 #include <string.h> /* for memcpy */
+#include <stdlib.h> /* for realloc */
 #include <sys/timerfd.h> /* XXX: linux specific, not portable */
+#include <time.h> /* for clock_gettime */
+#include <limits.h> /* for LLONG_MAX */
 
 #include <curl/curl.h>
 
@@ -9,18 +12,98 @@
 #include "panic.h"
 
 enum {
+    /* one per req and the poll, init or stopped and a spare one */
+    evs_maxlen_ = https_reqs_maxlen + 3,
     /* arbitrary */
-
-    evs_maxlen_ = 12,
-    fds_maxlen_ = 24
+    fds_init_cap_ = 8,
+    h1_conns_default_maxlen_ = 4,
+    body_chunk_len_ = 1024, /* what wjson writes before it is flushed */
+    poll_url_len_ = 512,
+    poll_timeout_margin_s_ = 10, /* over the timeout of the long poll */
+    poll_update_depth_ = 3, /* {"result": [{"update_id": N */
+    /* of a poll that failed in a way that may pass, see poll_retry_ */
+    poll_retry_base_ms_ = 1000,
+    poll_retry_max_ms_ = 60000,
+    endpoints_maxlen_ = 16,
+    endpoint_name_len_ = 48,
+    /* log-linear in microseconds: the ones below hist_sub_len_ have a
+     * bucket each, then each power of 2 is cut in hist_sub_len_ buckets,
+     * up to 2^32; see hist_bucket_ */
+    hist_sub_bits_ = 4,
+    hist_sub_len_ = 1 << hist_sub_bits_,
+    hist_buckets_len_ = (32 - hist_sub_bits_ + 1) * hist_sub_len_,
+    /* counts are halved when they sum to it, so the old ones fade */
+    hist_decay_len_ = 1024,
+    /* handles kept free of each class for the ones above it */
+    prio_reserved_ = 1,
+    /* of a response that is not given to the caller, for retry_after */
+    retry_body_len_ = 256,
+    retry_str_len_ = 128,
+    retry_after_depth_ = 2, /* {"parameters": {"retry_after": N */
+    /* "Idempotence-Key: " and the key */
+    idem_hdr_len_ = https_idem_key_maxlen + 32
 };
 
 struct https_ev {
     enum https_ev_type ty;
+    unsigned long req_id; /* 0 if not about a req */
+    long status;
+    int is_json_syntax;
+    int is_deadline;
+    struct https_timings timings;
+};
+
+struct endpoint_ {
+    char name[endpoint_name_len_];
+    unsigned long reqs;
+    unsigned long hist[hist_buckets_len_];
+    unsigned long hist_len; /* the sum of hist */
+};
+
+struct https_share {
+    CURLSH * sh;
+};
+
+/* an easy handle of the pool and the req it runs */
+struct req_ {
+    struct https_mod * m;
+    CURL * curl; /* NULL until first used */
+    int is_pend;
+    unsigned long id;
+    enum https_prio prio;
+    int is_deadline;
+    long long deadline_ns; /* 0 for none */
+    /* retries, see https_set_retry */
+    int tries_left; /* after this one */
+    int is_idem; /* safe to send again */
+    int is_resp_out; /* some of the response went to the caller */
+    int is_retry_body; /* the response is kept here instead */
+    char retry_body[retry_body_len_];
+    size_t retry_body_len;
+    long long retry_due_ns; /* 0 if not waiting to be sent again */
+    struct curl_slist * idem_hdrs; /* json_hdrs and the key, or NULL */
+    char * url_buf; /* of a GET with data, the url and the query */
+    size_t url_cap;
+    /* the sink of https_req_json_parse, NULL for data_cb */
+    struct rjson_ctx * json;
+    https_json_cb json_cb;
+    void * json_user;
+    int is_json_syntax;
+    int is_json_fin; /* the top-level value ended */
+    /* the body of https_req_json_body, made on first use */
+    https_body_cb body_cb;
+    void * body_user;
+    int is_body_done;
+    struct wjson_ctx * body_json; /* flushes into body_buf */
+    char * body_chunk;
+    char * body_buf; /* what curl did not take yet */
+    size_t body_len;
+    size_t body_off;
+    size_t body_cap;
 };
 
 static enum set_fd_res_ {
-    set_fd_add_overflow_ = -1,
+    set_fd_no_mem_ = -1,
     set_fd_ok_ = 1
 } set_fd_(struct https_mod * m, int fd, short events);
 
@@ -32,13 +115,14 @@ static enum del_fd_res_ {
 static enum add_ev_res_ {
     add_ev_overflow_ = -1,
     add_ev_ok_ = 1
-} add_ev_(struct https_mod * m, enum https_ev_type ty);
+} add_ev_(struct https_mod * m, enum https_ev_type ty,
+    const struct req_ * req, long status);
 
 enum st_ {
     st_uninit_ = 0,
     st_just_init_,
     st_idle_,
-    st_pend_,
+    st_pend_, /* at least one req is pending */
     st_stopped_,
     st_err_
 };
@@ -47,11 +131,35 @@ static enum set_st_res_ {
     set_st_ok_ = 1
 } set_st_(struct https_mod * m, enum st_ st);
 
+static void req_done_(struct https_mod * m, struct req_ * req);
+static enum retry_res_ {
+    retry_no_ = 0,
+    retry_waiting_ = 1,
+    retry_give_up_ = 2 /* the response was kept, so the req fails */
+} retry_(struct https_mod * m, struct req_ * req, CURLcode res);
+static void retry_due_(struct https_mod * m);
+static int is_retry_status_(const struct req_ * req, long status);
+static int is_retry_err_(const struct req_ * req, CURLcode res);
+static long backoff_ms_(struct https_mod * m, long base_ms, long max_ms,
+    int tries);
+static int arm_timer_(struct https_mod * m);
+static long long now_ns_(void);
+static void poll_done_(struct https_mod * m, CURLcode res);
+static void poll_retry_(struct https_mod * m, long status);
+static enum https_poll_res poll_prep_(struct https_mod * m);
+static enum https_poll_res poll_send_(struct https_mod * m);
+static void timings_(CURL * curl, struct https_timings * t);
+static void endpoint_note_(struct https_mod * m, CURL * curl);
+
 static int sock_cb_(CURL * h, curl_socket_t sock, int what,
     void * data, void * fd_data);
 static int timer_cb_(CURLM * h, long timeout_ms, void * data);
 static int write_cb_(char * data, size_t throwaway, size_t len,
     void * user_data);
+static int resp_out_(struct req_ * req, const char * data, size_t len);
+static void retry_body_out_(struct req_ * req);
+static size_t read_cb_(char * buf, size_t throwaway, size_t len,
+    void * user_data);
 
 struct https_mod {
     enum st_ st;
@@ -66,13 +174,61 @@ struct https_mod {
 
     https_resp_data_cb data_cb;
     void * data_cb_user;
-    long resp_status;
 
-    struct pollfd fds[fds_maxlen_];
+    /* dense for poll; fd_pos[fd] is the index of fd in it or -1 */
+    struct pollfd * fds;
     size_t fds_len;
+    size_t fds_cap;
+    int * fd_pos;
+    size_t fd_pos_len;
+    /* https_update works on a copy, as curl changes fds meanwhile */
+    struct pollfd * ready;
+    size_t ready_cap;
     int timerfd;
+    /* CLOCK_MONOTONIC; -1 if curl has no timeout. the timer is set to
+     * the earliest of it and retry_due_ns of the reqs */
+    long long curl_due_ns;
+
+    struct req_ reqs[https_reqs_maxlen];
+    size_t reqs_pend;
+    unsigned long next_req_id;
+    long timeout_s; /* of the reqs with no deadline */
+    /* for the next req, see https_next_req */
+    enum https_prio next_prio;
+    long next_deadline_ms;
+    const char * next_idem_key; /* NULL for none */
+    int retry_tries_maxlen;
+    long retry_base_ms;
+    long retry_max_ms;
+    struct rjson_ctx * retry_json; /* NULL until https_set_retry */
+    char retry_str[retry_str_len_];
+    unsigned long long rand_state; /* of the jitter */
+    long verbose;
+    long streams_maxlen; /* 0 for no HTTP/2 */
+    struct https_share * share; /* NULL if not attached */
+
+    struct endpoint_ endpoints[endpoints_maxlen_];
+    size_t endpoints_len;
+
+    /* the long poll; poll.curl is NULL until https_poll_start */
+    struct req_ poll;
+    int is_poll_on;
+    const char * poll_base_url;
+    char poll_url[poll_url_len_];
+    long poll_timeout_s;
+    long long poll_offset;
+    long long poll_sent_offset; /* of the poll in flight */
+    int poll_fails; /* in a row, for the backoff */
+    long poll_retry_after_ms; /* of the last batch, -1 if none */
+    struct rjson_ctx * poll_json;
+    char * poll_str;
+    size_t poll_str_mlen;
+    https_json_cb poll_cb;
+    void * poll_user;
+    int poll_depth; /* of the token being parsed */
+    int is_poll_update_id; /* the last token was the key of it */
+    int is_poll_retry_after; /* the same for "retry_after" */
 
-    CURL * curl;
     CURLM * curlm;
 
     struct curl_slist * json_hdrs;
@@ -82,6 +238,8 @@ enum https_init_res https_init(
     struct https_mod * m,
     https_resp_data_cb data_cb, void * data_cb_user)
 {
+    size_t i;
+
     m->st = st_just_init_;
     m->stop_strat = https_stop_strat_wait;
     m->is_stop_waiting = 0;
@@ -93,15 +251,64 @@ enum https_init_res https_init(
     m->data_cb = data_cb;
     m->data_cb_user = data_cb_user;
 
-    m->resp_status = 0;
-
-    m->curl = curl_easy_init();
-    if (m->curl == NULL) {
-        return https_init_fail_curl_easy_init;
+    for (i = 0; i < https_reqs_maxlen; i++) {
+        m->reqs[i].m = m;
+        m->reqs[i].curl = NULL;
+        m->reqs[i].is_pend = 0;
+        m->reqs[i].id = 0;
+        m->reqs[i].json = NULL;
+        m->reqs[i].body_json = NULL;
+        m->reqs[i].body_chunk = NULL;
+        m->reqs[i].body_buf = NULL;
+        m->reqs[i].body_cap = 0;
+        m->reqs[i].retry_due_ns = 0;
+        m->reqs[i].idem_hdrs = NULL;
+        m->reqs[i].url_buf = NULL;
+        m->reqs[i].url_cap = 0;
     }
+    m->reqs_pend = 0;
+    m->next_req_id = 1;
+    m->timeout_s = 0;
+    m->next_prio = https_prio_normal;
+    m->next_deadline_ms = 0;
+    m->next_idem_key = NULL;
+    m->retry_tries_maxlen = 1;
+    m->retry_base_ms = 0;
+    m->retry_max_ms = 0;
+    m->retry_json = NULL;
+    m->rand_state = 0;
+    m->verbose = 0;
+    m->streams_maxlen = https_reqs_maxlen;
+    m->share = NULL;
+
+    m->endpoints_len = 0;
+
+    m->poll.m = m;
+    m->poll.curl = NULL;
+    m->poll.is_pend = 0;
+    m->poll.id = 0;
+    m->poll.json = NULL;
+    m->poll.body_json = NULL;
+    m->poll.body_chunk = NULL;
+    m->poll.body_buf = NULL;
+    m->poll.body_cap = 0;
+    m->poll.is_deadline = 0;
+    m->poll.deadline_ns = 0;
+    m->poll.tries_left = 0;
+    m->poll.is_idem = 1;
+    m->poll.is_resp_out = 0;
+    m->poll.is_retry_body = 0;
+    m->poll.retry_body_len = 0;
+    m->poll.retry_due_ns = 0;
+    m->poll.idem_hdrs = NULL;
+    m->poll.url_buf = NULL;
+    m->poll.url_cap = 0;
+    m->is_poll_on = 0;
+    m->poll_json = NULL;
+
+    /* the easy handles are made by https_req_json as needed */
     m->curlm = curl_multi_init();
     if (m->curlm == NULL) {
-        curl_easy_cleanup(m->curl);
         return https_init_fail_curl_multi_init;
     }
 
@@ -112,20 +319,15 @@ enum https_init_res https_init(
             "Accept: application/json");
     if (m->json_hdrs == NULL) {
         /* XXX: may leak the first slist node in json_hdrs */
-        curl_easy_cleanup(m->curl);
         curl_multi_cleanup(m->curlm);
         return https_init_fail_no_mem;
     }
 
-    curl_easy_setopt(m->curl, CURLOPT_POSTFIELDSIZE, -1L);
-    curl_easy_setopt(m->curl, CURLOPT_HTTPHEADER, m->json_hdrs);
-    curl_easy_setopt(m->curl, CURLOPT_WRITEDATA, m);
-    curl_easy_setopt(m->curl, CURLOPT_WRITEFUNCTION, write_cb_);
-
     curl_multi_setopt(m->curlm, CURLMOPT_SOCKETDATA, m);
     curl_multi_setopt(m->curlm, CURLMOPT_SOCKETFUNCTION, sock_cb_);
     curl_multi_setopt(m->curlm, CURLMOPT_TIMERDATA, m);
     curl_multi_setopt(m->curlm, CURLMOPT_TIMERFUNCTION, timer_cb_);
+    https_set_multiplex(m, m->streams_maxlen, h1_conns_default_maxlen_);
 
     m->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
     if (-1 == m->timerfd) {
@@ -133,17 +335,36 @@ enum https_init_res https_init(
         return https_init_fail_timerfd;
     }
 
+    m->curl_due_ns = -1;
+
+    m->fds = NULL;
     m->fds_len = 0;
+    m->fds_cap = 0;
+    m->fd_pos = NULL;
+    m->fd_pos_len = 0;
+    m->ready = NULL;
+    m->ready_cap = 0;
 
     return https_init_ok;
 }
 
 enum https_stop_prep_res https_stop_prep(struct https_mod * m)
 {
+    /* it would not end before its timeout, and losing it loses nothing */
+    m->is_poll_on = 0;
+    if (m->poll.is_pend) {
+        req_done_(m, &m->poll);
+    }
+
     switch (m->stop_strat) {
     case https_stop_strat_abort:
         if (m->st == st_pend_) {
-            curl_multi_remove_handle(m->curlm, m->curl);
+            size_t i;
+            for (i = 0; i < https_reqs_maxlen; i++) {
+                if (m->reqs[i].is_pend) {
+                    req_done_(m, &m->reqs[i]);
+                }
+            }
         }
         if (set_st_(m, st_stopped_) != set_st_ok_) {
             SOB_PANIC("set_st_(st_stopped_) in https_stop_prep");
@@ -173,11 +394,29 @@ enum https_stop_prep_res https_stop_prep(struct https_mod * m)
 enum https_stop_res https_stop(struct https_mod * m)
 {
     if (m->st == st_stopped_) {
+        size_t i;
         m->st = st_uninit_;
-        curl_easy_cleanup(m->curl);
+        for (i = 0; i < https_reqs_maxlen; i++) {
+            if (m->reqs[i].curl != NULL) {
+                curl_easy_cleanup(m->reqs[i].curl);
+            }
+            free(m->reqs[i].body_json);
+            free(m->reqs[i].body_chunk);
+            free(m->reqs[i].body_buf);
+            curl_slist_free_all(m->reqs[i].idem_hdrs);
+            free(m->reqs[i].url_buf);
+        }
+        if (m->poll.curl != NULL) {
+            curl_easy_cleanup(m->poll.curl);
+        }
+        free(m->poll_json);
+        free(m->retry_json);
         curl_multi_cleanup(m->curlm);
         curl_slist_free_all(m->json_hdrs);
         close(m->timerfd);
+        free(m->fds);
+        free(m->fd_pos);
+        free(m->ready);
 
         return https_stop_ok;
     } else {
@@ -195,27 +434,173 @@ size_t https_pollfds(struct https_mod * m, struct pollfd ** fds_out)
     }
 }
 
-static void req_fail_(struct https_mod * m)
+/* takes the handle of a req off the multi and back to the pool */
+static void req_done_(struct https_mod * m, struct req_ * req)
+{
+    /* not in the multi while waiting for a retry, which curl ignores */
+    curl_multi_remove_handle(m->curlm, req->curl);
+    req->is_pend = 0;
+    req->retry_due_ns = 0;
+    m->reqs_pend--;
+    if (m->reqs_pend == 0 && m->st == st_pend_) {
+        if (set_st_(m, st_idle_) != set_st_ok_) {
+            SOB_PANIC("set_st_(st_idle_) in req_done_");
+        }
+    }
+}
+
+/* the end of the body may complete the last token */
+static void json_end_(struct req_ * req)
 {
-    if (set_st_(m, st_err_) != set_st_ok_) {
-        SOB_PANIC("set_st_(st_err_) in update");
+    int i;
+    /* '\0' once more if the one before was buffered, see rjson_next */
+    for (i = 0; i < 2 && ! req->is_json_fin; i++) {
+        enum rjson_next_res r = rjson_next(req->json, '\0');
+        if (r == rjson_next_syntax) {
+            req->is_json_syntax = 1;
+            return;
+        }
+        if (rjson_cur_ty(req->json) != rjson_incomplete) {
+            (*req->json_cb)(req->id, req->json, req->json_user);
+        }
+        req->is_json_fin = (r == rjson_next_fin);
+    }
+}
+
+/* the batch is in, so the next poll goes out at once */
+static void poll_done_(struct https_mod * m, CURLcode res)
+{
+    struct req_ * req = &m->poll;
+    long status = 0;
+    int is_ok;
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+    is_ok = (res == CURLE_OK && ! req->is_json_syntax && status == 200);
+    if (res != CURLE_OK) {
+        m->curl_err = res;
+    }
+    /* timeout_s and the margin passed with no response */
+    req->is_deadline = (res == CURLE_OPERATION_TIMEDOUT);
+    /* a 502 page of a proxy is not json, so it is not a syntax error */
+    if (! is_ok && m->is_poll_on && (is_retry_status_(req, status)
+        || req->is_deadline || is_retry_err_(req, res)))
+    {
+        poll_retry_(m, status);
+        return;
     }
-    if (add_ev_(m, https_ev_req_fail) != add_ev_ok_) {
-        SOB_PANIC("add_ev_(https_ev_req_fail) in update");
+    if (is_ok) {
+        m->poll_fails = 0;
     }
+    if (add_ev_(m, is_ok ? https_ev_poll_fin : https_ev_poll_fail, req,
+            status) != add_ev_ok_)
+    {
+        SOB_PANIC("add_ev_(https_ev_poll_*) in update");
+    }
+    req_done_(m, req);
+    m->is_poll_on = m->is_poll_on && is_ok;
+    if (m->is_poll_on && poll_send_(m) != https_poll_ok) {
+        m->is_poll_on = 0;
+        if (add_ev_(m, https_ev_poll_fail, req, 0) != add_ev_ok_) {
+            SOB_PANIC("add_ev_(https_ev_poll_fail) in update");
+        }
+    }
+}
+
+/* the poll stays pending, with the offset it was sent with, as some of
+ * the batch may have gone to poll_cb */
+static void poll_retry_(struct https_mod * m, long status)
+{
+    struct req_ * req = &m->poll;
+    long delay_ms = (status == 429) ? m->poll_retry_after_ms : -1;
+    if (add_ev_(m, https_ev_poll_retry, req, status) != add_ev_ok_) {
+        SOB_PANIC("add_ev_(https_ev_poll_retry) in update");
+    }
+    if (delay_ms < 0) {
+        delay_ms = backoff_ms_(m, poll_retry_base_ms_, poll_retry_max_ms_,
+            m->poll_fails);
+    }
+    m->poll_fails++;
+    m->poll_offset = m->poll_sent_offset;
+    curl_multi_remove_handle(m->curlm, req->curl);
+    req->retry_due_ns = now_ns_() + delay_ms * 1000000LL;
+    if (arm_timer_(m) != 0) {
+        SOB_PANIC("arm_timer_ in poll_retry_");
+    }
+}
+
+/* reports reqs that curl finished */
+static void read_info_(struct https_mod * m)
+{
+    struct CURLMsg * cmsg = NULL;
+    do {
+        int qlen = 0;
+        cmsg = curl_multi_info_read(m->curlm, &qlen);
+        if (cmsg != NULL && cmsg->msg == CURLMSG_DONE) {
+            struct req_ * req = NULL;
+            long status = 0;
+            curl_easy_getinfo(cmsg->easy_handle, CURLINFO_PRIVATE, &req);
+            if (req == NULL || ! req->is_pend) {
+                SOB_PANIC("CURLMSG_DONE for a handle not pending");
+            }
+            switch (retry_(m, req, cmsg->data.result)) {
+            case retry_no_:
+                break;
+            case retry_waiting_:
+                continue; /* cmsg is invalid after it */
+            case retry_give_up_:
+                curl_easy_getinfo(req->curl,
+                        CURLINFO_RESPONSE_CODE, &status);
+                retry_body_out_(req);
+                req->is_deadline = 1;
+                if (add_ev_(m, https_ev_req_fail, req, status)
+                    != add_ev_ok_)
+                {
+                    SOB_PANIC("add_ev_(https_ev_req_fail) in update");
+                }
+                req_done_(m, req);
+                continue;
+            };
+            if (cmsg->data.result == CURLE_OK && req->json != NULL) {
+                json_end_(req);
+            }
+            if (req == &m->poll) {
+                poll_done_(m, cmsg->data.result);
+            } else if (cmsg->data.result == CURLE_OK
+                && ! req->is_json_syntax)
+            {
+                curl_easy_getinfo(req->curl,
+                        CURLINFO_RESPONSE_CODE, &status);
+                endpoint_note_(m, req->curl);
+                if (add_ev_(m, https_ev_req_fin, req, status)
+                    != add_ev_ok_)
+                {
+                    SOB_PANIC("add_ev_(https_ev_req_fin) in update");
+                }
+            } else {
+                m->curl_err = cmsg->data.result;
+                req->is_deadline = (cmsg->data.result
+                    == CURLE_OPERATION_TIMEDOUT);
+                if (add_ev_(m, https_ev_req_fail, req, 0) != add_ev_ok_) {
+                    SOB_PANIC("add_ev_(https_ev_req_fail) in update");
+                }
+            }
+            if (req != &m->poll) {
+                /* cmsg is invalid after this */
+                req_done_(m, req);
+            }
+        }
+    } while (cmsg);
 }
 
 void https_update(struct https_mod * m, struct pollfd * fds, nfds_t nfds)
 {
     int i;
     CURLMcode cmres = CURLM_OK;
-    struct CURLMsg * cmsg = NULL;
     int still_running;
 
     m->evs_len = 0;
 
     if (m->st == st_stopped_) {
-        if (add_ev_(m, https_ev_stopped) != add_ev_ok_ ) {
+        if (add_ev_(m, https_ev_stopped, NULL, 0) != add_ev_ok_ ) {
             SOB_PANIC("add_ev_(https_ev_stopped)");
         }
         return;
@@ -225,7 +610,7 @@ void https_update(struct https_mod * m, struct pollfd * fds, nfds_t nfds)
         if (set_st_(m, st_idle_) != set_st_ok_) {
             SOB_PANIC("set_st_(st_err_) in update");
         }
-        if (add_ev_(m, https_ev_init) != add_ev_ok_ ) {
+        if (add_ev_(m, https_ev_init, NULL, 0) != add_ev_ok_ ) {
             SOB_PANIC("add_ev_(https_ev_init)");
         }
         return;
@@ -235,8 +620,19 @@ void https_update(struct https_mod * m, struct pollfd * fds, nfds_t nfds)
         return;
     }
 
-    for (i = 0; i < nfds; i++) {
-        const struct pollfd * fd = &fds[i];
+    if (nfds > m->ready_cap) {
+        struct pollfd * ready = realloc(m->ready,
+            nfds * sizeof(struct pollfd));
+        if (ready == NULL) {
+            SOB_PANIC("realloc ready in update");
+        }
+        m->ready = ready;
+        m->ready_cap = nfds;
+    }
+    memcpy(m->ready, fds, nfds * sizeof(struct pollfd));
+
+    for (i = 0; i < nfds && cmres == CURLM_OK; i++) {
+        const struct pollfd * fd = &m->ready[i];
         if (fd->fd == m->timerfd) {
             if (fd->revents & POLLIN) { /* timer fired */
                 /* drain the buffer */
@@ -246,10 +642,18 @@ void https_update(struct https_mod * m, struct pollfd * fds, nfds_t nfds)
                     perror("read(timerfd) ignored");
                 }
 
+                retry_due_(m);
+                if (m->curl_due_ns >= 0 && m->curl_due_ns <= now_ns_()) {
+                    m->curl_due_ns = -1; /* curl sets the next one */
+                }
+                if (arm_timer_(m) != 0) {
+                    cmres = CURLM_INTERNAL_ERROR;
+                    break;
+                }
                 cmres = curl_multi_socket_action(m->curlm,
                         CURL_SOCKET_TIMEOUT, 0, &still_running);
             }
-        } else {
+        } else if (fd->revents != 0) {
             int cev = 0;
             switch (fd->revents) {
             case POLLIN:
@@ -267,47 +671,42 @@ void https_update(struct https_mod * m, struct pollfd * fds, nfds_t nfds)
             cmres = curl_multi_socket_action(m->curlm,
                     fd->fd, cev, &still_running);
         }
+    }
 
-        if (cmres == CURLM_OK) {
-            do {
-                int qlen = 0;
-                cmsg = curl_multi_info_read(m->curlm, &qlen);
-                if (cmsg != NULL && cmsg->msg == CURLMSG_DONE) {
-                    if (cmsg->data.result == CURLE_OK) {
-                        curl_easy_getinfo(m->curl,
-                                CURLINFO_RESPONSE_CODE, &m->resp_status);
-                        if (set_st_(m, st_idle_) != set_st_ok_) {
-                            SOB_PANIC("set_st_(st_idle_) in update");
-                        }
-                        if (add_ev_(m, https_ev_req_fin) != add_ev_ok_ ) {
-                            SOB_PANIC("add_ev_(https_ev_req_fin) in update");
-                        }
-                        curl_multi_remove_handle(m->curlm, m->curl);
-
-                        if (m->is_stop_waiting) {
-                            m->is_stop_waiting = 0;
-                            if (set_st_(m, st_stopped_) != set_st_ok_) {
-                                SOB_PANIC("set_st_(st_stopped_)");
-                            }
-                            if (add_ev_(m, https_ev_stopped) != add_ev_ok_ ) {
-                                SOB_PANIC("add_ev_(https_ev_stopped)");
-                            }
-                        }
-
-                        return;
-                    } else {
-                        m->curl_err = cmsg->data.result;
-                        req_fail_(m);
-                    }
+    if (cmres != CURLM_OK) {
+        /* the multi is broken, so are all of its reqs */
+        m->curlm_err = cmres;
+        if (m->poll.is_pend) {
+            m->is_poll_on = 0;
+            if (add_ev_(m, https_ev_poll_fail, &m->poll, 0) != add_ev_ok_) {
+                SOB_PANIC("add_ev_(https_ev_poll_fail) in update");
+            }
+            req_done_(m, &m->poll);
+        }
+        for (i = 0; i < https_reqs_maxlen; i++) {
+            struct req_ * req = &m->reqs[i];
+            if (req->is_pend) {
+                if (add_ev_(m, https_ev_req_fail, req, 0) != add_ev_ok_) {
+                    SOB_PANIC("add_ev_(https_ev_req_fail) in update");
                 }
-            } while (cmsg);
+                req_done_(m, req);
+            }
         }
+        if (set_st_(m, st_err_) != set_st_ok_) {
+            SOB_PANIC("set_st_(st_err_) in update");
+        }
+        return;
+    }
 
-        if (cmres != CURLM_OK) {
-            m->curlm_err = cmres;
-            req_fail_(m);
+    read_info_(m);
 
-            return;
+    if (m->is_stop_waiting && m->reqs_pend == 0) {
+        m->is_stop_waiting = 0;
+        if (set_st_(m, st_stopped_) != set_st_ok_) {
+            SOB_PANIC("set_st_(st_stopped_)");
+        }
+        if (add_ev_(m, https_ev_stopped, NULL, 0) != add_ev_ok_ ) {
+            SOB_PANIC("add_ev_(https_ev_stopped)");
         }
     }
 }
@@ -320,19 +719,76 @@ size_t https_events(struct https_mod * m, struct https_ev ** evs_out)
 
 void https_set_timeout(struct https_mod * m, long timeout_s)
 {
-    curl_easy_setopt(m->curl, CURLOPT_TIMEOUT, timeout_s);
+    m->timeout_s = timeout_s;
+}
+
+enum https_retry_res https_set_retry(struct https_mod * m, int tries_maxlen,
+    long base_ms, long max_ms)
+{
+    if (m->retry_json == NULL) {
+        m->retry_json = malloc(rjson_ctx_sizeof());
+        if (m->retry_json == NULL) {
+            return https_retry_fail_no_mem;
+        }
+    }
+    if (m->rand_state == 0) {
+        m->rand_state = (unsigned long long) now_ns_() | 1;
+    }
+    m->retry_tries_maxlen = (tries_maxlen > 0) ? tries_maxlen : 1;
+    m->retry_base_ms = base_ms;
+    m->retry_max_ms = max_ms;
+    return https_retry_ok;
+}
+
+void https_next_req_idem(struct https_mod * m, const char * key)
+{
+    m->next_idem_key = key;
+}
+
+void https_next_req(struct https_mod * m, enum https_prio prio,
+    long deadline_ms)
+{
+    m->next_prio = prio;
+    m->next_deadline_ms = deadline_ms;
+}
+
+enum https_cancel_res https_cancel(struct https_mod * m,
+    unsigned long req_id)
+{
+    size_t i;
+    for (i = 0; i < https_reqs_maxlen; i++) {
+        struct req_ * req = &m->reqs[i];
+        if (req->is_pend && req->id == req_id) {
+            req_done_(m, req);
+            /* https_update does not look at an idle mod */
+            if (m->is_stop_waiting && m->reqs_pend == 0) {
+                m->is_stop_waiting = 0;
+                if (set_st_(m, st_stopped_) != set_st_ok_) {
+                    SOB_PANIC("set_st_(st_stopped_) in https_cancel");
+                }
+            }
+            return https_cancel_ok;
+        }
+    }
+    return https_cancel_fail_not_found;
 }
 
 void https_set_verbosity(struct https_mod * m, enum https_verbosity level)
 {
+    size_t i;
     switch (level) {
     case https_verbosity_silent:
-        curl_easy_setopt(m->curl, CURLOPT_VERBOSE, 0L);
+        m->verbose = 0;
         break;
     case https_verbosity_debug:
-        curl_easy_setopt(m->curl, CURLOPT_VERBOSE, 1L);
+        m->verbose = 1;
         break;
     };
+    for (i = 0; i < https_reqs_maxlen; i++) {
+        if (m->reqs[i].curl != NULL) {
+            curl_easy_setopt(m->reqs[i].curl, CURLOPT_VERBOSE, m->verbose);
+        }
+    }
 }
 
 void https_set_stop_strat(struct https_mod * m, enum https_stop_strategy s)
@@ -340,48 +796,622 @@ void https_set_stop_strat(struct https_mod * m, enum https_stop_strategy s)
     m->stop_strat = s;
 }
 
-enum https_req_res https_req_json(struct https_mod * m,
-    enum https_req_method method, const char * url,
+/* the version is picked by ALPN, so HTTP/1.1 is the fallback */
+static void set_http_version_(struct https_mod * m, CURL * curl)
+{
+    if (m->streams_maxlen > 0) {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+            (long) CURL_HTTP_VERSION_2TLS);
+        /* wait for the connection in progress instead of making another
+         * one, until it is known whether it multiplexes */
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+            (long) CURL_HTTP_VERSION_1_1);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 0L);
+    }
+}
+
+void https_set_multiplex(struct https_mod * m,
+    long streams_maxlen, long h1_conns_maxlen)
+{
+    size_t i;
+    m->streams_maxlen = streams_maxlen;
+    curl_multi_setopt(m->curlm, CURLMOPT_PIPELINING,
+        (streams_maxlen > 0) ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+    if (streams_maxlen > 0) {
+        curl_multi_setopt(m->curlm, CURLMOPT_MAX_CONCURRENT_STREAMS,
+            streams_maxlen);
+    }
+    /* with HTTP/2 there is only one unless it runs out of streams */
+    curl_multi_setopt(m->curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+        h1_conns_maxlen);
+    for (i = 0; i < https_reqs_maxlen; i++) {
+        if (m->reqs[i].curl != NULL && ! m->reqs[i].is_pend) {
+            set_http_version_(m, m->reqs[i].curl);
+        }
+    }
+}
+
+static int req_init_curl_(struct https_mod * m, struct req_ * req)
+{
+    req->curl = curl_easy_init();
+    if (req->curl == NULL) {
+        return 0;
+    }
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE, -1L);
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, m->json_hdrs);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, req);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, write_cb_);
+    curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
+    curl_easy_setopt(req->curl, CURLOPT_VERBOSE, m->verbose);
+    set_http_version_(m, req->curl);
+    if (m->share != NULL) {
+        curl_easy_setopt(req->curl, CURLOPT_SHARE, m->share->sh);
+    }
+    return 1;
+}
+
+/* a handle of the pool that is not pending, made on first use */
+static struct req_ * req_alloc_(struct https_mod * m)
+{
+    size_t i;
+    for (i = 0; i < https_reqs_maxlen; i++) {
+        struct req_ * req = &m->reqs[i];
+        if (req->is_pend) {
+            continue;
+        }
+        if (req->curl == NULL && ! req_init_curl_(m, req)) {
+            return NULL;
+        }
+        return req;
+    }
+    return NULL;
+}
+
+/* url with data after '?', or after '&' if it has a query already; it
+ * lives in req until the handle is used again. NULL if out of mem */
+static const char * query_url_(struct req_ * req, const char * url,
     const char * data)
 {
-    if (m->st != st_idle_ ) {
-        return https_req_fail_other_pend;
+    size_t url_len = strlen(url);
+    size_t len = url_len + 1 + strlen(data) + 1;
+    if (len > req->url_cap) {
+        char * buf = realloc(req->url_buf, len);
+        if (buf == NULL) {
+            return NULL;
+        }
+        req->url_buf = buf;
+        req->url_cap = len;
+    }
+    memcpy(req->url_buf, url, url_len);
+    req->url_buf[url_len] = (strchr(url, '?') != NULL) ? '&' : '?';
+    strcpy(req->url_buf + url_len + 1, data);
+    return req->url_buf;
+}
+
+/* a handle for a new req, or NULL with the res */
+static struct req_ * req_prep_(struct https_mod * m,
+    enum https_req_method method, const char * url, const char * data,
+    enum https_req_res * res_out)
+{
+    struct req_ * req;
+    enum https_prio prio = m->next_prio;
+    long deadline_ms = m->next_deadline_ms;
+    const char * idem_key = m->next_idem_key;
+    m->next_prio = https_prio_normal;
+    m->next_deadline_ms = 0;
+    m->next_idem_key = NULL;
+    if (m->st != st_idle_ && m->st != st_pend_) {
+        *res_out = https_req_fail;
+        return NULL;
     }
     if (m->is_stop_waiting) {
-        return https_req_fail_stopping;
+        *res_out = https_req_fail_stopping;
+        return NULL;
+    }
+    if (m->reqs_pend - m->poll.is_pend + (https_prio_urgent - prio)
+        * prio_reserved_ >= https_reqs_maxlen)
+    {
+        *res_out = https_req_fail_no_handle;
+        return NULL;
+    }
+    req = req_alloc_(m);
+    if (req == NULL) {
+        *res_out = https_req_fail;
+        return NULL;
     }
 
     switch (method) {
         case https_method_get:
-            curl_easy_setopt(m->curl, CURLOPT_HTTPGET, 1L);
+            curl_easy_setopt(req->curl, CURLOPT_HTTPGET, 1L);
+            if (data != NULL) {
+                url = query_url_(req, url, data);
+                if (url == NULL) {
+                    *res_out = https_req_fail;
+                    return NULL;
+                }
+            }
             break;
         case https_method_post:
-            curl_easy_setopt(m->curl, CURLOPT_POST, 1L);
+            /* with NULL, curl would read the body with the reader */
+            curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS,
+                (data != NULL) ? data : "");
             break;
     };
-    curl_easy_setopt(m->curl, CURLOPT_URL, url);
-    curl_easy_setopt(m->curl, CURLOPT_POSTFIELDS, data);
+    curl_easy_setopt(req->curl, CURLOPT_URL, url);
+    /* the handle may have sent a https_req_json_body before */
+    curl_easy_setopt(req->curl, CURLOPT_READFUNCTION, NULL);
+    curl_easy_setopt(req->curl, CURLOPT_READDATA, NULL);
+    /* from when it is added to the multi, so the wait for a connection
+     * counts too */
+    curl_easy_setopt(req->curl, CURLOPT_TIMEOUT_MS,
+        (deadline_ms > 0) ? deadline_ms : m->timeout_s * 1000);
+    /* 16 is the default of HTTP/2 */
+    curl_easy_setopt(req->curl, CURLOPT_STREAM_WEIGHT,
+        (prio == https_prio_urgent) ? 256L
+        : (prio == https_prio_bulk) ? 1L : 16L);
+    req->prio = prio;
+    req->is_deadline = 0;
+    req->deadline_ns = (deadline_ms > 0)
+        ? now_ns_() + deadline_ms * 1000000LL : 0;
+    req->tries_left = m->retry_tries_maxlen - 1;
+    /* a GET may change things too, like sendMessage */
+    req->is_idem = (idem_key != NULL);
+    req->is_resp_out = 0;
+    req->is_retry_body = 0;
+    req->retry_body_len = 0;
+    req->retry_due_ns = 0;
+
+    curl_slist_free_all(req->idem_hdrs);
+    req->idem_hdrs = NULL;
+    if (idem_key != NULL && idem_key[0] != '\0') {
+        char hdr[idem_hdr_len_];
+        struct curl_slist * hdrs = NULL;
+        const struct curl_slist * h;
+        if (strlen(idem_key) > https_idem_key_maxlen) {
+            *res_out = https_req_fail;
+            return NULL;
+        }
+        for (h = m->json_hdrs; h != NULL; h = h->next) {
+            hdrs = curl_slist_append(req->idem_hdrs, h->data);
+            if (hdrs == NULL) {
+                break;
+            }
+            req->idem_hdrs = hdrs;
+        }
+        if (h == NULL) {
+            sprintf(hdr, "Idempotence-Key: %s", idem_key);
+            hdrs = curl_slist_append(req->idem_hdrs, hdr);
+        }
+        if (hdrs == NULL) {
+            curl_slist_free_all(req->idem_hdrs);
+            req->idem_hdrs = NULL;
+            *res_out = https_req_fail;
+            return NULL;
+        }
+        req->idem_hdrs = hdrs;
+    }
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER,
+        (req->idem_hdrs != NULL) ? req->idem_hdrs : m->json_hdrs);
+    req->json = NULL;
+    req->body_cb = NULL;
+    req->is_json_syntax = 0;
+    req->is_json_fin = 0;
+    return req;
+}
 
-    curl_multi_add_handle(m->curlm, m->curl);
+static enum https_req_res req_start_(struct https_mod * m,
+    struct req_ * req, unsigned long * req_id_out)
+{
+    if (curl_multi_add_handle(m->curlm, req->curl) != CURLM_OK) {
+        return https_req_fail;
+    }
+    req->is_pend = 1;
+    req->id = m->next_req_id++;
+    m->reqs_pend++;
+    *req_id_out = req->id;
 
     if (set_st_(m, st_pend_) != set_st_ok_) {
-        SOB_PANIC("set_st_(st_pend_) in https_req_json");
+        SOB_PANIC("set_st_(st_pend_) in req_start_");
     }
 
     return https_req_ok;
 }
 
-long https_resp_status(const struct https_mod * m)
+enum https_req_res https_req_json(struct https_mod * m,
+    enum https_req_method method, const char * url,
+    const char * data, unsigned long * req_id_out)
 {
-    return m->resp_status;
+    enum https_req_res res;
+    struct req_ * req = req_prep_(m, method, url, data, &res);
+    if (req == NULL) {
+        return res;
+    }
+    return req_start_(m, req, req_id_out);
 }
 
+enum https_req_res https_req_json_parse(struct https_mod * m,
+    enum https_req_method method, const char * url, const char * data,
+    struct rjson_ctx * json, https_json_cb json_cb, void * json_user,
+    unsigned long * req_id_out)
+{
+    enum https_req_res res;
+    struct req_ * req = req_prep_(m, method, url, data, &res);
+    if (req == NULL) {
+        return res;
+    }
+    req->json = json;
+    req->json_cb = json_cb;
+    req->json_user = json_user;
+    return req_start_(m, req, req_id_out);
+}
+
+/* tracks the update_id of the batch for the offset of the next poll */
+static void poll_json_cb_(unsigned long req_id,
+    const struct rjson_ctx * json, void * user)
+{
+    struct https_mod * m = user;
+    enum rjson_ty ty = rjson_cur_ty(json);
+    long long id;
+    if (ty == rjson_num && m->is_poll_update_id
+        && rjson_cur_i64(json, &id) == rjson_int_ok && id < LLONG_MAX)
+    {
+        if (id + 1 > m->poll_offset) {
+            m->poll_offset = id + 1;
+        }
+    }
+    if (ty == rjson_num && m->is_poll_retry_after) {
+        double s = rjson_cur_num(json);
+        m->poll_retry_after_ms = (s >= 0 && s < 86400) ? (long) s * 1000 : -1;
+    }
+    /* a value that is a str is followed by a key, never by a num */
+    m->is_poll_update_id = (ty == rjson_str
+        && m->poll_depth == poll_update_depth_
+        && strcmp(rjson_cur_str(json), "update_id") == 0);
+    m->is_poll_retry_after = (ty == rjson_str
+        && m->poll_depth == retry_after_depth_
+        && strcmp(rjson_cur_str(json), "retry_after") == 0);
+    if (ty == rjson_obj_start || ty == rjson_arr_start) {
+        m->poll_depth++;
+    } else if (ty == rjson_obj_end || ty == rjson_arr_end) {
+        m->poll_depth--;
+    }
+    (*m->poll_cb)(req_id, json, m->poll_user);
+}
+
+/* for a poll that is not in the multi, a new one or poll_retry_-ed */
+static enum https_poll_res poll_prep_(struct https_mod * m)
+{
+    struct req_ * req = &m->poll;
+    int len = snprintf(m->poll_url, poll_url_len_,
+        "%s?timeout=%li&offset=%lli",
+        m->poll_base_url, m->poll_timeout_s, m->poll_offset);
+    if (len < 0 || len >= poll_url_len_) {
+        return https_poll_fail;
+    }
+    m->poll_sent_offset = m->poll_offset;
+    m->poll_retry_after_ms = -1;
+    m->is_poll_retry_after = 0;
+    curl_easy_setopt(req->curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(req->curl, CURLOPT_URL, m->poll_url);
+    rjson_init(m->poll_json, m->poll_str, m->poll_str_mlen);
+    m->poll_depth = 0;
+    m->is_poll_update_id = 0;
+    req->json = m->poll_json;
+    req->json_cb = poll_json_cb_;
+    req->json_user = m;
+    req->is_json_syntax = 0;
+    req->is_json_fin = 0;
+    req->body_cb = NULL;
+    /* as req_prep_ does; it is never sent again by retry_ */
+    req->is_deadline = 0;
+    req->is_resp_out = 0;
+    req->is_retry_body = 0;
+    req->retry_body_len = 0;
+    return https_poll_ok;
+}
+
+static enum https_poll_res poll_send_(struct https_mod * m)
+{
+    unsigned long throwaway;
+    if (poll_prep_(m) != https_poll_ok
+        || req_start_(m, &m->poll, &throwaway) != https_req_ok)
+    {
+        return https_poll_fail;
+    }
+    return https_poll_ok;
+}
+
+enum https_poll_res https_poll_start(struct https_mod * m, const char * url,
+    long timeout_s, long long offset, https_json_cb json_cb, void * json_user,
+    char * str_buf, size_t str_mlen)
+{
+    if (m->st != st_idle_ && m->st != st_pend_) {
+        return https_poll_fail;
+    }
+    if (m->is_stop_waiting) {
+        return https_poll_fail_stopping;
+    }
+    if (m->is_poll_on || m->poll.is_pend) {
+        return https_poll_fail_already;
+    }
+    if (m->poll.curl == NULL && ! req_init_curl_(m, &m->poll)) {
+        return https_poll_fail;
+    }
+    if (m->poll_json == NULL) {
+        m->poll_json = malloc(rjson_ctx_sizeof());
+        if (m->poll_json == NULL) {
+            return https_poll_fail;
+        }
+    }
+    /* the server holds it for up to timeout_s */
+    curl_easy_setopt(m->poll.curl, CURLOPT_TIMEOUT,
+        timeout_s + poll_timeout_margin_s_);
+    m->poll_base_url = url;
+    m->poll_timeout_s = timeout_s;
+    m->poll_offset = offset;
+    m->poll_cb = json_cb;
+    m->poll_user = json_user;
+    m->poll_str = str_buf;
+    m->poll_str_mlen = str_mlen;
+    m->poll_fails = 0;
+    if (m->rand_state == 0) {
+        m->rand_state = (unsigned long long) now_ns_() | 1;
+    }
+    if (poll_send_(m) != https_poll_ok) {
+        return https_poll_fail;
+    }
+    m->is_poll_on = 1;
+    return https_poll_ok;
+}
+
+long long https_poll_offset(const struct https_mod * m)
+{
+    return m->poll_offset;
+}
+
+/* takes what wjson wrote for read_cb_ */
+static enum wjson_res body_flush_(const char * str, size_t len, void * user)
+{
+    struct req_ * req = user;
+    if (req->body_len + len > req->body_cap) {
+        size_t cap = (req->body_cap > 0) ? req->body_cap : body_chunk_len_;
+        char * buf;
+        while (cap < req->body_len + len) {
+            cap *= 2;
+        }
+        buf = realloc(req->body_buf, cap);
+        if (buf == NULL) {
+            return wjson_overflow;
+        }
+        req->body_buf = buf;
+        req->body_cap = cap;
+    }
+    memcpy(req->body_buf + req->body_len, str, len);
+    req->body_len += len;
+    return wjson_ok;
+}
+
+enum https_req_res https_req_json_body(struct https_mod * m,
+    const char * url, https_body_cb body_cb, void * body_user,
+    unsigned long * req_id_out)
+{
+    enum https_req_res res;
+    struct req_ * req = req_prep_(m, https_method_post, url, NULL, &res);
+    if (req == NULL) {
+        return res;
+    }
+    if (req->body_json == NULL) {
+        req->body_json = malloc(wjson_ctx_sizeof());
+        req->body_chunk = malloc(body_chunk_len_);
+        if (req->body_json == NULL || req->body_chunk == NULL) {
+            free(req->body_json);
+            free(req->body_chunk);
+            req->body_json = NULL;
+            req->body_chunk = NULL;
+            return https_req_fail;
+        }
+    }
+    /* NULL for read_cb_; req_prep_ takes it off for the next req */
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, NULL);
+    curl_easy_setopt(req->curl, CURLOPT_READFUNCTION, read_cb_);
+    curl_easy_setopt(req->curl, CURLOPT_READDATA, req);
+    req->tries_left = 0; /* body_cb cannot make the body again */
+    wjson_init(req->body_json, req->body_chunk, body_chunk_len_, 0);
+    wjson_set_flush(req->body_json, body_flush_, req);
+    req->body_cb = body_cb;
+    req->body_user = body_user;
+    req->is_body_done = 0;
+    req->body_len = 0;
+    req->body_off = 0;
+    return req_start_(m, req, req_id_out);
+}
 
 enum https_ev_type https_ev_ty(const struct https_ev * ev)
 {
     return ev->ty;
 }
 
+unsigned long https_ev_req_id(const struct https_ev * ev)
+{
+    return ev->req_id;
+}
+
+long https_ev_status(const struct https_ev * ev)
+{
+    return ev->status;
+}
+
+int https_ev_is_json_syntax(const struct https_ev * ev)
+{
+    return ev->is_json_syntax;
+}
+
+int https_ev_is_deadline(const struct https_ev * ev)
+{
+    return ev->is_deadline;
+}
+
+const struct https_timings * https_ev_timings(const struct https_ev * ev)
+{
+    return &ev->timings;
+}
+
+/* the last part of the path, NULL if it does not fit in the name */
+static const char * endpoint_name_(const char * url, size_t * len_out)
+{
+    const char * end = strchr(url, '?');
+    const char * start;
+    if (end == NULL) {
+        end = url + strlen(url);
+    }
+    start = end;
+    while (start > url && start[-1] != '/') {
+        start--;
+    }
+    if (start == end || end - start >= endpoint_name_len_) {
+        return NULL;
+    }
+    *len_out = end - start;
+    return start;
+}
+
+static struct endpoint_ * endpoint_find_(const struct https_mod * m,
+    const char * name, size_t len)
+{
+    size_t i;
+    for (i = 0; i < m->endpoints_len; i++) {
+        const struct endpoint_ * ep = &m->endpoints[i];
+        if (strncmp(ep->name, name, len) == 0 && ep->name[len] == '\0') {
+            return (struct endpoint_ *) ep;
+        }
+    }
+    return NULL;
+}
+
+/* the ones past 2^32 go to the last one */
+static size_t hist_bucket_(long long us)
+{
+    int shift = 0;
+    size_t i;
+    if (us < hist_sub_len_) {
+        return (us < 0) ? 0 : (size_t) us;
+    }
+    while ((us >> shift) >= 2 * hist_sub_len_) {
+        shift++;
+    }
+    i = (size_t) (shift + 1) * hist_sub_len_
+        + (size_t) ((us >> shift) - hist_sub_len_);
+    return (i < hist_buckets_len_) ? i : hist_buckets_len_ - 1;
+}
+
+/* adds the total time of a finished req to the hist of its endpoint */
+static void endpoint_note_(struct https_mod * m, CURL * curl)
+{
+    char * url = NULL;
+    const char * name;
+    size_t len;
+    struct endpoint_ * ep;
+    curl_off_t us = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    if (url == NULL || (name = endpoint_name_(url, &len)) == NULL) {
+        return;
+    }
+    ep = endpoint_find_(m, name, len);
+    if (ep == NULL) {
+        if (m->endpoints_len == endpoints_maxlen_) {
+            return; /* XXX: should not be more endpoints than that */
+        }
+        ep = &m->endpoints[m->endpoints_len];
+        m->endpoints_len++;
+        memcpy(ep->name, name, len);
+        ep->name[len] = '\0';
+        ep->reqs = 0;
+        memset(ep->hist, 0, sizeof(ep->hist));
+        ep->hist_len = 0;
+    }
+
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &us);
+    ep->reqs++;
+    ep->hist[hist_bucket_(us)]++;
+    ep->hist_len++;
+    if (ep->hist_len == hist_decay_len_) {
+        size_t i;
+        ep->hist_len = 0;
+        for (i = 0; i < hist_buckets_len_; i++) {
+            ep->hist[i] /= 2;
+            ep->hist_len += ep->hist[i];
+        }
+    }
+}
+
+/* the upper bound of the bucket with the pct-th percentile */
+static long long endpoint_pct_(const struct endpoint_ * ep, int pct)
+{
+    unsigned long rank = (ep->hist_len * pct + 99) / 100;
+    unsigned long seen = 0;
+    size_t i;
+    for (i = 0; i < hist_buckets_len_; i++) {
+        unsigned long n = ep->hist[i];
+        long long low = (long long) i;
+        long long width = 1;
+        if (seen + n < rank || n == 0) {
+            seen += n;
+            continue;
+        }
+        if (i >= hist_sub_len_) {
+            int shift = (int) (i / hist_sub_len_) - 1;
+            low = (long long) (hist_sub_len_ + i % hist_sub_len_) << shift;
+            width = 1LL << shift;
+        }
+        /* the n in the bucket are taken as spread evenly over it, each in
+         * the middle of its share */
+        return low + width * (long long) (2 * (rank - seen) - 1)
+            / (long long) (2 * n);
+    }
+    return 0;
+}
+
+enum https_stats_res https_endpoint_stats(const struct https_mod * m,
+    const char * endpoint, struct https_endpoint_stats * stats_out)
+{
+    const struct endpoint_ * ep = endpoint_find_(m,
+        endpoint, strlen(endpoint));
+    if (ep == NULL) {
+        return https_stats_fail_not_found;
+    }
+    stats_out->reqs = ep->reqs;
+    stats_out->p50_us = endpoint_pct_(ep, 50);
+    stats_out->p95_us = endpoint_pct_(ep, 95);
+    stats_out->p99_us = endpoint_pct_(ep, 99);
+    return https_stats_ok;
+}
+
+enum https_share_init_res https_share_init(struct https_share * s)
+{
+    s->sh = curl_share_init();
+    if (s->sh == NULL) {
+        return https_share_init_fail_curl_share_init;
+    }
+    /* all of it runs on one thread, so no lock callbacks */
+    curl_share_setopt(s->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(s->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(s->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    return https_share_init_ok;
+}
+
+void https_share_stop(struct https_share * s)
+{
+    curl_share_cleanup(s->sh);
+}
+
+void https_set_share(struct https_mod * m, struct https_share * s)
+{
+    m->share = s;
+}
+
 
 static int sock_cb_(CURL * h, curl_socket_t fd, int what,
     void * data, void * fd_data)
@@ -427,26 +1457,45 @@ static int timer_cb_(CURLM * h, long timeout_ms, void * data)
 {
     struct https_mod * m = data;
 
+    (void) h;
+
+    /* a timeout of 0 is due now, which is in the past when it is set */
+    m->curl_due_ns = (timeout_ms >= 0)
+        ? now_ns_() + timeout_ms * 1000000LL : -1;
+    return arm_timer_(m);
+}
+
+static long long now_ns_(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* to the earliest of the timeout of curl and the retries */
+static int arm_timer_(struct https_mod * m)
+{
+    long long due = m->curl_due_ns;
+    size_t i;
     struct itimerspec its;
     /* expire once */
     its.it_interval.tv_sec = 0;
     its.it_interval.tv_nsec = 0;
 
-    (void) h;
-
-    if (timeout_ms >= 0) {
-        if (timeout_ms > 0) {
-            its.it_value.tv_sec = (timeout_ms / 1000);
-            its.it_value.tv_nsec = (timeout_ms % 1000) * 1000 * 1000;
-        } else if (timeout_ms == 0) {
-            /* curl wants to timeout now, but setting both fields
-             * of it_value to 0 disarms the timer.
-             * Closest is timeout in 1 nsec */
-            its.it_value.tv_sec = 0;
-            its.it_value.tv_nsec = 1;
+    for (i = 0; i <= https_reqs_maxlen; i++) {
+        long long r = (i < https_reqs_maxlen) ? m->reqs[i].retry_due_ns
+            : m->poll.retry_due_ns;
+        if (r != 0 && (due < 0 || r < due)) {
+            due = r;
         }
+    }
 
-        set_fd_(m, m->timerfd, POLLIN);
+    if (due >= 0) {
+        its.it_value.tv_sec = due / 1000000000LL;
+        its.it_value.tv_nsec = due % 1000000000LL;
+        if (set_fd_(m, m->timerfd, POLLIN) != set_fd_ok_) {
+            return -1;
+        }
     } else {
         /* disarm the timer */
         its.it_value.tv_sec = 0;
@@ -455,7 +1504,7 @@ static int timer_cb_(CURLM * h, long timeout_ms, void * data)
         (void) del_fd_(m, m->timerfd);
     }
 
-    if (timerfd_settime(m->timerfd, 0, &its, NULL) == -1) {
+    if (timerfd_settime(m->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
         perror("timerfd_settime"); /* XXX: should not print */
         return -1;
     }
@@ -463,20 +1512,298 @@ static int timer_cb_(CURLM * h, long timeout_ms, void * data)
     return 0;
 }
 
+static int is_retry_status_(const struct req_ * req, long status)
+{
+    switch (status) {
+    case 429: /* the server did not do it */
+        return 1;
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+        return req->is_idem;
+    default:
+        return 0;
+    };
+}
+
+static int is_retry_err_(const struct req_ * req, CURLcode res)
+{
+    switch (res) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+        return 1; /* nothing was sent */
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return req->is_idem;
+    default:
+        return 0; /* a timeout is the deadline */
+    };
+}
+
+/* of "parameters": {"retry_after": N} in the kept response, -1 if none */
+static long retry_after_ms_(struct https_mod * m, const struct req_ * req)
+{
+    size_t i;
+    int depth = 0;
+    int is_key = 0;
+    rjson_init(m->retry_json, m->retry_str, retry_str_len_);
+    for (i = 0; i <= req->retry_body_len; i++) {
+        char ch = (i < req->retry_body_len) ? req->retry_body[i] : '\0';
+        enum rjson_next_res r = rjson_next(m->retry_json, ch);
+        enum rjson_ty ty;
+        if (r == rjson_next_syntax) {
+            return -1; /* or cut at retry_body_len_ */
+        }
+        ty = rjson_cur_ty(m->retry_json);
+        if (ty == rjson_num && is_key) {
+            double s = rjson_cur_num(m->retry_json);
+            return (s >= 0 && s < 86400) ? (long) s * 1000 : -1;
+        }
+        if (ty != rjson_incomplete) {
+            is_key = (ty == rjson_str && depth == retry_after_depth_
+                && strcmp(rjson_cur_str(m->retry_json), "retry_after")
+                    == 0);
+            if (ty == rjson_obj_start || ty == rjson_arr_start) {
+                depth++;
+            } else if (ty == rjson_obj_end || ty == rjson_arr_end) {
+                depth--;
+            }
+        }
+        if (r == rjson_next_fin) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/* base_ms doubled for each of tries, in [d / 2, d] */
+static long backoff_ms_(struct https_mod * m, long base_ms, long max_ms,
+    int tries)
+{
+    long d = base_ms;
+    unsigned long long x = m->rand_state;
+    while (tries > 0 && d < max_ms) {
+        d *= 2;
+        tries--;
+    }
+    if (d > max_ms) {
+        d = max_ms;
+    }
+    /* xorshift64 */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    m->rand_state = x;
+    return d / 2 + (long) (x % (unsigned long long) (d / 2 + 1));
+}
+
+/* takes a finished try off the multi if it is to be sent again */
+static enum retry_res_ retry_(struct https_mod * m, struct req_ * req,
+    CURLcode res)
+{
+    long status = 0;
+    long delay_ms = -1;
+    long long due;
+    if (req->tries_left == 0 || req->is_resp_out) {
+        return retry_no_;
+    }
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (! is_retry_status_(req, status)) {
+            return retry_no_;
+        }
+        if (status == 429) {
+            delay_ms = retry_after_ms_(m, req);
+        }
+    } else if (! is_retry_err_(req, res)) {
+        return retry_no_;
+    }
+    if (delay_ms < 0) {
+        delay_ms = backoff_ms_(m, m->retry_base_ms, m->retry_max_ms,
+            m->retry_tries_maxlen - req->tries_left - 1);
+    }
+    due = now_ns_() + delay_ms * 1000000LL;
+    if (req->deadline_ns != 0 && due >= req->deadline_ns) {
+        return req->is_retry_body ? retry_give_up_ : retry_no_;
+    }
+    curl_multi_remove_handle(m->curlm, req->curl);
+    req->tries_left--;
+    req->retry_due_ns = due;
+    if (arm_timer_(m) != 0) {
+        SOB_PANIC("arm_timer_ in retry_");
+    }
+    return retry_waiting_;
+}
+
+/* sends again the reqs whose retry is due */
+static void retry_due_(struct https_mod * m)
+{
+    long long now = now_ns_();
+    size_t i;
+    for (i = 0; i < https_reqs_maxlen; i++) {
+        struct req_ * req = &m->reqs[i];
+        if (req->retry_due_ns == 0 || req->retry_due_ns > now) {
+            continue;
+        }
+        req->retry_due_ns = 0;
+        req->is_retry_body = 0;
+        req->retry_body_len = 0;
+        if (req->deadline_ns != 0) {
+            curl_easy_setopt(req->curl, CURLOPT_TIMEOUT_MS,
+                (long) ((req->deadline_ns - now) / 1000000LL) + 1);
+        }
+        if (curl_multi_add_handle(m->curlm, req->curl) != CURLM_OK) {
+            if (add_ev_(m, https_ev_req_fail, req, 0) != add_ev_ok_) {
+                SOB_PANIC("add_ev_(https_ev_req_fail) in update");
+            }
+            req_done_(m, req);
+        }
+    }
+    if (m->poll.retry_due_ns != 0 && m->poll.retry_due_ns <= now) {
+        m->poll.retry_due_ns = 0;
+        if (poll_prep_(m) != https_poll_ok
+            || curl_multi_add_handle(m->curlm, m->poll.curl) != CURLM_OK)
+        {
+            m->is_poll_on = 0;
+            if (add_ev_(m, https_ev_poll_fail, &m->poll, 0) != add_ev_ok_) {
+                SOB_PANIC("add_ev_(https_ev_poll_fail) in update");
+            }
+            req_done_(m, &m->poll);
+        }
+    }
+}
+
 static int write_cb_(char * data, size_t throwaway, size_t len,
     void * user_data)
 {
-    struct https_mod * m = user_data;
+    struct req_ * req = user_data;
 
     (void) throwaway; /* "size" in man, always 1 */
 
-    if (m->data_cb != NULL) {
-        (*m->data_cb)(data, len, m->data_cb_user);
+    if (! req->is_resp_out && ! req->is_retry_body && req->tries_left > 0) {
+        long status = 0;
+        curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &status);
+        req->is_retry_body = is_retry_status_(req, status);
+    }
+    if (req->is_retry_body) {
+        size_t n = retry_body_len_ - req->retry_body_len;
+        n = (n < len) ? n : len;
+        memcpy(req->retry_body + req->retry_body_len, data, n);
+        req->retry_body_len += n;
+        return len;
+    }
+    return resp_out_(req, data, len) ? len : 0; /* 0 fails the req */
+}
+
+/* to json_cb or data_cb; 0 if it is not json */
+static int resp_out_(struct req_ * req, const char * data, size_t len)
+{
+    struct https_mod * m = req->m;
+
+    req->is_resp_out = 1;
+
+    if (req->json != NULL) {
+        size_t i = 0;
+        while (i < len && ! req->is_json_fin) {
+            size_t used;
+            enum rjson_next_res r = rjson_feed(req->json,
+                data + i, len - i, &used);
+            i += used;
+            if (r == rjson_next_syntax) {
+                req->is_json_syntax = 1;
+                return 0;
+            }
+            if (rjson_cur_ty(req->json) != rjson_incomplete) {
+                (*req->json_cb)(req->id, req->json, req->json_user);
+            }
+            req->is_json_fin = (r == rjson_next_fin);
+        }
+        for (; i < len; i++) {
+            if (strchr(" \t\r\n", data[i]) == NULL) {
+                req->is_json_syntax = 1;
+                return 0;
+            }
+        }
+    } else if (m->data_cb != NULL) {
+        (*m->data_cb)(req->id, data, len, m->data_cb_user);
+    }
+
+    return 1;
+}
+
+/* the kept response of a try that is not repeated, like the "description"
+ * of a 429, goes out as if it was not kept */
+static void retry_body_out_(struct req_ * req)
+{
+    req->is_retry_body = 0;
+    if (resp_out_(req, req->retry_body, req->retry_body_len)
+        && req->json != NULL)
+    {
+        json_end_(req);
+    }
+}
+
+
+static size_t read_cb_(char * buf, size_t throwaway, size_t len,
+    void * user_data)
+{
+    struct req_ * req = user_data;
+    size_t n;
+
+    len *= throwaway; /* "size" in man, always 1 */
+
+    if (req->body_cb == NULL) {
+        return CURL_READFUNC_ABORT; /* not a https_req_json_body */
+    }
+
+    while (req->body_off == req->body_len && ! req->is_body_done) {
+        enum https_body_res r;
+        req->body_len = 0;
+        req->body_off = 0;
+        r = (*req->body_cb)(req->id, req->body_json, req->body_user);
+        if (r == https_body_fail
+            || wjson_flush(req->body_json) != wjson_ok)
+        {
+            return CURL_READFUNC_ABORT;
+        }
+        req->is_body_done = (r == https_body_done);
     }
 
-    return len;
+    n = req->body_len - req->body_off;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buf, req->body_buf + req->body_off, n);
+    req->body_off += n;
+    return n; /* 0 at the end */
 }
 
+static void timings_(CURL * curl, struct https_timings * t)
+{
+    curl_off_t us = 0;
+    if (curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &us) == CURLE_OK) {
+        t->namelookup_us = us;
+    }
+    if (curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &us) == CURLE_OK) {
+        t->connect_us = us;
+    }
+    if (curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &us) == CURLE_OK) {
+        t->appconnect_us = us;
+    }
+    if (curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &us)
+        == CURLE_OK)
+    {
+        t->starttransfer_us = us;
+    }
+    if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &us) == CURLE_OK) {
+        t->total_us = us;
+    }
+}
 
 static enum set_st_res_ set_st_(struct https_mod * m, enum st_ st)
 {
@@ -486,68 +1813,94 @@ static enum set_st_res_ set_st_(struct https_mod * m, enum st_ st)
 
 static int find_fd_(struct https_mod * m, int fd)
 {
-    int i;
-    for (i = 0; i < m->fds_len; i++) {
-        if (m->fds[i].fd == fd) {
-            return i;
-        }
+    if (fd >= 0 && fd < m->fd_pos_len) {
+        return m->fd_pos[fd];
     }
     return -1;
 }
 
-static int add_fd_(struct https_mod * m, int fd, short events)
+/* room for fd in fd_pos and for one more in fds */
+static int grow_fds_(struct https_mod * m, int fd)
 {
-    if (m->fds_len < fds_maxlen_) {
-        const int idx = m->fds_len;
-        m->fds[idx].fd = fd;
-        m->fds[idx].events = events;
-        m->fds[idx].revents = 0;
-        m->fds_len++;
-        return idx;
-    } else {
-        return -1;
+    if (fd >= m->fd_pos_len) {
+        size_t len = (m->fd_pos_len > 0) ? m->fd_pos_len : fds_init_cap_;
+        int * fd_pos;
+        size_t i;
+        while (len <= fd) {
+            len *= 2;
+        }
+        fd_pos = realloc(m->fd_pos, len * sizeof(int));
+        if (fd_pos == NULL) {
+            return 0;
+        }
+        for (i = m->fd_pos_len; i < len; i++) {
+            fd_pos[i] = -1;
+        }
+        m->fd_pos = fd_pos;
+        m->fd_pos_len = len;
     }
+    if (m->fds_len == m->fds_cap) {
+        size_t cap = (m->fds_cap > 0) ? m->fds_cap * 2 : fds_init_cap_;
+        struct pollfd * fds = realloc(m->fds, cap * sizeof(struct pollfd));
+        if (fds == NULL) {
+            return 0;
+        }
+        m->fds = fds;
+        m->fds_cap = cap;
+    }
+    return 1;
 }
 
 static enum set_fd_res_ set_fd_(struct https_mod * m, int fd, short events)
 {
     int pos = find_fd_(m, fd);
     if (-1 == pos) { /* not found */
-        pos = add_fd_(m, fd, events);
-        if (-1 == pos) { /* all slots taken */
-            return set_fd_add_overflow_;
-        } else {
-            /* fd was added */
-            return set_fd_ok_;
+        if (! grow_fds_(m, fd)) {
+            return set_fd_no_mem_;
         }
-    } else {
-        m->fds[pos].events = events;
-        return set_fd_ok_;
+        pos = m->fds_len;
+        m->fds[pos].fd = fd;
+        m->fds[pos].revents = 0;
+        m->fd_pos[fd] = pos;
+        m->fds_len++;
     }
+    m->fds[pos].events = events;
+    return set_fd_ok_;
 }
 
+/* the last one takes its place */
 static enum del_fd_res_ del_fd_(struct https_mod * m, int fd)
 {
     int pos = find_fd_(m, fd);
     if (-1 == pos) {
         return del_fd_not_found_;
     } else {
-        int i;
-        for (i = pos + 1; i < m->fds_len; i++) {
-            m->fds[i - 1] = m->fds[i];
-        }
+        const struct pollfd * last = &m->fds[m->fds_len - 1];
+        m->fd_pos[last->fd] = pos;
+        m->fds[pos] = *last;
+        m->fd_pos[fd] = -1;
         m->fds_len--;
         return del_fd_ok_;
     }
 }
 
-static enum add_ev_res_ add_ev_(struct https_mod * m, enum https_ev_type ty)
+static enum add_ev_res_ add_ev_(struct https_mod * m, enum https_ev_type ty,
+    const struct req_ * req, long status)
 {
     if (evs_maxlen_ == m->evs_len) {
         return add_ev_overflow_;
     }
 
     m->evs[m->evs_len].ty = ty;
+    m->evs[m->evs_len].req_id = (req != NULL) ? req->id : 0;
+    m->evs[m->evs_len].status = status;
+    m->evs[m->evs_len].is_json_syntax = (req != NULL) ? req->is_json_syntax
+        : 0;
+    m->evs[m->evs_len].is_deadline = (req != NULL) ? req->is_deadline : 0;
+    memset(&m->evs[m->evs_len].timings, 0, sizeof(struct https_timings));
+    if (req != NULL) {
+        timings_(req->curl, &m->evs[m->evs_len].timings);
+    }
     m->evs_len++;
 
     return add_ev_ok_;
@@ -557,30 +1910,116 @@ static enum add_ev_res_ add_ev_(struct https_mod * m, enum https_ev_type ty)
 #ifdef SOB_HTTPS_DEMO
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <poll.h>
 
 enum {
-    evs_maxlen = 5
+    evs_maxlen = 5,
+    json_str_mlen = 120
 };
 
-void data_cb(const char * resp, size_t len, void * user)
+void data_cb(unsigned long req_id, const char * resp, size_t len, void * user)
 {
-    printf("recv: '%.*s'\n", (int) len, resp);
+    printf("recv %lu: '%.*s'\n", req_id, (int) len, resp);
+}
+
+/* [0, 1, ..., 999], one number per call */
+enum https_body_res body_cb(unsigned long req_id,
+    struct wjson_ctx * json, void * user)
+{
+    int * next = user;
+    if (*next == 0 && wjson_arr_start(json) != wjson_ok) {
+        return https_body_fail;
+    }
+    if (*next == 1000) {
+        return (wjson_arr_end(json) == wjson_ok) ? https_body_done
+            : https_body_fail;
+    }
+    if (wjson_int(json, *next) != wjson_ok) {
+        return https_body_fail;
+    }
+    (*next)++;
+    return https_body_more;
+}
+
+void poll_cb(unsigned long req_id, const struct rjson_ctx * json, void * user)
+{
+    (void) req_id;
+    (void) json;
+    (void) user;
+}
+
+void json_cb(unsigned long req_id, const struct rjson_ctx * json, void * user)
+{
+    switch (rjson_cur_ty(json)) {
+    case rjson_str:
+        printf("json %lu: str '%s'\n", req_id, rjson_cur_str(json));
+        break;
+    case rjson_num:
+        printf("json %lu: num %g\n", req_id, rjson_cur_num(json));
+        break;
+    default:
+        printf("json %lu: %i\n", req_id, (int) rjson_cur_ty(json));
+        break;
+    };
 }
 
 int main(void)
 {
     int i;
     struct https_mod m;
+    struct https_share share;
     struct pollfd * fds;
+    unsigned long req_ids[5];
+    int reqs_left = 4;
+    int polls_left = 2;
+    int body_next = 0;
+    struct rjson_ctx * json = malloc(rjson_ctx_sizeof());
+    char json_str[json_str_mlen];
+    char poll_str[json_str_mlen];
+
+    if (json == NULL) {
+        fprintf(stderr, "cannot malloc json\n");
+        return 1;
+    }
+    rjson_init(json, json_str, json_str_mlen);
+
+    /* what getUpdates gives when nothing came in timeout_s; the poll goes
+     * on after it */
+    {
+        const char * idle_str = "{\"ok\":true,\"result\":[]}";
+        size_t len = strlen(idle_str) + 1;
+        size_t off = 0;
+        enum rjson_next_res res = rjson_next_ok;
+        while (off < len && res == rjson_next_ok) {
+            size_t used;
+            res = rjson_feed(json, idle_str + off, len - off, &used);
+            off += used;
+        }
+        if (res != rjson_next_fin) {
+            fprintf(stderr, "idle poll syntax error @ %lu\n", rjson_pos(json));
+            return 1;
+        }
+        rjson_init(json, json_str, json_str_mlen);
+    }
 
+    if (https_share_init(&share) != https_share_init_ok) {
+        fprintf(stderr, "cannot init share\n");
+        return 1;
+    }
     if (https_init(&m, data_cb, NULL) != https_init_ok ) {
         fprintf(stderr, "cannot init\n");
         return 1;
     }
+    https_set_share(&m, &share);
 
     https_set_verbosity(&m, https_verbosity_debug);
     https_set_timeout(&m, 2);
+    if (https_set_retry(&m, 3, 200, 2000) != https_retry_ok) {
+        fprintf(stderr, "cannot set_retry\n");
+        return 1;
+    }
 
     while (1) {
         struct https_ev * evs;
@@ -611,13 +2050,59 @@ int main(void)
 
 init:
 
+    /* both are in flight at once, the first one ahead of bulk work */
+    https_next_req(&m, https_prio_urgent, 1500);
     if (https_req_json(&m,
             https_method_get,
             "https://echo.free.beeceptor.com",
-            "{\"a\": 42, \"b\": \"hi\"}") != https_req_ok ) {
+            "a=42&b=hi", &req_ids[0]) != https_req_ok ) {
         fprintf(stderr, "cannot req_json\n");
         return 1;
     }
+    /* sent again as is if it fails */
+    https_next_req_idem(&m, "SOB_HTTPS_DEMO-1");
+    if (https_req_json(&m,
+            https_method_post,
+            "https://echo.free.beeceptor.com",
+            "{\"c\": 43}", &req_ids[1]) != https_req_ok ) {
+        fprintf(stderr, "cannot req_json\n");
+        return 1;
+    }
+    /* parsed as it arrives */
+    if (https_req_json_parse(&m,
+            https_method_post,
+            "https://echo.free.beeceptor.com",
+            "{\"d\": [44, \"e\"]}", json, json_cb, NULL,
+            &req_ids[2]) != https_req_ok ) {
+        fprintf(stderr, "cannot req_json_parse\n");
+        return 1;
+    }
+    /* the body is made as it is sent */
+    if (https_req_json_body(&m,
+            "https://echo.free.beeceptor.com",
+            body_cb, &body_next, &req_ids[3]) != https_req_ok ) {
+        fprintf(stderr, "cannot req_json_body\n");
+        return 1;
+    }
+    /* made and dropped before it is sent */
+    https_next_req(&m, https_prio_bulk, 0);
+    if (https_req_json(&m,
+            https_method_get,
+            "https://echo.free.beeceptor.com",
+            NULL, &req_ids[4]) != https_req_ok ) {
+        fprintf(stderr, "cannot req_json\n");
+        return 1;
+    }
+    if (https_cancel(&m, req_ids[4]) != https_cancel_ok) {
+        fprintf(stderr, "cannot cancel\n");
+        return 1;
+    }
+    /* along with the ones above */
+    if (https_poll_start(&m, "https://echo.free.beeceptor.com/getUpdates",
+            1, 0, poll_cb, NULL, poll_str, json_str_mlen) != https_poll_ok) {
+        fprintf(stderr, "cannot poll_start\n");
+        return 1;
+    }
 
     while (1) {
         struct https_ev * evs;
@@ -639,10 +2124,36 @@ init:
                 goto stopped;
                 break;
             case https_ev_req_fin:
-                printf("req completed\n");
-                goto req_done;
+                printf("req %lu completed with status %li in %llius"
+                    " (first byte at %llius)\n",
+                    https_ev_req_id(&evs[i]), https_ev_status(&evs[i]),
+                    https_ev_timings(&evs[i])->total_us,
+                    https_ev_timings(&evs[i])->starttransfer_us);
+                reqs_left--;
+                if (reqs_left == 0 && polls_left == 0) {
+                    goto req_done;
+                }
+                break;
             case https_ev_req_fail:
-                fprintf(stderr, "https_ev_req_fail\n");
+                fprintf(stderr, "https_ev_req_fail for %lu%s\n",
+                    https_ev_req_id(&evs[i]),
+                    https_ev_is_deadline(&evs[i]) ? " past deadline" : "");
+                goto req_fail;
+            case https_ev_poll_fin:
+                printf("poll %lu completed, next offset %lli\n",
+                    https_ev_req_id(&evs[i]), https_poll_offset(&m));
+                polls_left -= (polls_left > 0);
+                if (reqs_left == 0 && polls_left == 0) {
+                    goto req_done;
+                }
+                break;
+            case https_ev_poll_retry:
+                printf("poll %lu failed with status %li, retrying\n",
+                    https_ev_req_id(&evs[i]), https_ev_status(&evs[i]));
+                break;
+            case https_ev_poll_fail:
+                fprintf(stderr, "https_ev_poll_fail with status %li\n",
+                    https_ev_status(&evs[i]));
                 goto req_fail;
             default:
                 continue;
@@ -653,8 +2164,13 @@ init:
 req_done:
 
     {
-        long status = https_resp_status(&m);
-        printf("status: %li\n", status);
+        struct https_endpoint_stats stats;
+        if (https_endpoint_stats(&m, "echo.free.beeceptor.com", &stats)
+            == https_stats_ok)
+        {
+            printf("%lu reqs: p50 %llius, p95 %llius, p99 %llius\n",
+                stats.reqs, stats.p50_us, stats.p95_us, stats.p99_us);
+        }
     }
 
 req_fail:
@@ -693,6 +2209,8 @@ stopped:
         fprintf(stderr, "cannot stop\n");
         return 1;
     }
+    https_share_stop(&share);
+    free(json);
 
     return 0;
 }
@@ -4,18 +4,48 @@
 #include <stddef.h>
 #include <poll.h>
 
-typedef void (*https_resp_data_cb)(const char * resp, size_t len, void * user);
+#include "rjson.h"
+#include "wjson.h"
+
+/* req_id is the one https_req_json gave */
+typedef void (*https_resp_data_cb)(unsigned long req_id,
+    const char * resp, size_t len, void * user);
 
 struct https_mod;
 
 struct https_ev;
 
+/* from the start of a req, in microseconds; 0 for a phase it did not get
+ * to or did not need, like the dns lookup on a reused connection */
+struct https_timings {
+    long long namelookup_us;
+    long long connect_us;
+    long long appconnect_us; /* the tls handshake is done */
+    long long starttransfer_us; /* the first byte of the response */
+    long long total_us;
+};
+
+/* of the total time of the reqs that finished, per endpoint; the
+ * percentiles are within about 3% of the times they stand for */
+struct https_endpoint_stats {
+    unsigned long reqs; /* since the start; the percentiles favor recent */
+    long long p50_us;
+    long long p95_us;
+    long long p99_us;
+};
+
+/* caches shared by the mods attached to it */
+struct https_share;
+
 enum https_ev_type {
     https_ev_init,
     https_ev_init_fail,
     https_ev_stopped,
-    https_ev_req_fin, /* always after https_ev_req_data */
-    https_ev_req_fail
+    https_ev_req_fin, /* after all data of the req was given to data_cb */
+    https_ev_req_fail,
+    https_ev_poll_fin, /* a batch of the long poll was parsed */
+    https_ev_poll_retry, /* a poll failed; it is sent again after a backoff */
+    https_ev_poll_fail /* the long poll is stopped */
 };
 
 enum https_req_method {
@@ -64,17 +94,181 @@ enum https_stop_strategy {
 };
 void https_set_stop_strat(struct https_mod * mod, enum https_stop_strategy s);
 
+/* reqs to the same host share one HTTP/2 connection with up to
+ * streams_maxlen of them on it at once (https_reqs_maxlen by default).
+ * if the server has no HTTP/2, up to h1_conns_maxlen HTTP/1.1
+ * connections are used instead (4 by default). streams_maxlen of 0 turns
+ * HTTP/2 off. applies to reqs made after it */
+void https_set_multiplex(struct https_mod * mod,
+    long streams_maxlen, long h1_conns_maxlen);
+
+/* up to https_reqs_maxlen reqs may be pending at once, each on its own
+ * easy handle from a pool; url and data must live until its event.
+ * data is the body of a POST. for a GET it is the query, like
+ * "chat_id=1&text=hi" with the values url-encoded, and is put after a '?'
+ * in the url, or after a '&' if it has a query already */
+enum {
+    https_reqs_maxlen = 8
+};
 enum https_req_res {
     https_req_fail_stopping = -3,
-    https_req_fail_other_pend = -2,
+    https_req_fail_no_handle = -2, /* https_reqs_maxlen are pending */
     https_req_fail = -1,
     https_req_ok = 1
 } https_req_json(struct https_mod * mod,
-    enum https_req_method method, const char * url, const char * data);
-
-long https_resp_status(const struct https_mod * mod);
+    enum https_req_method method, const char * url, const char * data,
+    unsigned long * req_id_out);
 
 enum https_ev_type https_ev_ty(const struct https_ev * ev);
 
+/* when all handles but a few are pending, only the reqs of the higher
+ * classes get the rest, so bulk work does not hold up the replies.
+ * on HTTP/2 the streams of the higher classes get more of the bandwidth */
+enum https_prio {
+    https_prio_bulk,
+    https_prio_normal,
+    https_prio_urgent
+};
+
+/* for the next req made only, after which it is https_prio_normal with
+ * the timeout of https_set_timeout again. deadline_ms counts from when
+ * the req is made; past it the req fails with https_ev_is_deadline.
+ * 0 for the timeout of https_set_timeout */
+void https_next_req(struct https_mod * mod, enum https_prio prio,
+    long deadline_ms);
+
+/* a req that failed or got 429 or a 5xx is sent again, up to tries_maxlen
+ * times in all, after base_ms, then twice that each time up to max_ms,
+ * with some jitter. after a 429 with "parameters": {"retry_after": N} in
+ * the body, as the telegram bot api sends, it waits N seconds instead.
+ * a req, GET or POST, is repeated only when the server did not get it,
+ * or after a 429, unless https_next_req_idem marked it as safe to repeat:
+ * the bot api does sendMessage on a GET too, so a GET may be done twice.
+ * https_req_json_body is never repeated.
+ * the response of a try that is repeated does not go to the caller, and
+ * only the last try has an event. when the deadline comes before the next
+ * try, the first 256 chars of the response of the last one go to the
+ * caller and the req fails with https_ev_is_deadline.
+ * 1 by default, with no retries */
+enum https_retry_res {
+    https_retry_fail_no_mem = -1,
+    https_retry_ok = 1
+} https_set_retry(struct https_mod * mod, int tries_maxlen,
+    long base_ms, long max_ms);
+
+/* the next req made is safe to repeat and is sent with key in the
+ * Idempotence-Key header on every try, as YooKassa wants. key is copied
+ * and may be up to https_idem_key_maxlen chars. an empty key marks it as
+ * safe to repeat with no header, like a GET of getMe */
+enum {
+    https_idem_key_maxlen = 64
+};
+void https_next_req_idem(struct https_mod * mod, const char * key);
+
+/* drops a pending req; no event comes for it. not for the long poll,
+ * and not from within the callbacks */
+enum https_cancel_res {
+    https_cancel_fail_not_found = -1,
+    https_cancel_ok = 1
+} https_cancel(struct https_mod * mod, unsigned long req_id);
+
+/* the DNS cache, the TLS session cache and the connection cache are
+ * shared by the mods attached with https_set_share.
+ * XXX: the TLS sessions do not outlive the process; curl resumes one with
+ * BearSSL only if it is in its own cache, which cannot be filled */
+enum https_share_init_res {
+    https_share_init_fail_curl_share_init = -1,
+    https_share_init_ok = 1
+} https_share_init(struct https_share * share);
+
+/* after all mods attached to it were stopped */
+void https_share_stop(struct https_share * share);
+
+/* before the first https_req_json */
+void https_set_share(struct https_mod * mod, struct https_share * share);
+
+/* called for every token of the response as it arrives; the response
+ * then does not go to data_cb. json is the one given to
+ * https_req_json_parse */
+typedef void (*https_json_cb)(unsigned long req_id,
+    const struct rjson_ctx * json, void * user);
+
+/* like https_req_json, but the response is fed to json (after rjson_init
+ * by the caller) while it downloads, with no copy of the whole body.
+ * a syntax error fails the req, see https_ev_is_json_syntax */
+enum https_req_res https_req_json_parse(struct https_mod * mod,
+    enum https_req_method method, const char * url, const char * data,
+    struct rjson_ctx * json, https_json_cb json_cb, void * json_user,
+    unsigned long * req_id_out);
+
+enum https_body_res {
+    https_body_fail = -1, /* fails the req */
+    https_body_done = 0,
+    https_body_more = 1
+};
+
+/* writes the next part of the body with json, and is called again for
+ * the one after it once curl took this one. json keeps its state
+ * between the calls, so a part may end inside an obj. a part may be of
+ * any len, but small ones keep the buffer small */
+typedef enum https_body_res (*https_body_cb)(unsigned long req_id,
+    struct wjson_ctx * json, void * user);
+
+/* a POST with the body made by body_cb as curl sends it, instead of
+ * rendered in full beforehand */
+enum https_req_res https_req_json_body(struct https_mod * mod,
+    const char * url, https_body_cb body_cb, void * body_user,
+    unsigned long * req_id_out);
+
+/* keeps one long poll GET of url?timeout=timeout_s&offset=N in flight on
+ * a handle of its own, not counted in https_reqs_maxlen. it is sent again
+ * right after each batch arrives, with N past the last "update_id" of
+ * the "result" array, as in getUpdates of the telegram bot api.
+ * the batch is parsed as it arrives and json_cb gets its tokens, with the
+ * strings in str_buf. url and str_buf must live until https_stop.
+ * a network error, a timeout, 429 or 5xx is reported by
+ * https_ev_poll_retry and the poll is sent again after "retry_after" or a
+ * backoff, with the offset it was sent with, so the updates of a batch
+ * cut short may come twice. other errors and statuses stop it with
+ * https_ev_poll_fail, and then it may be started again.
+ * https_stop_prep cancels it */
+enum https_poll_res {
+    https_poll_fail_stopping = -3,
+    https_poll_fail_already = -2,
+    https_poll_fail = -1,
+    https_poll_ok = 1
+} https_poll_start(struct https_mod * mod, const char * url, long timeout_s,
+    long long offset, https_json_cb json_cb, void * json_user,
+    char * str_buf, size_t str_mlen);
+
+/* the offset the next poll is sent with */
+long long https_poll_offset(const struct https_mod * mod);
+
+/* for https_ev_req_* and https_ev_poll_*, each poll has its own */
+unsigned long https_ev_req_id(const struct https_ev * ev);
+
+/* for https_ev_req_fin and https_ev_poll_*;
+ * the http status of the response, 0 if there was none */
+long https_ev_status(const struct https_ev * ev);
+
+/* for https_ev_req_* and https_ev_poll_* */
+const struct https_timings * https_ev_timings(const struct https_ev * ev);
+
+/* the endpoint is the last part of the path of the url, like
+ * "sendMessage"; the long poll is not counted */
+enum https_stats_res {
+    https_stats_fail_not_found = -1,
+    https_stats_ok = 1
+} https_endpoint_stats(const struct https_mod * mod, const char * endpoint,
+    struct https_endpoint_stats * stats_out);
+
+/* for https_ev_req_fail of https_req_json_parse; the response was
+ * not json */
+int https_ev_is_json_syntax(const struct https_ev * ev);
+
+/* for https_ev_req_fail, https_ev_poll_retry and https_ev_poll_fail; its
+ * deadline or the timeout passed */
+int https_ev_is_deadline(const struct https_ev * ev);
+
 #endif /* SOB_HTTPS_H_SENTRY */
 
@@ -4,11 +4,31 @@
 
 #include <stddef.h> /* for size_t */
 #include <string.h> /* for strchr */
-#include <math.h> /* for pow */
-#include <stdio.h> /* for fprintf */
+#include <stdlib.h> /* for strtod */
+#include <limits.h> /* for ULLONG_MAX, LLONG_MAX */
+#include <stdio.h> /* for fprintf and sprintf */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 enum {
-    max_depth_ = 24
+    max_depth_ = 24,
+    /* the digits of a num kept for strtod. a halfway point between two
+     * doubles has at most 767, so one more and a sticky 1 for the rest
+     * still round right */
+    num_digits_len_ = 768,
+    /* and the '1', "e", the exponent and '\0' */
+    num_txt_len_ = num_digits_len_ + 16,
+    /* 10^22 is the largest power of 10 that is exact in a double */
+    exact_pow10_max_ = 22,
+    /* and 2^53 the largest mantissa */
+    exact_mant_bits_ = 53,
+    /* more would overflow exp, and is inf or 0 anyway */
+    exp_max_ = 100000,
+    /* the keys of all paths with a '\0' after each */
+    paths_txt_len_ = 512
 };
 
 enum level_ty_ {
@@ -25,7 +45,14 @@ enum st_ {
     st_num_,
     st_true_,
     st_false_,
-    st_null_
+    st_null_,
+    st_skip_ /* a value at no path */
+};
+
+/* a key per level, NULL for any element of an arr */
+struct path_ {
+    const char * segs[max_depth_];
+    size_t segs_len;
 };
 
 static void set_st_(struct rjson_ctx * c, enum st_ st);
@@ -40,6 +67,28 @@ static void assert_is_val_expected_(const struct rjson_ctx * c, int expected);
 static int is_whitespace_(char ch);
 static int is_num_start_(char ch);
 
+static size_t ws_run_(const char * buf, size_t len);
+static size_t str_run_(const char * buf, size_t len);
+static size_t until_any_(const char * buf, size_t len, const char * stops);
+
+static void block_masks_(const char * p, unsigned long long * quote,
+    unsigned long long * bs, unsigned long long * op,
+    unsigned long long * ctrl);
+static int tok_num_(struct rjson_ctx * c, const char * txt, size_t len);
+static enum str_escape_res_ {
+    str_escape_invalid_ = -1,
+    str_escaped_ = 1,
+    str_escape_utf16_ = 2
+} str_escape_(char * ch);
+static int hex_digit_(char ch);
+static int utf16_(unsigned long * hi, unsigned long unit, char * out);
+static int tape_escape_(const char * p, size_t len, char * out,
+    size_t * used_out);
+
+static int filter_val_(struct rjson_ctx * c, char ch);
+static void filter_tok_(struct rjson_ctx * c);
+static enum rjson_next_res next_skip_(struct rjson_ctx * c, char ch);
+
 static enum rjson_next_res next_idle_(struct rjson_ctx * c, char ch);
 static enum rjson_next_res next_want_key_(struct rjson_ctx * c, char ch);
 static enum rjson_next_res next_want_colon_(struct rjson_ctx * c, char ch);
@@ -59,14 +108,23 @@ struct rjson_ctx {
     union {
         struct {
             size_t len;
-            int is_escape;
+            int is_escape; /* till the last digit of a \\uXXXX */
             int is_key;
+            int hex_left; /* of the XXXX still to come */
+            unsigned long unit; /* the digits of it so far */
+            unsigned long hi; /* a high surrogate before its low one */
         } str;
 
         struct {
-            double num;
-            int digit_pos;
+            double num; /* made at the end */
+            unsigned long long mant; /* the digits, with no '.' */
+            int is_mant_over; /* some digits did not fit in mant */
+            int mant_skip; /* int digits past those in mant */
+            int frac_len; /* digits after '.' in mant */
+            int digit_pos; /* in the part */
             int is_neg;
+            int is_exp_neg;
+            int is_exp_sign; /* there was a '+' or '-' after 'e' */
             int exp;
             enum num_part_ty_ {
                 num_part_leading_zero_,
@@ -74,12 +132,23 @@ struct rjson_ctx {
                 num_part_frac_,
                 num_part_exp_
             } part;
+            size_t txt_len; /* digits in txt, from the first that is not 0 */
+            int txt_frac; /* digits after '.' in txt, and the 0s before it */
+            int txt_skip; /* int digits past those in txt */
+            int is_txt_cut; /* a digit that is not 0 did not fit in txt */
+            char txt[num_txt_len_];
         } num;
 
         struct {
             int word_pos;
             int bool_is_true;
         } special; /* for true, false, null */
+
+        struct {
+            int depth; /* of objs and arrs in the value */
+            int is_str;
+            int is_escape;
+        } skip;
     } sd;
     enum st_ st;
 
@@ -88,9 +157,27 @@ struct rjson_ctx {
     enum rjson_ty cur;
 
     int is_val_expected;
+    int is_arr_empty; /* nothing but whitespace since the last '[' */
     size_t pos;
+
+    /* see rjson_add_path; bit i of a mask is paths[i] */
+    struct path_ paths[rjson_paths_maxlen];
+    int paths_len;
+    char paths_txt[paths_txt_len_];
+    size_t paths_txt_len;
+    unsigned long alive[max_depth_ + 1]; /* that may match in lvls[i - 1] */
+    int lvl_path[max_depth_]; /* that matched lvls[i], -1 for none */
+    unsigned long key_mask; /* that matched the last key */
+    int val_path; /* that matched the value being parsed */
+    unsigned long val_deeper; /* that go on into it */
+    int cur_path;
 };
 
+size_t rjson_ctx_sizeof(void)
+{
+    return sizeof(struct rjson_ctx);
+}
+
 void rjson_init(struct rjson_ctx * c, char * str_out_buf, size_t str_mlen)
 {
     c->str = str_out_buf;
@@ -100,7 +187,62 @@ void rjson_init(struct rjson_ctx * c, char * str_out_buf, size_t str_mlen)
     c->cur = rjson_incomplete;
     set_st_(c, st_idle_);
     c->is_val_expected = 1; /* otherwise toplevel obj will be return an erorr */
+    c->is_arr_empty = 0;
     c->pos = 0;
+    c->paths_len = 0;
+    c->paths_txt_len = 0;
+    c->val_path = -1;
+    c->val_deeper = 0;
+    c->cur_path = -1;
+}
+
+enum rjson_path_res rjson_add_path(struct rjson_ctx * c, const char * path,
+    int * id_out)
+{
+    struct path_ * p = &c->paths[c->paths_len];
+    size_t txt_len = c->paths_txt_len;
+    const char * ch = path;
+
+    if (c->paths_len == rjson_paths_maxlen) {
+        return rjson_path_fail_too_many;
+    }
+    p->segs_len = 0;
+    while (1) {
+        const char * key = c->paths_txt + txt_len;
+        size_t key_len = strcspn(ch, ".[");
+        if (key_len == 0 || p->segs_len == max_depth_ - 1) {
+            return rjson_path_fail_syntax;
+        }
+        if (txt_len + key_len + 1 > paths_txt_len_) {
+            return rjson_path_fail_too_many;
+        }
+        memcpy(c->paths_txt + txt_len, ch, key_len);
+        c->paths_txt[txt_len + key_len] = '\0';
+        txt_len += key_len + 1;
+        p->segs[p->segs_len] = key;
+        p->segs_len++;
+        ch += key_len;
+        while (ch[0] == '[') {
+            if (ch[1] != ']' || p->segs_len == max_depth_ - 1) {
+                return rjson_path_fail_syntax;
+            }
+            p->segs[p->segs_len] = NULL;
+            p->segs_len++;
+            ch += 2;
+        }
+        if (*ch == '\0') {
+            break;
+        } else if (*ch == '.') {
+            ch++;
+        } else {
+            return rjson_path_fail_syntax;
+        }
+    }
+
+    c->paths_txt_len = txt_len;
+    *id_out = c->paths_len;
+    c->paths_len++;
+    return rjson_path_ok;
 }
 
 enum rjson_next_res rjson_next(struct rjson_ctx * c, char ch)
@@ -124,6 +266,13 @@ enum rjson_next_res rjson_next(struct rjson_ctx * c, char ch)
         }
     }
 
+    if (c->paths_len > 0 && c->st == st_idle_ && c->is_val_expected
+        && lvl_(c) != lvl_none_ && ! is_whitespace_(ch) && ch != ']'
+        && filter_val_(c, ch))
+    {
+        set_st_(c, st_skip_);
+    }
+
     switch (c->st) {
     case st_idle_:
         r = next_idle_(c, ch);
@@ -149,8 +298,17 @@ enum rjson_next_res rjson_next(struct rjson_ctx * c, char ch)
     case st_null_:
         r = next_null_(c, ch);
         break;
+    case st_skip_:
+        r = next_skip_(c, ch);
+        break;
     };
 
+    if (c->paths_len > 0 && r != rjson_next_syntax
+        && c->cur != rjson_incomplete)
+    {
+        filter_tok_(c);
+    }
+
     /* XXX: this whole thing with buffered_ch feels like a hack */
     if (processed_buffered || c->buffered_ch == -1) {
         /* removed one from buffer or not added this char to buffer */
@@ -178,6 +336,362 @@ enum rjson_next_res rjson_next(struct rjson_ctx * c, char ch)
     return r;
 }
 
+enum rjson_next_res rjson_feed(struct rjson_ctx * c,
+    const char * buf, size_t len, size_t * used_out)
+{
+    size_t i = 0;
+    enum rjson_next_res r = rjson_next_ok;
+
+    while (i < len) {
+        /* runs that rjson_next would take one by one with no token */
+        if (c->buffered_ch == -1) {
+            size_t n = 0;
+            switch (c->st) {
+            case st_idle_:
+            case st_want_key_:
+            case st_want_colon_:
+                n = ws_run_(buf + i, len - i);
+                break;
+            case st_skip_:
+                if (c->sd.skip.is_escape) {
+                    break;
+                }
+                n = until_any_(buf + i, len - i,
+                    c->sd.skip.is_str ? "\"\\" : "\"{}[]");
+                break;
+            case st_str_:
+                if (! c->sd.str.is_escape && c->sd.str.hi == 0) {
+                    n = str_run_(buf + i, len - i);
+                    /* the one that overflows goes to rjson_next */
+                    if (n > c->str_mlen - c->sd.str.len) {
+                        n = c->str_mlen - c->sd.str.len;
+                    }
+                    memcpy(c->str + c->sd.str.len, buf + i, n);
+                    c->sd.str.len += n;
+                }
+                break;
+            default:
+                break;
+            };
+            if (n > 0) {
+                c->cur = rjson_incomplete;
+                c->pos += n;
+                i += n;
+                continue;
+            }
+        }
+
+        r = rjson_next(c, buf[i]);
+        i++;
+        if (r != rjson_next_ok || c->cur != rjson_incomplete) {
+            break;
+        }
+    }
+
+    *used_out = i;
+    return r;
+}
+
+/* the structural chars of a json in buf, outside of strs, and both '"'
+ * of each str */
+static enum rjson_tape_res tape_idx_(const char * buf, size_t len,
+    size_t * idx, size_t idx_mlen, size_t * idx_len_out)
+{
+    size_t n = 0;
+    size_t base;
+    unsigned long long is_esc_carry = 0; /* of the first char of a block */
+    unsigned long long is_in_str = 0; /* at the end of the last block */
+
+    for (base = 0; base < len; base += 64) {
+        unsigned long long quote, bs, op, ctrl, esc, in_str, m;
+        if (len - base >= 64) {
+            block_masks_(buf + base, &quote, &bs, &op, &ctrl);
+        } else {
+            /* spaces are nothing to find */
+            char tail[64];
+            memset(tail, ' ', 64);
+            memcpy(tail, buf + base, len - base);
+            block_masks_(tail, &quote, &bs, &op, &ctrl);
+        }
+
+        /* a '\\' escapes the next char unless it is escaped itself */
+        esc = is_esc_carry;
+        is_esc_carry = 0;
+        for (m = bs; m != 0; m &= m - 1) {
+            int i = __builtin_ctzll(m);
+            if (esc >> i & 1) {
+                continue;
+            } else if (i == 63) {
+                is_esc_carry = 1;
+            } else {
+                esc |= 1ULL << (i + 1);
+            }
+        }
+        quote &= ~esc;
+
+        /* from an opening '"' up to the closing one, by a prefix xor */
+        in_str = quote;
+        in_str ^= in_str << 1;
+        in_str ^= in_str << 2;
+        in_str ^= in_str << 4;
+        in_str ^= in_str << 8;
+        in_str ^= in_str << 16;
+        in_str ^= in_str << 32;
+        in_str ^= is_in_str;
+        is_in_str = (in_str >> 63) ? ~0ULL : 0;
+
+        if ((ctrl & in_str & ~quote) != 0) {
+            return rjson_tape_fail_syntax; /* as next_str_ has it */
+        }
+
+        for (m = (op & ~in_str) | quote; m != 0; m &= m - 1) {
+            if (n == idx_mlen) {
+                return rjson_tape_fail_no_mem;
+            }
+            idx[n] = base + __builtin_ctzll(m);
+            n++;
+        }
+    }
+    if (is_in_str) {
+        return rjson_tape_fail_syntax;
+    }
+
+    *idx_len_out = n;
+    return rjson_tape_ok;
+}
+
+/* true, false, null or a num */
+static int tape_scalar_(const char * buf, size_t off, size_t len,
+    struct rjson_tok * t)
+{
+    struct rjson_ctx c;
+    t->off = off;
+    t->len = len;
+    t->is_escaped = 0;
+    if ((len == 4 && memcmp(buf + off, "true", 4) == 0)
+        || (len == 5 && memcmp(buf + off, "false", 5) == 0))
+    {
+        t->ty = rjson_bool;
+        return 1;
+    } else if (len == 4 && memcmp(buf + off, "null", 4) == 0) {
+        t->ty = rjson_null;
+        return 1;
+    } else if (is_num_start_(buf[off]) && tok_num_(&c, buf + off, len)) {
+        t->ty = rjson_num;
+        return 1;
+    }
+    return 0;
+}
+
+/* the escapes of a str are as next_str_ takes them */
+static int tape_escapes_(const char * buf, const struct rjson_tok * t)
+{
+    size_t i;
+    for (i = 0; i < t->len; i++) {
+        if (buf[t->off + i] == '\\') {
+            char out[4];
+            size_t used;
+            /* the closing '"' is escaped otherwise, so one more is there */
+            if (tape_escape_(buf + t->off + i + 1, t->len - i - 1, out,
+                    &used) < 0)
+            {
+                return 0;
+            }
+            i += used;
+        }
+    }
+    return 1;
+}
+
+enum rjson_tape_res rjson_tape(const char * buf, size_t len, size_t * idx,
+    size_t idx_mlen, struct rjson_tok * toks, size_t toks_mlen,
+    size_t * toks_len_out)
+{
+    enum want_ {
+        want_val_,
+        want_val_or_end_, /* after '[' */
+        want_key_,
+        want_key_or_end_, /* after '{' */
+        want_colon_,
+        want_comma_or_end_
+    } w = want_val_;
+    size_t stk[max_depth_]; /* the toks of the objs and arrs open */
+    size_t stk_len = 0;
+    size_t idx_len;
+    size_t k = 0; /* in idx */
+    size_t pos = 0; /* past the last char made a tok of */
+    size_t n = 0; /* in toks */
+    enum rjson_tape_res r = tape_idx_(buf, len, idx, idx_mlen, &idx_len);
+
+    if (r != rjson_tape_ok) {
+        return r;
+    }
+
+    while (n == 0 || stk_len > 0) {
+        size_t at;
+        char ch;
+        size_t gap;
+
+        if (k == idx_len) {
+            return rjson_tape_fail_syntax;
+        }
+        if (n == toks_mlen) {
+            return rjson_tape_fail_no_mem;
+        }
+        at = idx[k];
+        ch = buf[at];
+        gap = ws_run_(buf + pos, at - pos);
+
+        if (pos + gap < at) {
+            /* a scalar is the only thing between the structural chars */
+            size_t end = at;
+            if ((w != want_val_ && w != want_val_or_end_) || n == 0) {
+                return rjson_tape_fail_syntax;
+            }
+            while (is_whitespace_(buf[end - 1])) {
+                end--;
+            }
+            if (! tape_scalar_(buf, pos + gap, end - pos - gap, &toks[n])) {
+                return rjson_tape_fail_syntax;
+            }
+            n++;
+            pos = end;
+            w = want_comma_or_end_;
+            continue;
+        }
+        k++;
+        pos = at + 1;
+
+        toks[n].off = at;
+        toks[n].len = 1;
+        toks[n].is_escaped = 0;
+        switch (ch) {
+        case '{':
+        case '[':
+            if ((w != want_val_ && w != want_val_or_end_)
+                || (n == 0 && ch != '{') || stk_len == max_depth_)
+            {
+                return rjson_tape_fail_syntax;
+            }
+            toks[n].ty = (ch == '{') ? rjson_obj_start : rjson_arr_start;
+            stk[stk_len] = n;
+            stk_len++;
+            w = (ch == '{') ? want_key_or_end_ : want_val_or_end_;
+            break;
+        case '}':
+        case ']':
+            if (stk_len == 0
+                || toks[stk[stk_len - 1]].ty
+                    != ((ch == '}') ? rjson_obj_start : rjson_arr_start)
+                || ! (w == want_comma_or_end_
+                    || (w == want_key_or_end_ && ch == '}')
+                    || (w == want_val_or_end_ && ch == ']')))
+            {
+                return rjson_tape_fail_syntax;
+            }
+            toks[n].ty = (ch == '}') ? rjson_obj_end : rjson_arr_end;
+            stk_len--;
+            toks[stk[stk_len]].len = n - stk[stk_len];
+            w = want_comma_or_end_;
+            break;
+        case '"':
+            if (w == want_colon_ || w == want_comma_or_end_) {
+                return rjson_tape_fail_syntax;
+            }
+            toks[n].ty = rjson_str;
+            toks[n].off = at + 1;
+            toks[n].len = idx[k] - at - 1; /* tape_idx_ has the closing */
+            toks[n].is_escaped = (memchr(buf + at + 1, '\\',
+                toks[n].len) != NULL);
+            if (toks[n].is_escaped && ! tape_escapes_(buf, &toks[n])) {
+                return rjson_tape_fail_syntax;
+            }
+            pos = idx[k] + 1;
+            k++;
+            w = (w == want_key_ || w == want_key_or_end_) ? want_colon_
+                : want_comma_or_end_;
+            break;
+        case ':':
+            if (w != want_colon_) {
+                return rjson_tape_fail_syntax;
+            }
+            w = want_val_;
+            continue; /* not a tok */
+        case ',':
+            if (w != want_comma_or_end_) {
+                return rjson_tape_fail_syntax;
+            }
+            w = (toks[stk[stk_len - 1]].ty == rjson_obj_start) ? want_key_
+                : want_val_;
+            continue;
+        };
+        n++;
+    }
+
+    if (k != idx_len || ws_run_(buf + pos, len - pos) != len - pos) {
+        return rjson_tape_fail_syntax;
+    }
+    *toks_len_out = n;
+    return rjson_tape_ok;
+}
+
+enum rjson_tok_str_res rjson_tok_str(const char * buf,
+    const struct rjson_tok * t, char * str_out, size_t str_mlen)
+{
+    size_t i;
+    size_t len = 0;
+    for (i = 0; i < t->len; i++) {
+        char out[4];
+        int n = 1;
+        out[0] = buf[t->off + i];
+        if (out[0] == '\\') {
+            size_t used;
+            /* checked by rjson_tape */
+            n = tape_escape_(buf + t->off + i + 1, t->len - i - 1, out,
+                &used);
+            i += used;
+        }
+        if (str_mlen - len < (size_t) n) {
+            return rjson_tok_str_fail_overflow;
+        }
+        memcpy(str_out + len, out, n);
+        len += n;
+    }
+    if (len == str_mlen) {
+        return rjson_tok_str_fail_overflow;
+    }
+    str_out[len] = '\0';
+    return rjson_tok_str_ok;
+}
+
+double rjson_tok_num(const char * buf, const struct rjson_tok * t)
+{
+    struct rjson_ctx c;
+    (void) tok_num_(&c, buf + t->off, t->len); /* checked by rjson_tape */
+    return c.sd.num.num;
+}
+
+enum rjson_int_res rjson_tok_u64(const char * buf, const struct rjson_tok * t,
+    unsigned long long * num_out)
+{
+    struct rjson_ctx c;
+    (void) tok_num_(&c, buf + t->off, t->len);
+    return rjson_cur_u64(&c, num_out);
+}
+
+enum rjson_int_res rjson_tok_i64(const char * buf, const struct rjson_tok * t,
+    long long * num_out)
+{
+    struct rjson_ctx c;
+    (void) tok_num_(&c, buf + t->off, t->len);
+    return rjson_cur_i64(&c, num_out);
+}
+
+int rjson_tok_is_true(const char * buf, const struct rjson_tok * t)
+{
+    return buf[t->off] == 't';
+}
+
 size_t rjson_pos(const struct rjson_ctx * c)
 {
     return c->pos;
@@ -195,10 +709,50 @@ double rjson_cur_num(const struct rjson_ctx * c)
 {
     return c->sd.num.num;
 }
+enum rjson_int_res rjson_cur_u64(const struct rjson_ctx * c,
+    unsigned long long * num_out)
+{
+    if (c->sd.num.part != num_part_int_
+        && c->sd.num.part != num_part_leading_zero_)
+    {
+        return rjson_int_fail_not_int;
+    }
+    if (c->sd.num.is_mant_over || (c->sd.num.is_neg && c->sd.num.mant > 0)) {
+        return rjson_int_fail_overflow;
+    }
+    *num_out = c->sd.num.mant;
+    return rjson_int_ok;
+}
+enum rjson_int_res rjson_cur_i64(const struct rjson_ctx * c,
+    long long * num_out)
+{
+    unsigned long long max = (unsigned long long) LLONG_MAX
+        + (c->sd.num.is_neg ? 1 : 0);
+    if (c->sd.num.part != num_part_int_
+        && c->sd.num.part != num_part_leading_zero_)
+    {
+        return rjson_int_fail_not_int;
+    }
+    if (c->sd.num.is_mant_over || c->sd.num.mant > max) {
+        return rjson_int_fail_overflow;
+    }
+    if (c->sd.num.is_neg) {
+        /* -LLONG_MIN does not fit */
+        *num_out = (c->sd.num.mant == max) ? LLONG_MIN
+            : - (long long) c->sd.num.mant;
+    } else {
+        *num_out = (long long) c->sd.num.mant;
+    }
+    return rjson_int_ok;
+}
 int rjson_cur_is_true(const struct rjson_ctx * c)
 {
     return c->sd.special.bool_is_true;
 }
+int rjson_cur_path(const struct rjson_ctx * c)
+{
+    return c->cur_path;
+}
 
 static void set_st_(struct rjson_ctx * c, enum st_ st)
 {
@@ -208,13 +762,26 @@ static void set_st_(struct rjson_ctx * c, enum st_ st)
             c->sd.str.len = 0;
             c->sd.str.is_escape = 0;
             c->sd.str.is_key = 0;
+            c->sd.str.hex_left = 0;
+            c->sd.str.unit = 0;
+            c->sd.str.hi = 0;
             break;
         case st_num_:
             c->sd.num.num = 0.0;
+            c->sd.num.mant = 0;
+            c->sd.num.is_mant_over = 0;
+            c->sd.num.mant_skip = 0;
+            c->sd.num.frac_len = 0;
             c->sd.num.digit_pos = 0;
             c->sd.num.is_neg = 0;
+            c->sd.num.is_exp_neg = 0;
+            c->sd.num.is_exp_sign = 0;
             c->sd.num.exp = 0;
             c->sd.num.part = num_part_int_;
+            c->sd.num.txt_len = 0;
+            c->sd.num.txt_frac = 0;
+            c->sd.num.txt_skip = 0;
+            c->sd.num.is_txt_cut = 0;
             break;
         case st_true_:
             c->sd.special.bool_is_true = 1;
@@ -227,6 +794,11 @@ static void set_st_(struct rjson_ctx * c, enum st_ st)
         case st_null_:
             c->sd.special.word_pos = 0;
             break;
+        case st_skip_:
+            c->sd.skip.depth = 0;
+            c->sd.skip.is_str = 0;
+            c->sd.skip.is_escape = 0;
+            break;
         case st_idle_:
         case st_want_key_:
         case st_want_colon_:
@@ -297,8 +869,341 @@ static int is_num_start_(char ch)
         || ch == '-';
 }
 
+/* how many chars at the start of buf are whitespace */
+static size_t ws_run_(const char * buf, size_t len)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        __m256i ws = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))));
+        unsigned int other = ~ (unsigned int) _mm256_movemask_epi8(ws);
+        if (other != 0) {
+            return i + __builtin_ctz(other);
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        __m128i ws = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+        unsigned int other = ~ (unsigned int) _mm_movemask_epi8(ws) & 0xffff;
+        if (other != 0) {
+            return i + __builtin_ctz(other);
+        }
+    }
+#endif
+    while (i < len && is_whitespace_(buf[i])) {
+        i++;
+    }
+    return i;
+}
+
+/* how many chars at the start of buf next_str_ would just copy: not '"',
+ * '\\' or a control character as it sees them, so the bytes of utf-8 are
+ * copied too */
+static size_t str_run_(const char * buf, size_t len)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        /* unsigned, so the ones >= 128 are above 31 */
+        __m256i stop = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+            _mm256_or_si256(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127)),
+                _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(31)),
+                    v)));
+        unsigned int m = (unsigned int) _mm256_movemask_epi8(stop);
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        /* unsigned, so the ones >= 128 are above 31 */
+        __m128i stop = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(127)),
+                _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(31)), v)));
+        unsigned int m = (unsigned int) _mm_movemask_epi8(stop);
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        char ch = buf[i];
+        if ((unsigned char) ch <= 31 || ch == 127 || ch == '"'
+            || ch == '\\')
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+/* bit i is set if p[i] is '"', '\\', one of "{}[]:," or a control
+ * character as next_str_ sees them */
+static void block_masks_(const char * p, unsigned long long * quote,
+    unsigned long long * bs, unsigned long long * op,
+    unsigned long long * ctrl)
+{
+#if defined(__AVX2__)
+    int h;
+    *quote = 0;
+    *bs = 0;
+    *op = 0;
+    *ctrl = 0;
+    for (h = 0; h < 64; h += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (p + h));
+        __m256i o = _mm256_or_si256(
+            _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('[')),
+                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(']')))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+        __m256i ct = _mm256_or_si256(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(31)), v),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(127)));
+        *quote |= (unsigned long long) (unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << h;
+        *bs |= (unsigned long long) (unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << h;
+        *op |= (unsigned long long) (unsigned int) _mm256_movemask_epi8(o)
+            << h;
+        *ctrl |= (unsigned long long) (unsigned int) _mm256_movemask_epi8(ct)
+            << h;
+    }
+#elif defined(__SSE2__)
+    int h;
+    *quote = 0;
+    *bs = 0;
+    *op = 0;
+    *ctrl = 0;
+    for (h = 0; h < 64; h += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + h));
+        __m128i o = _mm_or_si128(
+            _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')),
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('[')),
+                    _mm_cmpeq_epi8(v, _mm_set1_epi8(']')))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        __m128i ct = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(31)), v),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8(127)));
+        *quote |= (unsigned long long) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << h;
+        *bs |= (unsigned long long) _mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << h;
+        *op |= (unsigned long long) _mm_movemask_epi8(o) << h;
+        *ctrl |= (unsigned long long) _mm_movemask_epi8(ct) << h;
+    }
+#else
+    int i;
+    *quote = 0;
+    *bs = 0;
+    *op = 0;
+    *ctrl = 0;
+    for (i = 0; i < 64; i++) {
+        unsigned long long bit = 1ULL << i;
+        char ch = p[i];
+        *quote |= (ch == '"') ? bit : 0;
+        *bs |= (ch == '\\') ? bit : 0;
+        *op |= (ch != '\0' && strchr("{}[]:,", ch) != NULL) ? bit : 0;
+        *ctrl |= ((unsigned char) ch <= 31 || ch == 127) ? bit : 0;
+    }
+#endif
+}
+
+/* c as if rjson_next parsed the num in txt; 0 if it is not one */
+static int tok_num_(struct rjson_ctx * c, const char * txt, size_t len)
+{
+    size_t i;
+    c->st = st_idle_;
+    c->buffered_ch = -1;
+    c->is_val_expected = 1;
+    c->cur = rjson_incomplete;
+    set_st_(c, st_num_);
+    for (i = 0; i < len; i++) {
+        /* a char that ends the num, like a space in the middle */
+        if (c->st != st_num_ || next_num_(c, txt[i]) == rjson_next_syntax) {
+            return 0;
+        }
+    }
+    return c->st == st_num_ && next_num_(c, ' ') == rjson_next_ok;
+}
+
+/* how many chars at the start of buf are none of stops and not '\0' */
+static size_t until_any_(const char * buf, size_t len, const char * stops)
+{
+    size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    size_t stops_len = strlen(stops);
+    size_t s;
+#endif
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        __m256i hit = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+        unsigned int m;
+        for (s = 0; s < stops_len; s++) {
+            hit = _mm256_or_si256(hit,
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(stops[s])));
+        }
+        m = (unsigned int) _mm256_movemask_epi8(hit);
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        __m128i hit = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+        unsigned int m;
+        for (s = 0; s < stops_len; s++) {
+            hit = _mm_or_si128(hit,
+                _mm_cmpeq_epi8(v, _mm_set1_epi8(stops[s])));
+        }
+        m = (unsigned int) _mm_movemask_epi8(hit);
+        if (m != 0) {
+            return i + __builtin_ctz(m);
+        }
+    }
+#endif
+    /* strchr finds the '\0' of stops too */
+    while (i < len && strchr(stops, buf[i]) == NULL) {
+        i++;
+    }
+    return i;
+}
+
+/* at the start of a value; 1 if it is to be skipped */
+static int filter_val_(struct rjson_ctx * c, char ch)
+{
+    size_t d = c->lvls_len;
+    unsigned long mask = 0;
+    unsigned long exact = 0;
+    int i;
+
+    if (lvl_(c) == lvl_arr_) {
+        for (i = 0; i < c->paths_len; i++) {
+            if ((c->alive[d] >> i & 1) && c->paths[i].segs_len >= d
+                && c->paths[i].segs[d - 1] == NULL)
+            {
+                mask |= 1UL << i;
+            }
+        }
+    } else {
+        mask = c->key_mask;
+    }
+    for (i = 0; i < c->paths_len; i++) {
+        if ((mask >> i & 1) && c->paths[i].segs_len == d) {
+            exact |= 1UL << i;
+        }
+    }
+    c->val_path = (exact != 0) ? __builtin_ctzl(exact) : -1;
+    c->val_deeper = mask & ~exact;
+
+    if (exact == 0 && (c->val_deeper == 0 || (ch != '{' && ch != '['))) {
+        /* a num or a word is parsed as usual, but not reported */
+        return ch == '"' || ch == '{' || ch == '[';
+    }
+    return 0;
+}
+
+/* hides the token if it is at no path */
+static void filter_tok_(struct rjson_ctx * c)
+{
+    size_t d = c->lvls_len;
+    int i;
+    switch (c->cur) {
+    case rjson_obj_start:
+    case rjson_arr_start:
+        /* the top-level obj is at no path, but all start in it */
+        c->lvl_path[d - 1] = (d > 1) ? c->val_path : -1;
+        c->alive[d] = (d > 1) ? c->val_deeper
+            : (1UL << c->paths_len) - 1;
+        c->cur_path = c->lvl_path[d - 1];
+        break;
+    case rjson_obj_end:
+    case rjson_arr_end:
+        c->cur_path = c->lvl_path[d]; /* the one popped */
+        break;
+    case rjson_str:
+        if (c->st == st_want_colon_) { /* a key */
+            c->key_mask = 0;
+            for (i = 0; i < c->paths_len; i++) {
+                if ((c->alive[d] >> i & 1) && c->paths[i].segs_len >= d
+                    && c->paths[i].segs[d - 1] != NULL
+                    && strcmp(c->paths[i].segs[d - 1], c->str) == 0)
+                {
+                    c->key_mask |= 1UL << i;
+                }
+            }
+            c->cur_path = -1;
+            break;
+        }
+        /* fallthrough */
+    default:
+        c->cur_path = c->val_path;
+        break;
+    };
+    if (c->cur_path == -1) {
+        c->cur = rjson_incomplete;
+    }
+}
+
+/* till the end of a str, obj or arr; nothing in it is checked */
+static enum rjson_next_res next_skip_(struct rjson_ctx * c, char ch)
+{
+    assert_st_(c, st_skip_);
+
+    c->cur = rjson_incomplete;
+
+    if (c->sd.skip.is_str) {
+        if (c->sd.skip.is_escape) {
+            c->sd.skip.is_escape = 0;
+        } else if (ch == '\\') {
+            c->sd.skip.is_escape = 1;
+        } else if (ch == '"') {
+            c->sd.skip.is_str = 0;
+        }
+    } else if (ch == '"') {
+        c->sd.skip.is_str = 1;
+    } else if (ch == '{' || ch == '[') {
+        c->sd.skip.depth++;
+    } else if (ch == '}' || ch == ']') {
+        c->sd.skip.depth--;
+    }
+
+    if (c->sd.skip.depth == 0 && ! c->sd.skip.is_str) {
+        c->is_val_expected = 0;
+        set_st_(c, st_idle_);
+    }
+    return rjson_next_ok;
+}
+
 static enum rjson_next_res next_idle_(struct rjson_ctx * c, char ch)
 {
+    int is_arr_empty = c->is_arr_empty;
+
     assert_st_(c, st_idle_);
 
     c->cur = rjson_incomplete;
@@ -306,6 +1211,7 @@ static enum rjson_next_res next_idle_(struct rjson_ctx * c, char ch)
     if (is_whitespace_(ch)) {
         return rjson_next_ok;
     }
+    c->is_arr_empty = 0;
 
     if (lvl_(c) == lvl_none_ && ch != '{') {
         return rjson_next_syntax;
@@ -344,6 +1250,7 @@ static enum rjson_next_res next_idle_(struct rjson_ctx * c, char ch)
             set_st_(c, st_idle_);
             c->cur = rjson_arr_start;
             c->is_val_expected = 1;
+            c->is_arr_empty = 1;
             return rjson_next_ok;
         } else {
             return rjson_next_syntax;
@@ -367,10 +1274,12 @@ static enum rjson_next_res next_idle_(struct rjson_ctx * c, char ch)
         }
     case ']':
         if (lvl_(c) == lvl_arr_) {
-            if (! c->is_val_expected) {
+            /* not after a ',', unlike '}' in next_want_key_ */
+            if (! c->is_val_expected || is_arr_empty) {
                 pop_lvl_(c);
                 set_st_(c, st_idle_);
                 c->cur = rjson_arr_end;
+                c->is_val_expected = 0;
                 return rjson_next_ok;
             } else {
                 return rjson_next_syntax;
@@ -417,6 +1326,7 @@ enum rjson_next_res next_want_key_(struct rjson_ctx * c, char ch)
     assert_is_val_expected_(c, 1);
 
     if (is_whitespace_(ch)) {
+        c->cur = rjson_incomplete; /* the obj_start was reported */
         return rjson_next_ok;
     }
 
@@ -453,6 +1363,7 @@ enum rjson_next_res next_want_colon_(struct rjson_ctx * c, char ch)
     assert_is_val_expected_(c, 0);
 
     if (is_whitespace_(ch)) {
+        c->cur = rjson_incomplete; /* the key was reported */
         return rjson_next_ok;
     }
 
@@ -478,14 +1389,12 @@ static enum add_str_ch_res_ {
     add_ch_ok_ = 1
 } add_str_ch_(struct rjson_ctx * c, char ch);
 
-static enum str_escape_res_ {
-    str_escape_invalid_ = -1,
-    str_escaped_ = 1,
-    str_escape_utf16_ = 2
-} str_escape_(char * ch);
-
 static enum rjson_next_res next_str_(struct rjson_ctx * c, char ch)
 {
+    char out[4]; /* what goes to str */
+    int n = 0;
+    int i;
+
     assert_st_(c, st_str_);
     if (c->sd.str.is_key) {
         assert_lvl_(c, lvl_obj_);
@@ -493,21 +1402,50 @@ static enum rjson_next_res next_str_(struct rjson_ctx * c, char ch)
 
     c->cur = rjson_incomplete;
 
-    if (ch <= 31 || ch >= 127) { /* control character */
+    /* control character; the bytes of utf-8 are >= 128 */
+    if ((unsigned char) ch <= 31 || ch == 127) {
         return rjson_next_syntax;
     }
 
-    if (c->sd.str.is_escape) {
+    if (c->sd.str.hex_left > 0) {
+        int d = hex_digit_(ch);
+        if (d < 0) {
+            return rjson_next_syntax;
+        }
+        c->sd.str.unit = c->sd.str.unit * 16 + d;
+        c->sd.str.hex_left--;
+        if (c->sd.str.hex_left > 0) {
+            return rjson_next_ok;
+        }
+        c->sd.str.is_escape = 0;
+        n = utf16_(&c->sd.str.hi, c->sd.str.unit, out);
+        if (n < 0) {
+            return rjson_next_syntax;
+        } else if (n == 0) {
+            return rjson_next_ok; /* its low surrogate is next */
+        }
+    } else if (c->sd.str.is_escape) {
         enum str_escape_res_ r = str_escape_(&ch);
         switch (r) {
         case str_escaped_:
+            if (c->sd.str.hi != 0) {
+                return rjson_next_syntax;
+            }
             c->sd.str.is_escape = 0;
             break; /* ch has escaped value */
         case str_escape_utf16_:
-            return rjson_next_syntax; /* XXX: not implemented */
+            c->sd.str.hex_left = 4;
+            c->sd.str.unit = 0;
+            return rjson_next_ok;
         case str_escape_invalid_:
             return rjson_next_syntax;
         };
+    } else if (c->sd.str.hi != 0) {
+        if (ch != '\\') {
+            return rjson_next_syntax; /* a high surrogate with no low one */
+        }
+        c->sd.str.is_escape = 1;
+        return rjson_next_ok;
     } else if (ch == '\\') {
         c->sd.str.is_escape = 1;
         return rjson_next_ok;
@@ -522,11 +1460,15 @@ static enum rjson_next_res next_str_(struct rjson_ctx * c, char ch)
         }
     }
 
-    {
-        enum add_str_ch_res_ r = add_str_ch_(c, ch);
+    if (n == 0) {
+        out[0] = ch;
+        n = 1;
+    }
+    for (i = 0; i < n; i++) {
+        enum add_str_ch_res_ r = add_str_ch_(c, out[i]);
         switch (r) {
         case add_ch_ok_:
-            return rjson_next_ok;
+            break;
         case add_ch_overflow_:
             /* XXX: should not print */
             fprintf(stderr,
@@ -535,10 +1477,12 @@ static enum rjson_next_res next_str_(struct rjson_ctx * c, char ch)
             return rjson_next_syntax;
         };
     }
-    SOB_PANIC("unreachable");
-    return rjson_next_syntax;
+    return rjson_next_ok;
 }
 
+static void num_digit_(struct rjson_ctx * c, char ch);
+static double num_end_(struct rjson_ctx * c);
+
 static enum rjson_next_res next_num_(struct rjson_ctx * c, char ch)
 {
     assert_st_(c, st_num_);
@@ -546,9 +1490,7 @@ static enum rjson_next_res next_num_(struct rjson_ctx * c, char ch)
 
     if (is_whitespace_(ch) || ch == '}' || ch == ']' || ch == ',') {
         if (c->sd.num.digit_pos > 0) {
-            if (c->sd.num.part == num_part_exp_) {
-                c->sd.num.num *= pow(10.0, c->sd.num.exp);
-            }
+            c->sd.num.num = num_end_(c);
             c->cur = rjson_num;
             if (c->buffered_ch != -1) {
                 SOB_PANIC("buffered_ch should've been consumed before num");
@@ -564,21 +1506,15 @@ static enum rjson_next_res next_num_(struct rjson_ctx * c, char ch)
 
     if (c->sd.num.part == num_part_int_ && ch == '0' && c->sd.num.digit_pos == 0) {
         c->sd.num.part = num_part_leading_zero_;
+        c->sd.num.digit_pos++;
         return rjson_next_ok;
     }
 
     switch (c->sd.num.part) {
     case num_part_leading_zero_:
-        if (ch == '.') {
-            c->sd.num.part = num_part_frac_;
-            return rjson_next_ok;
-        } else {
-            return rjson_next_syntax;
-        }
-        break;
     case num_part_int_:
         if (ch == '-') {
-            if (c->sd.num.digit_pos == 0) {
+            if (c->sd.num.digit_pos == 0 && ! c->sd.num.is_neg) {
                 c->sd.num.is_neg = 1;
                 return rjson_next_ok;
             } else {
@@ -600,30 +1536,27 @@ static enum rjson_next_res next_num_(struct rjson_ctx * c, char ch)
             } else {
                 return rjson_next_syntax;
             }
-        } else if (ch >= '0' && ch <= '9') {
-            c->sd.num.num *= 10;
-            c->sd.num.num += (ch - '0') * (c->sd.num.is_neg ? -1 : 1);
+        } else if (ch >= '0' && ch <= '9'
+            && c->sd.num.part == num_part_int_)
+        {
+            num_digit_(c, ch);
             c->sd.num.digit_pos++;
             return rjson_next_ok;
         } else {
-            return rjson_next_syntax;
+            return rjson_next_syntax; /* like 01 */
         }
         break;
     case num_part_frac_:
         if (ch == 'e' || ch == 'E') {
             if (c->sd.num.digit_pos > 0) {
                 c->sd.num.digit_pos = 0;
-                c->sd.num.is_neg = 0;
-                c->sd.num.exp = 0;
                 c->sd.num.part = num_part_exp_;
                 return rjson_next_ok;
             } else {
                 return rjson_next_syntax;
             }
         } else if (ch >= '0' && ch <= '9') {
-            c->sd.num.num += (ch - '0')
-                * pow(10.0, -(c->sd.num.digit_pos + 1))
-                * (c->sd.num.is_neg ? -1 : 1);
+            num_digit_(c, ch);
             c->sd.num.digit_pos++;
             return rjson_next_ok;
         } else {
@@ -631,23 +1564,18 @@ static enum rjson_next_res next_num_(struct rjson_ctx * c, char ch)
         }
         break;
     case num_part_exp_:
-        if (ch == '+') {
-            if (c->sd.num.digit_pos == 0) {
-                c->sd.num.is_neg = 0;
-                return rjson_next_ok;
-            } else {
-                return rjson_next_syntax;
-            }
-        } else if (ch == '-') {
-            if (c->sd.num.digit_pos == 0) {
-                c->sd.num.is_neg = 1;
+        if (ch == '+' || ch == '-') {
+            if (c->sd.num.digit_pos == 0 && ! c->sd.num.is_exp_sign) {
+                c->sd.num.is_exp_sign = 1;
+                c->sd.num.is_exp_neg = (ch == '-');
                 return rjson_next_ok;
             } else {
                 return rjson_next_syntax;
             }
         } else if (ch >= '0' && ch <= '9') {
-            c->sd.num.exp *= 10;
-            c->sd.num.exp += (ch - '0') * (c->sd.num.is_neg ? -1 : 1);
+            if (c->sd.num.exp < exp_max_) {
+                c->sd.num.exp = c->sd.num.exp * 10 + (ch - '0');
+            }
             c->sd.num.digit_pos++;
             return rjson_next_ok;
         } else {
@@ -659,6 +1587,72 @@ static enum rjson_next_res next_num_(struct rjson_ctx * c, char ch)
     return rjson_next_ok;
 }
 
+/* into mant while it fits, and into txt */
+static void num_digit_(struct rjson_ctx * c, char ch)
+{
+    unsigned int d = ch - '0';
+    int is_frac = (c->sd.num.part == num_part_frac_);
+    if (c->sd.num.txt_len == 0 && d == 0) {
+        c->sd.num.txt_frac += is_frac;
+    } else if (c->sd.num.txt_len < num_digits_len_) {
+        c->sd.num.txt[c->sd.num.txt_len] = ch;
+        c->sd.num.txt_len++;
+        c->sd.num.txt_frac += is_frac;
+    } else {
+        c->sd.num.is_txt_cut |= (d != 0);
+        c->sd.num.txt_skip += ! is_frac;
+    }
+
+    if (! c->sd.num.is_mant_over
+        && c->sd.num.mant <= (ULLONG_MAX - d) / 10)
+    {
+        c->sd.num.mant = c->sd.num.mant * 10 + d;
+        c->sd.num.frac_len += (c->sd.num.part == num_part_frac_);
+    } else {
+        c->sd.num.is_mant_over = 1;
+        c->sd.num.mant_skip += (c->sd.num.part != num_part_frac_);
+    }
+}
+
+/* the double nearest to the num */
+static double num_end_(struct rjson_ctx * c)
+{
+    static const double pow10[exact_pow10_max_ + 1] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    int e10 = (c->sd.num.is_exp_neg ? -c->sd.num.exp : c->sd.num.exp)
+        - c->sd.num.frac_len + c->sd.num.mant_skip;
+    double num;
+
+    if (! c->sd.num.is_mant_over
+        && c->sd.num.mant <= (1ULL << exact_mant_bits_)
+        && e10 >= -exact_pow10_max_ && e10 <= exact_pow10_max_)
+    {
+        /* both are exact, so there is only the rounding of the result */
+        num = (double) c->sd.num.mant;
+        num = (e10 < 0) ? num / pow10[-e10] : num * pow10[e10];
+    } else if (c->sd.num.part == num_part_int_ && ! c->sd.num.is_mant_over) {
+        num = (double) c->sd.num.mant; /* rounded once */
+    } else if (c->sd.num.txt_len == 0) {
+        num = 0.0;
+    } else {
+        /* the digits and their exponent, with no '.' of the locale, so
+         * strtod rounds once */
+        size_t len = c->sd.num.txt_len;
+        int e = (c->sd.num.is_exp_neg ? -c->sd.num.exp : c->sd.num.exp)
+            - c->sd.num.txt_frac + c->sd.num.txt_skip;
+        if (c->sd.num.is_txt_cut) {
+            c->sd.num.txt[len] = '1';
+            len++;
+            e--;
+        }
+        sprintf(c->sd.num.txt + len, "e%d", e);
+        num = strtod(c->sd.num.txt, NULL);
+    }
+    return c->sd.num.is_neg ? -num : num;
+}
+
 static enum rjson_next_res next_bool_(struct rjson_ctx * c, char ch,
         const char * word);
 
@@ -758,6 +1752,106 @@ static enum str_escape_res_ str_escape_(char * ch)
     };
 }
 
+static int hex_digit_(char ch)
+{
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    } else if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    } else if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+/* unit of a \\uXXXX as utf-8 in out: how many chars there are, 0 if it is
+ * a high surrogate, kept in hi till its low one, or -1 if it is not valid.
+ * \\u0000 is not, as strs end with '\\0' */
+static int utf16_(unsigned long * hi, unsigned long unit, char * out)
+{
+    unsigned long cp = unit;
+    if (unit >= 0xd800 && unit <= 0xdbff && *hi == 0) {
+        *hi = unit;
+        return 0;
+    } else if (unit >= 0xdc00 && unit <= 0xdfff && *hi != 0) {
+        cp = 0x10000 + ((*hi - 0xd800) << 10) + (unit - 0xdc00);
+        *hi = 0;
+    } else if (*hi != 0 || (unit >= 0xd800 && unit <= 0xdfff) || unit == 0) {
+        return -1;
+    }
+
+    if (cp < 0x80) {
+        out[0] = (char) cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char) (0xc0 | cp >> 6);
+        out[1] = (char) (0x80 | (cp & 0x3f));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char) (0xe0 | cp >> 12);
+        out[1] = (char) (0x80 | (cp >> 6 & 0x3f));
+        out[2] = (char) (0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char) (0xf0 | cp >> 18);
+    out[1] = (char) (0x80 | (cp >> 12 & 0x3f));
+    out[2] = (char) (0x80 | (cp >> 6 & 0x3f));
+    out[3] = (char) (0x80 | (cp & 0x3f));
+    return 4;
+}
+
+/* the escape of a str of rjson_tape just past its '\\', as next_str_
+ * takes it: how many chars of it go to out, or -1 if it is not valid.
+ * *used_out is how many of p it is */
+static int tape_escape_(const char * p, size_t len, char * out,
+    size_t * used_out)
+{
+    unsigned long hi = 0;
+    size_t i = 0;
+    int n = 0;
+    char ch = p[0];
+
+    switch (str_escape_(&ch)) {
+    case str_escaped_:
+        out[0] = ch;
+        *used_out = 1;
+        return 1;
+    case str_escape_invalid_:
+        return -1;
+    case str_escape_utf16_:
+        break;
+    };
+
+    /* a high surrogate is followed by the \\u of its low one */
+    while (n == 0) {
+        unsigned long unit = 0;
+        int k;
+        if (i > 0) {
+            if (len - i < 1 || p[i] != '\\') {
+                return -1;
+            }
+            i++;
+        }
+        if (len - i < 5 || p[i] != 'u') {
+            return -1;
+        }
+        for (k = 1; k <= 4; k++) {
+            int d = hex_digit_(p[i + k]);
+            if (d < 0) {
+                return -1;
+            }
+            unit = unit * 16 + d;
+        }
+        i += 5;
+        n = utf16_(&hi, unit, out);
+        if (n < 0) {
+            return -1;
+        }
+    }
+    *used_out = i;
+    return n;
+}
+
 #ifdef SOB_RJSON_DEMO
 
 #include <stdio.h>
@@ -766,6 +1860,35 @@ enum {
     str_buf_mlen_ = 120
 };
 
+static struct rjson_tok tape_toks_[64];
+
+static enum rjson_tape_res tape_(const char * str, size_t * toks_len_out)
+{
+    static size_t idx[64];
+    return rjson_tape(str, strlen(str), idx, 64, tape_toks_, 64,
+        toks_len_out);
+}
+
+/* the last str in json, by rjson_feed, or NULL if it is not valid */
+static const char * feed_str_(struct rjson_ctx * c, const char * json,
+    char * str_buf, size_t str_mlen)
+{
+    size_t len = strlen(json) + 1;
+    size_t off = 0;
+    rjson_init(c, str_buf, str_mlen);
+    while (off < len) {
+        size_t used;
+        enum rjson_next_res r = rjson_feed(c, json + off, len - off, &used);
+        off += used;
+        if (r == rjson_next_syntax) {
+            return NULL;
+        } else if (r == rjson_next_fin) {
+            return str_buf;
+        }
+    }
+    return NULL;
+}
+
 int main(int argc, char ** argv)
 {
     const char * str = "{\"hello\": \"world\",\n"
@@ -830,6 +1953,277 @@ int main(int argc, char ** argv)
         }
     }
 
+    /* rjson_feed gives the same tokens at the same pos */
+    {
+        const char * ws_str = "{ \"long string to scan in bulk, past 32\" :"
+            " [ 1 ,\t\"esc\\\"aped\" , {  }, [ null ]  , [ ], [[]], true ] ,\n"
+            "  \"k\"  :  -0.5e1   }";
+        char feed_buf[str_buf_mlen_];
+        struct rjson_ctx f;
+        size_t len = strlen(ws_str) + 1;
+        size_t off = 0;
+        int toks = 0;
+
+        rjson_init(&c, str_buf, str_buf_mlen_);
+        rjson_init(&f, feed_buf, str_buf_mlen_);
+        i = 0;
+        while (off < len) {
+            size_t used;
+            enum rjson_next_res fres = rjson_feed(&f,
+                ws_str + off, len - off, &used);
+            enum rjson_next_res nres;
+            do {
+                nres = rjson_next(&c, ws_str[i]);
+                i++;
+            } while (nres == rjson_next_ok
+                && rjson_cur_ty(&c) == rjson_incomplete && i < len);
+            off += used;
+            if (fres != nres || i != off || rjson_pos(&f) != rjson_pos(&c)
+                || rjson_cur_ty(&f) != rjson_cur_ty(&c)
+                || (rjson_cur_ty(&f) == rjson_str
+                    && strcmp(rjson_cur_str(&f), rjson_cur_str(&c)) != 0))
+            {
+                fprintf(stderr, "feed differs @ %lu\n", off);
+                return 1;
+            }
+            toks += (rjson_cur_ty(&f) != rjson_incomplete);
+            if (fres == rjson_next_syntax) {
+                fprintf(stderr, "feed syntax error @ %lu\n", rjson_pos(&f));
+                return 1;
+            } else if (fres == rjson_next_fin) {
+                break;
+            }
+        }
+        printf("feed: %i tokens, same as rjson_next\n", toks);
+    }
+
+    /* only what is asked for of a getUpdates batch */
+    {
+        const char * upd_str = "{\"ok\":true,\"result\":[{\"update_id\":7,"
+            "\"message\":{\"from\":{\"id\":1,\"first_name\":\"A [b]\"},"
+            "\"chat\":{\"id\":-100123,\"type\":\"group\"},"
+            "\"entities\":[{\"offset\":0,\"length\":6}],"
+            "\"text\":\"/start \\\"x\\\"\"}},{\"update_id\":8,"
+            "\"callback_query\":{\"id\":\"q\",\"data\":\"pay:1\"}}]}";
+        const char * paths[] = {"result[]", "result[].update_id",
+            "result[].message.chat.id", "result[].message.text",
+            "result[].callback_query.data"};
+        size_t len = strlen(upd_str) + 1;
+        size_t off = 0;
+        enum rjson_next_res res = rjson_next_ok;
+
+        rjson_init(&c, str_buf, str_buf_mlen_);
+        for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+            int id;
+            if (rjson_add_path(&c, paths[i], &id) != rjson_path_ok) {
+                fprintf(stderr, "cannot add path '%s'\n", paths[i]);
+                return 1;
+            }
+        }
+        while (off < len && res == rjson_next_ok) {
+            size_t used;
+            res = rjson_feed(&c, upd_str + off, len - off, &used);
+            off += used;
+            if (res == rjson_next_syntax) {
+                fprintf(stderr, "path syntax error @ %lu\n", rjson_pos(&c));
+                return 1;
+            }
+            switch (rjson_cur_ty(&c)) {
+            case rjson_incomplete:
+                break;
+            case rjson_str:
+                printf("%s: '%s'\n", paths[rjson_cur_path(&c)],
+                    rjson_cur_str(&c));
+                break;
+            case rjson_num:
+                printf("%s: %g\n", paths[rjson_cur_path(&c)],
+                    rjson_cur_num(&c));
+                break;
+            default:
+                printf("%s: %i\n", paths[rjson_cur_path(&c)],
+                    (int) rjson_cur_ty(&c));
+                break;
+            };
+        }
+    }
+
+    /* what a long poll gets when nothing happened, with paths and without */
+    {
+        const char * idle_str = "{\"ok\":true,\"result\":[]}";
+        size_t len = strlen(idle_str) + 1;
+        int is_paths;
+
+        for (is_paths = 0; is_paths < 2; is_paths++) {
+            size_t off = 0;
+            int id;
+            enum rjson_next_res res = rjson_next_ok;
+
+            rjson_init(&c, str_buf, str_buf_mlen_);
+            if (is_paths && rjson_add_path(&c, "result[].update_id", &id)
+                != rjson_path_ok)
+            {
+                return 1;
+            }
+            while (off < len && res == rjson_next_ok) {
+                size_t used;
+                res = rjson_feed(&c, idle_str + off, len - off, &used);
+                off += used;
+            }
+            if (res != rjson_next_fin) {
+                fprintf(stderr, "idle poll syntax error @ %lu\n",
+                    rjson_pos(&c));
+                return 1;
+            }
+        }
+        printf("idle poll: fin\n");
+    }
+
+    /* a name as telegram sends it, with \uXXXX, and the same in utf-8 */
+    {
+        const char * utf8 = "\xd0\x9f\xd1\x91\xd1\x82\xd1\x80"
+            " \xf0\x9f\x98\x80";
+        const char * esc_str = "{\"a\": \"\\u041f\\u0451\\u0442\\u0440"
+            " \\ud83d\\ude00\"}";
+        const char * raw_str = "{\"a\": \"\xd0\x9f\xd1\x91\xd1\x82\xd1\x80"
+            " \xf0\x9f\x98\x80\"}";
+        const char * bad_strs[] = {"{\"a\": \"\\ud83d\"}",
+            "{\"a\": \"\\ude00\"}", "{\"a\": \"\\ud83dx\"}",
+            "{\"a\": \"\\ud83d\\n\"}", "{\"a\": \"\\ud83d\\ud83d\"}",
+            "{\"a\": \"\\u00\"}", "{\"a\": \"\\u0000\"}",
+            "{\"a\": \"\\u00g0\"}"};
+        const char * s;
+        size_t toks_len;
+        size_t k;
+
+        for (k = 0; k < 2; k++) {
+            const char * json = (k == 0) ? esc_str : raw_str;
+            s = feed_str_(&c, json, str_buf, str_buf_mlen_);
+            if (s == NULL || strcmp(s, utf8) != 0
+                || tape_(json, &toks_len) != rjson_tape_ok
+                || rjson_tok_str(json, &tape_toks_[2], str_buf,
+                    str_buf_mlen_) != rjson_tok_str_ok
+                || strcmp(str_buf, utf8) != 0)
+            {
+                fprintf(stderr, "utf-8 differs in %s\n", json);
+                return 1;
+            }
+        }
+        for (k = 0; k < sizeof(bad_strs) / sizeof(bad_strs[0]); k++) {
+            if (feed_str_(&c, bad_strs[k], str_buf, str_buf_mlen_) != NULL
+                || tape_(bad_strs[k], &toks_len) != rjson_tape_fail_syntax)
+            {
+                fprintf(stderr, "%s is taken\n", bad_strs[k]);
+                return 1;
+            }
+        }
+        printf("utf-8: '%s'\n", utf8);
+    }
+
+    /* ids past 2^53 stay exact */
+    {
+        const char * ids_str = "{\"chat_id\": 18446744073709551615,"
+            " \"update_id\": -9223372036854775808,"
+            " \"over\": 18446744073709551616, \"zero\": 0,"
+            " \"value\": 100.10, \"tiny\": 5e-324, \"long\": "
+            "0.1000000000000000055511151231257827021181583404541015625}";
+        size_t len = strlen(ids_str) + 1;
+        size_t off = 0;
+        enum rjson_next_res res = rjson_next_ok;
+
+        rjson_init(&c, str_buf, str_buf_mlen_);
+        while (off < len && res == rjson_next_ok) {
+            size_t used;
+            unsigned long long u;
+            long long s;
+            res = rjson_feed(&c, ids_str + off, len - off, &used);
+            off += used;
+            if (res == rjson_next_syntax) {
+                fprintf(stderr, "ids syntax error @ %lu\n", rjson_pos(&c));
+                return 1;
+            }
+            if (rjson_cur_ty(&c) != rjson_num) {
+                continue;
+            }
+            if (rjson_cur_u64(&c, &u) == rjson_int_ok) {
+                printf("u64: %llu\n", u);
+            } else if (rjson_cur_i64(&c, &s) == rjson_int_ok) {
+                printf("i64: %lli\n", s);
+            } else {
+                printf("num: %.17g\n", rjson_cur_num(&c));
+            }
+        }
+    }
+
+    /* rjson_tape gives the tokens of rjson_next, with strs in place */
+    {
+        const char * tape_str = "{\"ok\":true,\"result\":[{\"update_id\":"
+            "18446744073709551615,\"message\":{\"text\":\"/start "
+            "\\\"x\\\\\\\"\",\"chat\":{\"id\":-100123,\"type\":\"group\"},"
+            "\"photo\":[ 0.5 , null,false ]}}],\n\"description\":"
+            "\"a str longer than a 64 char block to find '\\\"' of, \\\\\"}";
+        size_t len = strlen(tape_str);
+        size_t idx[256];
+        struct rjson_tok toks[256];
+        size_t toks_len;
+        char tok_buf[str_buf_mlen_];
+        size_t off = 0;
+        size_t j;
+
+        if (rjson_tape(tape_str, len, idx, 256, toks, 256, &toks_len)
+            != rjson_tape_ok)
+        {
+            fprintf(stderr, "tape syntax error\n");
+            return 1;
+        }
+        rjson_init(&c, str_buf, str_buf_mlen_);
+        for (j = 0; j < toks_len; j++) {
+            const struct rjson_tok * t = &toks[j];
+            unsigned long long u = 0;
+            unsigned long long v = 0;
+            enum rjson_next_res res;
+            do {
+                size_t used;
+                res = rjson_feed(&c, tape_str + off, len + 1 - off, &used);
+                off += used;
+            } while (res == rjson_next_ok
+                && rjson_cur_ty(&c) == rjson_incomplete);
+            if (res == rjson_next_syntax || rjson_cur_ty(&c) != t->ty
+                || (t->ty == rjson_str
+                    && (rjson_tok_str(tape_str, t, tok_buf, str_buf_mlen_)
+                        != rjson_tok_str_ok
+                    || strcmp(tok_buf, rjson_cur_str(&c)) != 0))
+                || (t->ty == rjson_num
+                    && (rjson_tok_num(tape_str, t) != rjson_cur_num(&c)
+                    || rjson_tok_u64(tape_str, t, &u)
+                        != rjson_cur_u64(&c, &v) || u != v))
+                || (t->ty == rjson_bool && rjson_tok_is_true(tape_str, t)
+                    != rjson_cur_is_true(&c))
+                || ((t->ty == rjson_obj_start || t->ty == rjson_arr_start)
+                    && toks[j + t->len].ty != t->ty + 1))
+            {
+                fprintf(stderr, "tape differs @ tok %lu\n", j);
+                return 1;
+            }
+            if (t->ty == rjson_str && ! t->is_escaped) {
+                printf("tape str: '%.*s'\n", (int) t->len, tape_str + t->off);
+            }
+        }
+        printf("tape: %lu tokens, same as rjson_feed\n", toks_len);
+
+        if (tape_("{\"a\": [], \"b\": {}}", &toks_len) != rjson_tape_ok
+            || toks_len != 8
+            || tape_("{\"a\": 1 2}", &toks_len) != rjson_tape_fail_syntax
+            || tape_("{\"a\": \"\\u0041\"}", &toks_len) != rjson_tape_ok
+            || tape_("{\"a\": \"\\u004\"}", &toks_len)
+                != rjson_tape_fail_syntax
+            || tape_("{\"a\": \"b}", &toks_len) != rjson_tape_fail_syntax
+            || tape_("{\"a\": [1, ]}", &toks_len) != rjson_tape_fail_syntax
+            || tape_("{\"a\": 1} x", &toks_len) != rjson_tape_fail_syntax)
+        {
+            fprintf(stderr, "tape takes a bad json or not a good one\n");
+            return 1;
+        }
+    }
 
     return 0;
 }
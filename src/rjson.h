@@ -19,6 +19,13 @@ enum rjson_ty {
 
 struct rjson_ctx;
 
+/* for allocating a ctx where struct rjson_ctx is not visible */
+size_t rjson_ctx_sizeof(void);
+
+/* strs go to str_out_buf as utf-8: their chars >= 128 are copied, with
+ * no check that they are utf-8, and each \uXXXX, or two of them for a
+ * surrogate pair, is made utf-8. \u0000 is a syntax error, as the strs
+ * end with '\0' */
 void rjson_init(struct rjson_ctx * c, char * str_out_buf, size_t str_mlen);
 
 enum rjson_next_res {
@@ -27,12 +34,89 @@ enum rjson_next_res {
     rjson_next_ok = 1
 } rjson_next(struct rjson_ctx * c, char next_char);
 
+/* like rjson_next for each char of buf in turn, up to and including the
+ * first one that completes a token, ends the json or is a syntax error.
+ * *used_out is how many chars were taken, the rest is for the next call.
+ * the chars of strs and the whitespace between tokens are scanned many
+ * at a time */
+enum rjson_next_res rjson_feed(struct rjson_ctx * c,
+    const char * buf, size_t len, size_t * used_out);
+
+/* after rjson_init, only the values at the paths added are reported, with
+ * the id of the path. a path is keys from the top-level obj split by '.',
+ * where key[] is any element of the arr at key, like
+ * "result[].message.chat.id". an obj or arr at a path is reported by its
+ * start and end only, and its values if they are at paths too. keys are
+ * not reported, and the values at no path are skipped with no checks
+ * and no copy to str_out_buf. ids go up from 0 */
+enum {
+    rjson_paths_maxlen = 16
+};
+enum rjson_path_res {
+    rjson_path_fail_too_many = -2, /* or the paths are too long in all */
+    rjson_path_fail_syntax = -1,
+    rjson_path_ok = 1
+} rjson_add_path(struct rjson_ctx * c, const char * path, int * id_out);
+
+/* of the path of the current token; -1 if there are no paths */
+int rjson_cur_path(const struct rjson_ctx * c);
+
 size_t rjson_pos(const struct rjson_ctx * c);
 
 enum rjson_ty rjson_cur_ty(const struct rjson_ctx * c);
 const char * rjson_cur_str(const struct rjson_ctx * c);
+/* the double nearest to a rjson_num, however long it is */
 double rjson_cur_num(const struct rjson_ctx * c);
+
+/* for rjson_num; exact, if it has no fraction and no exponent, like ids */
+enum rjson_int_res {
+    rjson_int_fail_not_int = -2,
+    rjson_int_fail_overflow = -1, /* or negative for rjson_cur_u64 */
+    rjson_int_ok = 1
+};
+enum rjson_int_res rjson_cur_u64(const struct rjson_ctx * c,
+    unsigned long long * num_out);
+enum rjson_int_res rjson_cur_i64(const struct rjson_ctx * c,
+    long long * num_out);
 int rjson_cur_is_true(const struct rjson_ctx * c);
 
+/* a token of rjson_tape; the same ones rjson_next gives, keys included */
+struct rjson_tok {
+    enum rjson_ty ty;
+    /* for a str, its chars between the '"'; for a num, a bool or null,
+     * its text; for an obj or arr start, the '{' or '[' and how many
+     * toks on its end is; for an end, the '}' or ']' and 1 */
+    size_t off;
+    size_t len;
+    int is_escaped; /* for a str; see rjson_tok_str */
+};
+
+/* for a json that is all in buf, with no '\0' at the end: a pass finds
+ * where the '{', '[', '"' and so on are with SIMD, and puts them in idx,
+ * and another one makes toks of them, with no copy of the strs. len
+ * entries are always enough for each of idx and toks */
+enum rjson_tape_res {
+    rjson_tape_fail_no_mem = -2, /* idx or toks are too short */
+    rjson_tape_fail_syntax = -1,
+    rjson_tape_ok = 1
+} rjson_tape(const char * buf, size_t len, size_t * idx, size_t idx_mlen,
+    struct rjson_tok * toks, size_t toks_mlen, size_t * toks_len_out);
+
+/* a str of rjson_tape with its escapes undone as rjson_next does, and a
+ * '\0' after it */
+enum rjson_tok_str_res {
+    rjson_tok_str_fail_overflow = -1,
+    rjson_tok_str_ok = 1
+} rjson_tok_str(const char * buf, const struct rjson_tok * t,
+    char * str_out, size_t str_mlen);
+
+/* like rjson_cur_num and so on, for toks of rjson_tape */
+double rjson_tok_num(const char * buf, const struct rjson_tok * t);
+enum rjson_int_res rjson_tok_u64(const char * buf, const struct rjson_tok * t,
+    unsigned long long * num_out);
+enum rjson_int_res rjson_tok_i64(const char * buf, const struct rjson_tok * t,
+    long long * num_out);
+int rjson_tok_is_true(const char * buf, const struct rjson_tok * t);
+
 #endif /* SOB_RJSON_H_SENTRY */
 
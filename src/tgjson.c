@@ -0,0 +1,410 @@
+#include "tgjson.h"
+
+#include <string.h>
+
+enum {
+    slots_len_ = 16, /* a power of 2 */
+    frames_len_ = 8 /* resp, result, update, callback_query, message, user */
+};
+
+/* no two keys of one obj share a slot with it, see SOB_TGJSON_SLOTS_.
+ * XXX: over the chars of a str literal it is not a constant in ISO C; gcc
+ * folds it in static initializers, so the slots are made by the compiler,
+ * but not in array sizes or case labels */
+#define SOB_TGJSON_HASH_(len, first, last) \
+    (((len) + (unsigned char) (first) * 6 + (unsigned char) (last)) \
+        % slots_len_)
+
+enum kind_ {
+    kind_i64_,
+    kind_bool_,
+    kind_str_,
+    kind_obj_,
+    kind_each_
+};
+
+struct schema_;
+
+struct field_ {
+    const char * key;
+    size_t key_len;
+    enum kind_ kind;
+    size_t off; /* in the struct */
+    size_t mlen; /* of a str */
+    const struct schema_ * sub; /* of an obj or each */
+};
+
+struct schema_ {
+    const struct field_ * fields;
+    size_t fields_len;
+    unsigned char slots[slots_len_]; /* 1 + the index in fields, or 0 */
+};
+
+struct frame_ {
+    const struct schema_ * s;
+    char * at; /* the struct */
+    int is_each; /* an arr of s, with no struct of its own */
+};
+
+struct tgjson_ctx {
+    struct tgjson_resp * resp;
+    struct tgjson_update * upd;
+
+    struct frame_ frames[frames_len_];
+    size_t frames_len;
+    const struct field_ * val; /* of the last key, NULL if not known */
+    int is_key_next;
+    size_t skip_depth; /* in a value of a key that is not known */
+};
+
+/* undef at the bottom */
+#define SOB_TGJSON_OFF_i64_(obj, key) offsetof(struct tgjson_##obj, key)
+#define SOB_TGJSON_OFF_bool_(obj, key) offsetof(struct tgjson_##obj, key)
+#define SOB_TGJSON_OFF_str_(obj, key) offsetof(struct tgjson_##obj, key)
+#define SOB_TGJSON_OFF_obj_(obj, key) offsetof(struct tgjson_##obj, key)
+#define SOB_TGJSON_OFF_each_(obj, key) 0
+#define SOB_TGJSON_MLEN_i64_(arg) 0
+#define SOB_TGJSON_MLEN_bool_(arg) 0
+#define SOB_TGJSON_MLEN_str_(arg) (arg)
+#define SOB_TGJSON_MLEN_obj_(arg) 0
+#define SOB_TGJSON_MLEN_each_(arg) 0
+#define SOB_TGJSON_SUB_i64_(arg) NULL
+#define SOB_TGJSON_SUB_bool_(arg) NULL
+#define SOB_TGJSON_SUB_str_(arg) NULL
+#define SOB_TGJSON_SUB_obj_(arg) &arg##_schema_
+#define SOB_TGJSON_SUB_each_(arg) &arg##_schema_
+
+#define SOB_TGJSON_DESC_(ctx, obj, key, kind, arg) \
+    { \
+        #key, sizeof(#key) - 1, kind_##kind##_, \
+        SOB_TGJSON_OFF_##kind##_(obj, key), \
+        SOB_TGJSON_MLEN_##kind##_(arg), \
+        SOB_TGJSON_SUB_##kind##_(arg) \
+    },
+#define SOB_TGJSON_IS_AT_(slot, key) \
+    (SOB_TGJSON_HASH_(sizeof(#key) - 1, #key[0], #key[sizeof(#key) - 2]) \
+        == (slot))
+#define SOB_TGJSON_SLOT_(slot, obj, key, kind, arg) \
+    + (SOB_TGJSON_IS_AT_(slot, key) ? tgjson_##obj##_##key + 1 : 0)
+#define SOB_TGJSON_COUNT_(slot, obj, key, kind, arg) \
+    + SOB_TGJSON_IS_AT_(slot, key)
+/* 1 + the index of the key at slot; two keys there divide by 0, which
+ * fails the build. it is not a negative array size, as that needs the
+ * hash to be an integer constant */
+#define SOB_TGJSON_SLOTS_(X, slot) \
+    (0 X(SOB_TGJSON_SLOT_, slot)) / ((0 X(SOB_TGJSON_COUNT_, slot)) <= 1)
+#define SOB_TGJSON_SCHEMA_(obj, X) \
+    static const struct field_ obj##_fields_[] = { \
+        X(SOB_TGJSON_DESC_, 0) \
+    }; \
+    static const struct schema_ obj##_schema_ = { \
+        obj##_fields_, \
+        sizeof(obj##_fields_) / sizeof(obj##_fields_[0]), \
+        { \
+            SOB_TGJSON_SLOTS_(X, 0), SOB_TGJSON_SLOTS_(X, 1), \
+            SOB_TGJSON_SLOTS_(X, 2), SOB_TGJSON_SLOTS_(X, 3), \
+            SOB_TGJSON_SLOTS_(X, 4), SOB_TGJSON_SLOTS_(X, 5), \
+            SOB_TGJSON_SLOTS_(X, 6), SOB_TGJSON_SLOTS_(X, 7), \
+            SOB_TGJSON_SLOTS_(X, 8), SOB_TGJSON_SLOTS_(X, 9), \
+            SOB_TGJSON_SLOTS_(X, 10), SOB_TGJSON_SLOTS_(X, 11), \
+            SOB_TGJSON_SLOTS_(X, 12), SOB_TGJSON_SLOTS_(X, 13), \
+            SOB_TGJSON_SLOTS_(X, 14), SOB_TGJSON_SLOTS_(X, 15) \
+        } \
+    };
+
+/* the ones an obj has go before it */
+SOB_TGJSON_SCHEMA_(user, SOB_TGJSON_USER)
+SOB_TGJSON_SCHEMA_(chat, SOB_TGJSON_CHAT)
+SOB_TGJSON_SCHEMA_(message, SOB_TGJSON_MESSAGE)
+SOB_TGJSON_SCHEMA_(callback_query, SOB_TGJSON_CALLBACK_QUERY)
+SOB_TGJSON_SCHEMA_(update, SOB_TGJSON_UPDATE)
+SOB_TGJSON_SCHEMA_(resp, SOB_TGJSON_RESP)
+
+#undef SOB_TGJSON_OFF_i64_
+#undef SOB_TGJSON_OFF_bool_
+#undef SOB_TGJSON_OFF_str_
+#undef SOB_TGJSON_OFF_obj_
+#undef SOB_TGJSON_OFF_each_
+#undef SOB_TGJSON_MLEN_i64_
+#undef SOB_TGJSON_MLEN_bool_
+#undef SOB_TGJSON_MLEN_str_
+#undef SOB_TGJSON_MLEN_obj_
+#undef SOB_TGJSON_MLEN_each_
+#undef SOB_TGJSON_SUB_i64_
+#undef SOB_TGJSON_SUB_bool_
+#undef SOB_TGJSON_SUB_str_
+#undef SOB_TGJSON_SUB_obj_
+#undef SOB_TGJSON_SUB_each_
+#undef SOB_TGJSON_DESC_
+#undef SOB_TGJSON_IS_AT_
+#undef SOB_TGJSON_SLOT_
+#undef SOB_TGJSON_COUNT_
+#undef SOB_TGJSON_SLOTS_
+#undef SOB_TGJSON_SCHEMA_
+
+static const struct field_ * find_field_(const struct schema_ * s,
+    const char * key);
+static int push_(struct tgjson_ctx * c, const struct schema_ * s, char * at,
+    int is_each);
+static enum tgjson_tok_res val_(struct tgjson_ctx * c,
+    const struct rjson_ctx * json, enum rjson_ty ty);
+
+size_t tgjson_ctx_sizeof(void)
+{
+    return sizeof(struct tgjson_ctx);
+}
+
+void tgjson_init(struct tgjson_ctx * c, struct tgjson_resp * resp_out,
+    struct tgjson_update * upd_out)
+{
+    c->resp = resp_out;
+    c->upd = upd_out;
+    c->frames_len = 0;
+    c->val = NULL;
+    c->is_key_next = 0;
+    c->skip_depth = 0;
+}
+
+enum tgjson_tok_res tgjson_tok(struct tgjson_ctx * c,
+    const struct rjson_ctx * json)
+{
+    enum rjson_ty ty = rjson_cur_ty(json);
+    const struct frame_ * f;
+
+    if (ty == rjson_incomplete) {
+        return tgjson_tok_ok;
+    } else if (c->skip_depth > 0) {
+        if (ty == rjson_obj_start || ty == rjson_arr_start) {
+            c->skip_depth++;
+        } else if (ty == rjson_obj_end || ty == rjson_arr_end) {
+            c->skip_depth--;
+        }
+        return tgjson_tok_ok;
+    } else if (c->frames_len == 0) {
+        if (ty != rjson_obj_start
+            || ! push_(c, &resp_schema_, (char *) c->resp, 0))
+        {
+            return tgjson_tok_fail_schema;
+        }
+        return tgjson_tok_ok;
+    }
+
+    f = &c->frames[c->frames_len - 1];
+    if (f->is_each) {
+        if (ty == rjson_obj_start && push_(c, f->s, (char *) c->upd, 0)) {
+            return tgjson_tok_ok;
+        } else if (ty == rjson_arr_end) {
+            c->frames_len--;
+            return tgjson_tok_ok;
+        }
+        return tgjson_tok_fail_schema;
+    } else if (c->is_key_next) {
+        if (ty == rjson_str) {
+            c->val = find_field_(f->s, rjson_cur_str(json));
+            c->is_key_next = 0;
+            return tgjson_tok_ok;
+        } else if (ty == rjson_obj_end) {
+            c->frames_len--;
+            /* an obj right in an arr is an update of the result */
+            return (c->frames_len > 0 && c->frames[c->frames_len - 1].is_each)
+                ? tgjson_tok_update : tgjson_tok_ok;
+        }
+        return tgjson_tok_fail_schema;
+    }
+    c->is_key_next = 1;
+    return val_(c, json, ty);
+}
+
+/* one memcmp at most, for the slot of the key */
+static const struct field_ * find_field_(const struct schema_ * s,
+    const char * key)
+{
+    size_t len = strlen(key);
+    size_t i;
+    if (len == 0) {
+        return NULL;
+    }
+    i = s->slots[SOB_TGJSON_HASH_(len, key[0], key[len - 1])];
+    if (i == 0 || i > s->fields_len || s->fields[i - 1].key_len != len
+        || memcmp(s->fields[i - 1].key, key, len) != 0)
+    {
+        return NULL;
+    }
+    return &s->fields[i - 1];
+}
+
+/* at is NULL for an each */
+static int push_(struct tgjson_ctx * c, const struct schema_ * s, char * at,
+    int is_each)
+{
+    struct frame_ * f;
+    if (c->frames_len == frames_len_) {
+        return 0;
+    }
+    f = &c->frames[c->frames_len];
+    f->s = s;
+    f->at = at;
+    f->is_each = is_each;
+    c->frames_len++;
+    c->is_key_next = 1;
+    if (at != NULL) {
+        /* the fields are left as they were, the bits tell which are new */
+        unsigned int * has = (unsigned int *) at;
+        has[0] = 0;
+        has[1] = 0;
+    }
+    return 1;
+}
+
+/* of the last key, in the obj on top */
+static enum tgjson_tok_res val_(struct tgjson_ctx * c,
+    const struct rjson_ctx * json, enum rjson_ty ty)
+{
+    const struct frame_ * f = &c->frames[c->frames_len - 1];
+    const struct field_ * d = c->val;
+    unsigned int bit;
+    char * at;
+
+    if (d == NULL || ty == rjson_null) {
+        if (ty == rjson_obj_start || ty == rjson_arr_start) {
+            c->skip_depth = 1;
+        }
+        return tgjson_tok_ok;
+    }
+    bit = 1u << (d - f->s->fields);
+    at = f->at + d->off;
+
+    switch (d->kind) {
+    case kind_i64_:
+        if (ty != rjson_num
+            || rjson_cur_i64(json, (long long *) at) != rjson_int_ok)
+        {
+            return tgjson_tok_fail_schema;
+        }
+        break;
+    case kind_bool_:
+        if (ty != rjson_bool) {
+            return tgjson_tok_fail_schema;
+        }
+        *(int *) at = rjson_cur_is_true(json);
+        break;
+    case kind_str_:
+        {
+            const char * str;
+            size_t len;
+            if (ty != rjson_str) {
+                return tgjson_tok_fail_schema;
+            }
+            str = rjson_cur_str(json);
+            len = strlen(str);
+            if (len >= d->mlen) {
+                len = d->mlen - 1;
+                /* not in the middle of a char of utf-8 */
+                while (len > 0 && ((unsigned char) str[len] & 0xc0) == 0x80) {
+                    len--;
+                }
+                ((unsigned int *) f->at)[1] |= bit;
+            }
+            memcpy(at, str, len);
+            at[len] = '\0';
+        }
+        break;
+    case kind_obj_:
+        if (ty != rjson_obj_start || ! push_(c, d->sub, at, 0)) {
+            return tgjson_tok_fail_schema;
+        }
+        break;
+    case kind_each_:
+        if (ty != rjson_arr_start || ! push_(c, d->sub, NULL, 1)) {
+            return tgjson_tok_fail_schema;
+        }
+        break;
+    };
+    /* f is still the obj of the key after a push_ */
+    *(unsigned int *) f->at |= bit;
+    return tgjson_tok_ok;
+}
+
+#ifdef SOB_TGJSON_DEMO
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void)
+{
+    const char * upd_str = "{\"ok\":true,\"result\":[{\"update_id\":"
+        "9007199254740993,\"message\":{\"message_id\":5,\"from\":{\"id\":"
+        "505249189,\"is_bot\":false,\"first_name\":\"A\",\"username\":"
+        "\"a_b\",\"language_code\":\"ru\"},\"chat\":{\"id\":505249189,"
+        "\"first_name\":\"A\",\"username\":\"a_b\",\"type\":\"private\"},"
+        "\"date\":1700000000,\"text\":\"/start\",\"entities\":[{\"offset\""
+        ":0,\"length\":6,\"type\":\"bot_command\"}]}},{\"update_id\":"
+        "9007199254740994,\"callback_query\":{\"id\":\"4382\",\"from\":{"
+        "\"id\":1,\"is_bot\":false,\"first_name\":\"\\u0411\"},\"message\":{"
+        "\"message_id\":6,\"chat\":{\"id\":-100123,\"title\":\"g\","
+        "\"type\":\"group\"},\"date\":1700000001,\"text\":\"pick\","
+        "\"reply_markup\":{\"inline_keyboard\":[[{\"text\":\"1\","
+        "\"callback_data\":\"pay:1\"}]]}},\"chat_instance\":\"-77\","
+        "\"data\":\"data longer than the 64 bytes that Telegram allows for "
+        "it, so it is cut\"}}]}";
+    static struct tgjson_resp resp;
+    static struct tgjson_update upd;
+    static char str_buf[tgjson_text_mlen];
+    struct rjson_ctx * json = malloc(rjson_ctx_sizeof());
+    struct tgjson_ctx * c = malloc(tgjson_ctx_sizeof());
+    size_t len = strlen(upd_str) + 1;
+    size_t off = 0;
+    int upds = 0;
+
+    rjson_init(json, str_buf, tgjson_text_mlen);
+    tgjson_init(c, &resp, &upd);
+    while (off < len) {
+        size_t used;
+        enum rjson_next_res r = rjson_feed(json, upd_str + off, len - off,
+            &used);
+        enum tgjson_tok_res t;
+        off += used;
+        if (r == rjson_next_syntax) {
+            fprintf(stderr, "syntax error @ %lu\n", rjson_pos(json));
+            return 1;
+        }
+        t = tgjson_tok(c, json);
+        if (t == tgjson_tok_fail_schema) {
+            fprintf(stderr, "schema error @ %lu\n", rjson_pos(json));
+            return 1;
+        } else if (t == tgjson_tok_update) {
+            upds++;
+            printf("update %lli\n", upd.update_id);
+            if (SOB_TGJSON_HAS(&upd, update, message)) {
+                const struct tgjson_message * m = &upd.message;
+                printf("  message %lli in %s chat %lli from @%s (%s): '%s'\n",
+                    m->message_id, m->chat.type, m->chat.id,
+                    m->from.username, m->from.language_code, m->text);
+            }
+            if (SOB_TGJSON_HAS(&upd, update, callback_query)) {
+                const struct tgjson_callback_query * q = &upd.callback_query;
+                printf("  callback %s from %s on message %lli%s: '%s'%s\n",
+                    q->id, q->from.first_name, q->message.message_id,
+                    SOB_TGJSON_HAS(&q->from, user, username)
+                        ? " with a username" : "",
+                    q->data,
+                    SOB_TGJSON_IS_TRUNC(q, callback_query, data)
+                        ? " (cut)" : "");
+            }
+        }
+        if (r == rjson_next_fin) {
+            break;
+        }
+    }
+    if (upds != 2 || ! SOB_TGJSON_HAS(&resp, resp, ok) || ! resp.ok) {
+        fprintf(stderr, "%i updates of 2\n", upds);
+        return 1;
+    }
+    printf("ok\n");
+
+    free(c);
+    free(json);
+    return 0;
+}
+
+#endif /* SOB_TGJSON_DEMO */
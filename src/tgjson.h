@@ -0,0 +1,151 @@
+#ifndef SOB_TGJSON_H_SENTRY
+#define SOB_TGJSON_H_SENTRY
+
+#include <stddef.h> /* for size_t */
+
+#include "rjson.h"
+
+/* objs of the Telegram Bot API, decoded from the tokens of rjson right
+ * into these structs. keys that are not here are skipped with their
+ * values. strs are utf-8, with the \uXXXX of telegram undone by rjson, and
+ * a str that is cut ends on a whole char */
+
+enum {
+    tgjson_name_mlen = 257, /* 64 chars of up to 4 bytes, and '\0' */
+    tgjson_title_mlen = 513,
+    tgjson_text_mlen = 16385, /* the str_mlen for rjson_init too */
+    tgjson_short_mlen = 65, /* usernames, ids and data of callbacks */
+    tgjson_code_mlen = 17,
+    tgjson_desc_mlen = 257
+};
+
+/* X(ctx, obj, key, kind, arg) for each field of an obj. kind is i64, bool,
+ * str (arg is its mlen), obj (arg is the tgjson_ struct) or each (an arr
+ * of arg, each given on its own by tgjson_tok). ctx is passed to X */
+#define SOB_TGJSON_USER(X, ctx) \
+    X(ctx, user, id, i64, 0) \
+    X(ctx, user, is_bot, bool, 0) \
+    X(ctx, user, first_name, str, tgjson_name_mlen) \
+    X(ctx, user, last_name, str, tgjson_name_mlen) \
+    X(ctx, user, username, str, tgjson_short_mlen) \
+    X(ctx, user, language_code, str, tgjson_code_mlen)
+#define SOB_TGJSON_CHAT(X, ctx) \
+    X(ctx, chat, id, i64, 0) \
+    X(ctx, chat, type, str, tgjson_code_mlen) \
+    X(ctx, chat, title, str, tgjson_title_mlen) \
+    X(ctx, chat, username, str, tgjson_short_mlen) \
+    X(ctx, chat, first_name, str, tgjson_name_mlen) \
+    X(ctx, chat, last_name, str, tgjson_name_mlen)
+#define SOB_TGJSON_MESSAGE(X, ctx) \
+    X(ctx, message, message_id, i64, 0) \
+    X(ctx, message, date, i64, 0) \
+    X(ctx, message, from, obj, user) \
+    X(ctx, message, chat, obj, chat) \
+    X(ctx, message, text, str, tgjson_text_mlen)
+#define SOB_TGJSON_CALLBACK_QUERY(X, ctx) \
+    X(ctx, callback_query, id, str, tgjson_short_mlen) \
+    X(ctx, callback_query, from, obj, user) \
+    X(ctx, callback_query, message, obj, message) \
+    X(ctx, callback_query, inline_message_id, str, tgjson_short_mlen) \
+    X(ctx, callback_query, chat_instance, str, tgjson_short_mlen) \
+    X(ctx, callback_query, data, str, tgjson_short_mlen)
+#define SOB_TGJSON_UPDATE(X, ctx) \
+    X(ctx, update, update_id, i64, 0) \
+    X(ctx, update, message, obj, message) \
+    X(ctx, update, callback_query, obj, callback_query)
+/* what a method like getUpdates returns */
+#define SOB_TGJSON_RESP(X, ctx) \
+    X(ctx, resp, ok, bool, 0) \
+    X(ctx, resp, error_code, i64, 0) \
+    X(ctx, resp, description, str, tgjson_desc_mlen) \
+    X(ctx, resp, result, each, update)
+
+/* undef at the bottom */
+#define SOB_TGJSON_BIT_(ctx, obj, key, kind, arg) tgjson_##obj##_##key,
+#define SOB_TGJSON_FIELD_(ctx, obj, key, kind, arg) \
+    SOB_TGJSON_FIELD_##kind##_(key, arg)
+#define SOB_TGJSON_FIELD_i64_(key, arg) long long key;
+#define SOB_TGJSON_FIELD_bool_(key, arg) int key;
+#define SOB_TGJSON_FIELD_str_(key, arg) char key[arg];
+#define SOB_TGJSON_FIELD_obj_(key, arg) struct tgjson_##arg key;
+#define SOB_TGJSON_FIELD_each_(key, arg)
+
+/* has and is_trunc are by the bits of these; a field is set only if its
+ * bit in has is */
+enum tgjson_user_bit { SOB_TGJSON_USER(SOB_TGJSON_BIT_, 0) };
+enum tgjson_chat_bit { SOB_TGJSON_CHAT(SOB_TGJSON_BIT_, 0) };
+enum tgjson_message_bit { SOB_TGJSON_MESSAGE(SOB_TGJSON_BIT_, 0) };
+enum tgjson_callback_query_bit {
+    SOB_TGJSON_CALLBACK_QUERY(SOB_TGJSON_BIT_, 0)
+};
+enum tgjson_update_bit { SOB_TGJSON_UPDATE(SOB_TGJSON_BIT_, 0) };
+enum tgjson_resp_bit { SOB_TGJSON_RESP(SOB_TGJSON_BIT_, 0) };
+
+#define SOB_TGJSON_HAS(o, obj, key) (((o)->has >> tgjson_##obj##_##key) & 1)
+#define SOB_TGJSON_IS_TRUNC(o, obj, key) \
+    (((o)->is_trunc >> tgjson_##obj##_##key) & 1)
+
+/* has and is_trunc go first in each of them */
+struct tgjson_user {
+    unsigned int has;
+    unsigned int is_trunc; /* strs longer than their mlen are cut */
+    SOB_TGJSON_USER(SOB_TGJSON_FIELD_, 0)
+};
+
+struct tgjson_chat {
+    unsigned int has;
+    unsigned int is_trunc;
+    SOB_TGJSON_CHAT(SOB_TGJSON_FIELD_, 0)
+};
+
+struct tgjson_message {
+    unsigned int has;
+    unsigned int is_trunc;
+    SOB_TGJSON_MESSAGE(SOB_TGJSON_FIELD_, 0)
+};
+
+struct tgjson_callback_query {
+    unsigned int has;
+    unsigned int is_trunc;
+    SOB_TGJSON_CALLBACK_QUERY(SOB_TGJSON_FIELD_, 0)
+};
+
+struct tgjson_update {
+    unsigned int has;
+    unsigned int is_trunc;
+    SOB_TGJSON_UPDATE(SOB_TGJSON_FIELD_, 0)
+};
+
+struct tgjson_resp {
+    unsigned int has;
+    unsigned int is_trunc;
+    SOB_TGJSON_RESP(SOB_TGJSON_FIELD_, 0)
+};
+
+#undef SOB_TGJSON_BIT_
+#undef SOB_TGJSON_FIELD_
+#undef SOB_TGJSON_FIELD_i64_
+#undef SOB_TGJSON_FIELD_bool_
+#undef SOB_TGJSON_FIELD_str_
+#undef SOB_TGJSON_FIELD_obj_
+#undef SOB_TGJSON_FIELD_each_
+
+struct tgjson_ctx;
+
+size_t tgjson_ctx_sizeof(void);
+
+/* for one response; the updates of its result go to upd_out one by one */
+void tgjson_init(struct tgjson_ctx * c, struct tgjson_resp * resp_out,
+    struct tgjson_update * upd_out);
+
+enum tgjson_tok_res {
+    tgjson_tok_fail_schema = -1, /* a value is not of the kind of its key */
+    tgjson_tok_ok = 1,
+    tgjson_tok_update = 2 /* upd_out is whole until the next token */
+};
+
+/* for each token of json, like from https_json_cb */
+enum tgjson_tok_res tgjson_tok(struct tgjson_ctx * c,
+    const struct rjson_ctx * json);
+
+#endif /* SOB_TGJSON_H_SENTRY */
@@ -47,8 +47,16 @@ struct wjson_ctx {
     enum st_ st;
     int need_comma;
     int is_first;
+
+    wjson_flush_cb flush_cb; /* NULL unless wjson_set_flush */
+    void * flush_user;
 };
 
+size_t wjson_ctx_sizeof(void)
+{
+    return sizeof(struct wjson_ctx);
+}
+
 void wjson_init(struct wjson_ctx * c, char * out_str, size_t out_str_max_len,
     int is_pretty)
 {
@@ -57,8 +65,13 @@ void wjson_init(struct wjson_ctx * c, char * out_str, size_t out_str_max_len,
     c->mlen = out_str_max_len;
     c->len = 0;
 
+    c->lvls_len = 0;
     c->st = st_none_;
     c->need_comma = 0;
+    c->is_first = 0;
+
+    c->flush_cb = NULL;
+    c->flush_user = NULL;
 
     if (c->mlen >= 1) {
         c->str[0] = '\0';
@@ -73,6 +86,21 @@ const char * wjson_out_str(const struct wjson_ctx * c)
     return c->str;
 }
 
+void wjson_set_flush(struct wjson_ctx * c, wjson_flush_cb cb, void * user)
+{
+    c->flush_cb = cb;
+    c->flush_user = user;
+}
+
+enum wjson_res wjson_flush(struct wjson_ctx * c)
+{
+    if (c->flush_cb != NULL && c->len > 0) {
+        SOB_WJSON_CHECK((*c->flush_cb)(c->str, c->len, c->flush_user));
+        c->len = 0;
+    }
+    return wjson_ok;
+}
+
 enum wjson_res wjson_str(struct wjson_ctx * c, char * str)
 {
     SOB_WJSON_CHECK(maybe_comma_(c));
@@ -262,6 +290,9 @@ enum wjson_res wjson_arr_end(struct wjson_ctx * c)
 
 static enum wjson_res add_ch_(struct wjson_ctx * c, char ch)
 {
+    if (c->len + 2 > c->mlen && c->flush_cb != NULL && c->len > 0) {
+        SOB_WJSON_CHECK(wjson_flush(c));
+    }
     if (c->len + 2 > c->mlen) {
         return wjson_overflow;
     }
@@ -289,12 +320,13 @@ static enum wjson_res maybe_indent_(struct wjson_ctx * c)
             int i;
             for (i = 0; i < c->lvls_len; i++) {
                 int j;
-                if (c->len + indentation_ + 1 > c->mlen) {
+                if (c->flush_cb == NULL
+                    && c->len + indentation_ + 1 > c->mlen)
+                {
                     return wjson_overflow;
                 }
                 for (j = 0; j < indentation_; j++) {
-                    c->str[c->len] = ' ';
-                    c->len++;
+                    WJSON_ADD_CH_(' ');
                 }
             }
         }
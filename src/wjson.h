@@ -20,9 +20,24 @@ enum wjson_res {
     wjson_ok = 1
 };
 
+/* for allocating a ctx where struct wjson_ctx is not visible */
+size_t wjson_ctx_sizeof(void);
+
 void wjson_init(struct wjson_ctx * c, char * out_str, size_t out_str_max_len,
     int is_pretty);
 
+/* called with what was written when out_str is full, which is then
+ * reused; a result other than wjson_ok fails the write */
+typedef enum wjson_res (*wjson_flush_cb)(const char * str, size_t len,
+    void * user);
+
+/* after wjson_init; out_str then only holds what was not flushed yet and
+ * is not NUL-terminated */
+void wjson_set_flush(struct wjson_ctx * c, wjson_flush_cb cb, void * user);
+
+/* flushes the rest */
+enum wjson_res wjson_flush(struct wjson_ctx * c);
+
 const char * wjson_out_str(const struct wjson_ctx * c);
 
 enum wjson_res wjson_str(struct wjson_ctx * c, char * str);